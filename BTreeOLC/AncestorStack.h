@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+
+namespace descent {
+
+    /**
+     * Inner nodes passed on the way down with the versions they were read
+     * at, so that a failed operation can resume below the root. A node whose
+     * version is unchanged still routes keys the same way, and since nodes
+     * are never unlinked while operations run it is still in the tree. A
+     * split of a node also needs its parent, so a resume point needs an
+     * unchanged parent as well (or has to still be the root)
+     */
+    template<class Node>
+    struct AncestorStack {
+        struct Entry {
+            Node* node;
+            uint64_t version;
+            bool rightmost; // right-most node of its level
+        };
+
+        static const int maxDepth = 32;
+
+        Entry entries[maxDepth];
+        int depth = 0;
+
+        void push(Node* node, uint64_t version, bool rightmost = false) {
+            assert(depth < maxDepth);
+            entries[depth++] = Entry{node, version, rightmost};
+        }
+
+        Entry pop() { return entries[--depth]; }
+
+        Entry& top() { return entries[depth - 1]; }
+
+        bool empty() const { return depth == 0; }
+
+        bool unchanged(int i) const {
+            return entries[i].node->typeVersionLockObsolete.load() == entries[i].version;
+        }
+
+        /**
+         * Drops entries until the top one can be resumed from
+         * @return false if none is left and the operation starts at the root
+         */
+        bool trim(Node* root) {
+            while (depth > 0) {
+                int i = depth - 1;
+                if (unchanged(i) && (i > 0 ? unchanged(i - 1) : entries[0].node == root)) {
+                    return true;
+                }
+                depth--;
+            }
+            return false;
+        }
+    };
+}
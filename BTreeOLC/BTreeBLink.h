@@ -0,0 +1,562 @@
+/*
+ * Lehman-Yao B-link tree on top of the optimistic version locks of btreeolc.
+ * Every node has a high key and a link to its right sibling. A split only
+ * locks the node being split, publishes the new sibling through the link and
+ * then adds the separator to the parent as a separate step. Readers that
+ * find a key above a node's high key follow the link to the right.
+ */
+
+#pragma once
+
+#include <cassert>
+#include <cstring>
+#include <atomic>
+#include <immintrin.h>
+#include <sched.h>
+#include <iostream>
+
+#include "Timeline.h"
+#include "Trace.h"
+#include "Heatmap.h"
+#include "TreeStats.h"
+#include "TreeVerifier.h"
+#include "Teardown.h"
+#include "AncestorStack.h"
+
+namespace btreeblink {
+
+    enum class PageType : uint8_t { BTreeInner=1, BTreeLeaf=2 };
+
+    static const uint64_t pageSize=4*1024;
+
+    struct OptLock {
+        std::atomic<uint64_t> typeVersionLockObsolete{0b100};
+
+        bool isLocked(uint64_t version) {
+            return ((version & 0b10) == 0b10);
+        }
+
+        uint64_t readLockOrRestart(bool &needRestart) {
+            uint64_t version;
+            version = typeVersionLockObsolete.load();
+            if (isLocked(version) || isObsolete(version)) {
+                _mm_pause();
+                needRestart = true;
+                TRACE_EVENT(RestartReadLock, this, 0);
+                HEATMAP_RESTART(this);
+            }
+            return version;
+        }
+
+        void writeLockOrRestart(bool &needRestart) {
+            uint64_t version;
+            version = readLockOrRestart(needRestart);
+            if (needRestart) return;
+
+            upgradeToWriteLockOrRestart(version, needRestart);
+            if (needRestart) return;
+        }
+
+        void upgradeToWriteLockOrRestart(uint64_t &version, bool &needRestart) {
+            if (typeVersionLockObsolete.compare_exchange_strong(version, version + 0b10)) {
+                version = version + 0b10;
+            } else {
+                _mm_pause();
+                needRestart = true;
+                TRACE_EVENT(RestartUpgrade, this, 0);
+                HEATMAP_RESTART(this);
+            }
+        }
+
+        void writeUnlock() {
+            typeVersionLockObsolete.fetch_add(0b10);
+        }
+
+        bool isObsolete(uint64_t version) {
+            return (version & 1) == 1;
+        }
+
+        void checkOrRestart(uint64_t startRead, bool &needRestart) const {
+            needRestart = (startRead != typeVersionLockObsolete.load());
+            if (needRestart) {
+                TRACE_EVENT(RestartCheck, this, 0);
+                HEATMAP_RESTART(this);
+            }
+        }
+
+        void readUnlockOrRestart(uint64_t startRead, bool &needRestart) const {
+            needRestart = (startRead != typeVersionLockObsolete.load());
+            if (needRestart) {
+                TRACE_EVENT(RestartReadUnlock, this, 0);
+                HEATMAP_RESTART(this);
+            }
+        }
+    };
+
+    struct NodeBase : public OptLock{
+        PageType type;
+        uint8_t level;     // 0 for leaves, never changes
+        bool hasHighKey;   // false for the right-most node of a level
+        uint16_t count;
+    };
+
+    /**
+     * Fields every node has: keys above highKey live in next or further right
+     */
+    template<class Key>
+        struct LinkedNode : public NodeBase {
+            Key highKey;
+            NodeBase* next;
+
+            /**
+             * Gives the upper part of this node's range to sibling, which is
+             * linked in right of it
+             */
+            void linkSibling(LinkedNode* sibling, Key sep) {
+                sibling->level = level;
+                sibling->hasHighKey = hasHighKey;
+                sibling->highKey = highKey;
+                sibling->next = next;
+                hasHighKey = true;
+                highKey = sep;
+                next = sibling;
+            }
+
+            bool covers(Key k) { return !hasHighKey || !(highKey < k); }
+        };
+
+    template<class Key,class Payload>
+        struct BTreeLeaf : public LinkedNode<Key> {
+            static const PageType typeMarker=PageType::BTreeLeaf;
+            static const uint64_t maxEntries=(pageSize-sizeof(LinkedNode<Key>))/(sizeof(Key)+sizeof(Payload));
+
+            Key keys[maxEntries];
+            Payload payloads[maxEntries];
+
+            BTreeLeaf() {
+                this->count=0;
+                this->type=typeMarker;
+                this->level=0;
+                this->hasHighKey=false;
+                this->next=nullptr;
+            }
+
+            bool isFull() { return this->count==maxEntries; };
+
+            unsigned lowerBound(Key k) {
+                unsigned lower=0;
+                unsigned upper=this->count;
+                while (lower<upper) {
+                    unsigned mid=((upper-lower)/2)+lower;
+                    if (k<keys[mid]) {
+                        upper=mid;
+                    } else if (k>keys[mid]) {
+                        lower=mid+1;
+                    } else {
+                        return mid;
+                    }
+                }
+                return lower;
+            }
+
+            bool contains(Key k) {
+                unsigned pos=lowerBound(k);
+                return pos<this->count && keys[pos]==k;
+            }
+
+            void insert(Key k,Payload p) {
+                assert(this->count<maxEntries);
+                unsigned pos=lowerBound(k);
+                if ((pos<this->count) && (keys[pos]==k)) {
+                    // Upsert
+                    payloads[pos] = p;
+                    return;
+                }
+                memmove(keys+pos+1,keys+pos,sizeof(Key)*(this->count-pos));
+                memmove(payloads+pos+1,payloads+pos,sizeof(Payload)*(this->count-pos));
+                keys[pos]=k;
+                payloads[pos]=p;
+                this->count++;
+            }
+
+            BTreeLeaf* split(Key& sep) {
+                BTreeLeaf* newLeaf = new BTreeLeaf();
+                newLeaf->count = this->count-(this->count/2);
+                this->count = this->count-newLeaf->count;
+                memcpy(newLeaf->keys, keys+this->count, sizeof(Key)*newLeaf->count);
+                memcpy(newLeaf->payloads, payloads+this->count, sizeof(Payload)*newLeaf->count);
+                sep = keys[this->count-1];
+                this->linkSibling(newLeaf, sep);
+                return newLeaf;
+            }
+        };
+
+    template<class Key>
+        struct BTreeInner : public LinkedNode<Key> {
+            static const PageType typeMarker=PageType::BTreeInner;
+            static const uint64_t maxEntries=(pageSize-sizeof(LinkedNode<Key>))/(sizeof(Key)+sizeof(NodeBase*));
+
+            NodeBase* children[maxEntries];
+            Key keys[maxEntries];
+
+            BTreeInner(uint8_t level) {
+                this->count=0;
+                this->type=typeMarker;
+                this->level=level;
+                this->hasHighKey=false;
+                this->next=nullptr;
+            }
+
+            bool isFull() { return this->count==(maxEntries-1); };
+
+            unsigned lowerBound(Key k) {
+                unsigned lower=0;
+                unsigned upper=this->count;
+                while (lower<upper) {
+                    unsigned mid=((upper-lower)/2)+lower;
+                    if (k<keys[mid]) {
+                        upper=mid;
+                    } else if (k>keys[mid]) {
+                        lower=mid+1;
+                    } else {
+                        return mid;
+                    }
+                }
+                return lower;
+            }
+
+            BTreeInner* split(Key& sep) {
+                BTreeInner* newInner=new BTreeInner(this->level);
+                newInner->count=this->count-(this->count/2);
+                this->count=this->count-newInner->count-1;
+                sep=keys[this->count];
+                memcpy(newInner->keys,keys+this->count+1,sizeof(Key)*(newInner->count+1));
+                memcpy(newInner->children,children+this->count+1,sizeof(NodeBase*)*(newInner->count+1));
+                this->linkSibling(newInner, sep);
+                return newInner;
+            }
+
+            /**
+             * Adds child right of the child that covered sep before its split
+             */
+            void insert(Key k,NodeBase* child) {
+                assert(this->count<maxEntries-1);
+                unsigned pos=lowerBound(k);
+                memmove(keys+pos+1,keys+pos,sizeof(Key)*(this->count-pos+1));
+                memmove(children+pos+1,children+pos,sizeof(NodeBase*)*(this->count-pos+1));
+                keys[pos]=k;
+                children[pos]=child;
+                std::swap(children[pos],children[pos+1]);
+                this->count++;
+            }
+        };
+
+    template<class Key,class Value>
+        struct BTree {
+            typedef BTreeLeaf<Key,Value> Leaf;
+            typedef BTreeInner<Key> Inner;
+
+            std::atomic<NodeBase*> root;
+            std::atomic<int> treeHeight{1};
+            int insertFallbackTimes = 0;
+            int lookupFallbackTimes = 0;
+            teardown::Reclaimer reclaimer;
+
+            BTree() {
+                root = new Leaf();
+            }
+
+            ~BTree() {
+                reclaimer.wait();
+                freeNodes(root);
+            }
+
+            void freeNodes(NodeBase* node, int numThreads = parallel::defaultThreads()) {
+                teardown::freeTree<Inner, Leaf>(node, numThreads);
+            }
+
+            /**
+             * Frees the old tree on all cores. No operation may be running
+             */
+            void clear() {
+                NodeBase* old = root;
+                root = new Leaf();
+                treeHeight = 1;
+                freeNodes(old);
+            }
+
+            /**
+             * Swaps in an empty tree right away and frees the old one on a
+             * background thread. Operations started before the swap must have
+             * finished
+             */
+            void clearAsync() {
+                NodeBase* old = root;
+                root = new Leaf();
+                treeHeight = 1;
+                reclaimer.run([this, old]() { freeNodes(old, 1); });
+            }
+
+            bool checkTree() {
+                int height = checkTreeRecursive(root);
+                std::cout << height << std::endl;
+                return height != -1;
+            }
+
+            int checkTreeRecursive(NodeBase *node) {
+                if(node->type == PageType::BTreeInner) {
+                    auto inner = static_cast<Inner*>(node);
+                    int height1  = 0, height2 = 0;
+                    for(int i = 0; i < inner->count; i++) {
+                        auto child = inner->children[i];
+                        if(height1 == 0) {
+                            height1 = checkTreeRecursive(child);
+                        } else {
+                            height2 = checkTreeRecursive(child);
+                        }
+
+                        if((height2 != 0 && height1 != height2) || height1 == -1 || height2 == -1) {
+                            std::cout << height1 << " " << height2 << std::endl;
+                            return -1;
+                        }
+                    }
+                    return height1;
+                } else {
+                    return 1;
+                }
+            }
+
+            /**
+             * Checks ordering, separator and fanout invariants in parallel,
+             * see TreeVerifier.h. Needs a tree without concurrent writers,
+             * at which point every split has reached its parent
+             */
+            treeverify::VerifyResult verify(int numThreads = parallel::defaultThreads()) {
+                return treeverify::verify<Key, Inner, Leaf>(root.load(), numThreads);
+            }
+
+            /**
+             * Node counts per level, fill histograms and memory use, see
+             * TreeStats.h. Only exact while no writer is running
+             */
+            treestats::TreeStats stats(int numThreads = parallel::defaultThreads()) {
+                return treestats::collect<Inner, Leaf>(root.load(), numThreads);
+            }
+
+            void yield(int count) {
+                if (count>3)
+                    sched_yield();
+                else
+                    _mm_pause();
+            }
+
+            /**
+             * Replaces the root, which the caller holds locked. Every root
+             * change happens under the old root's lock
+             */
+            void makeRoot(Key k,NodeBase* leftChild,NodeBase* rightChild) {
+                auto inner = new Inner(leftChild->level + 1);
+                inner->count = 1;
+                inner->keys[0] = k;
+                inner->children[0] = leftChild;
+                inner->children[1] = rightChild;
+                root = inner;
+                treeHeight++;
+                TRACE_EVENT(MakeRoot, inner, treeHeight);
+            }
+
+            /**
+             * Walks optimistically from node down to the node at level that
+             * covers k, moving right where k is above a high key. A failed
+             * version check retries at the same node: its lower bound never
+             * changes, so it still leads to k. Inner nodes it descends from
+             * are pushed onto path
+             * @return the node, version is the version it was read at
+             */
+            NodeBase* findNode(NodeBase* node, Key k, unsigned level, uint64_t& version,
+                               descent::AncestorStack<NodeBase>* path) {
+                int restartCount = 0;
+                while (true) {
+                    bool needRestart = false;
+                    version = node->readLockOrRestart(needRestart);
+                    if (needRestart) {
+                        timeline::countRestart();
+                        yield(++restartCount);
+                        continue;
+                    }
+                    auto linked = static_cast<LinkedNode<Key>*>(node);
+                    NodeBase* next;
+                    bool down = false;
+                    if (!linked->covers(k)) {
+                        next = linked->next;
+                    } else if (node->level == level) {
+                        return node;
+                    } else {
+                        auto inner = static_cast<Inner*>(node);
+                        next = inner->children[inner->lowerBound(k)];
+                        down = true;
+                    }
+                    node->checkOrRestart(version, needRestart);
+                    if (needRestart) {
+                        timeline::countRestart();
+                        yield(++restartCount);
+                        continue;
+                    }
+                    if (down && path)
+                        path->push(node, version);
+                    node = next;
+                }
+            }
+
+            /**
+             * Write locks the node that covers k, starting at node and
+             * following right-links. Locks are taken left to right and at
+             * most two are held, so this cannot deadlock
+             */
+            NodeBase* lockCovering(NodeBase* node, Key k) {
+                writeLock(node);
+                while (!static_cast<LinkedNode<Key>*>(node)->covers(k)) {
+                    NodeBase* next = static_cast<LinkedNode<Key>*>(node)->next;
+                    writeLock(next);
+                    node->writeUnlock();
+                    node = next;
+                }
+                return node;
+            }
+
+            void writeLock(NodeBase* node) {
+                int restartCount = 0;
+                while (true) {
+                    bool needRestart = false;
+                    node->writeLockOrRestart(needRestart);
+                    if (!needRestart) return;
+                    timeline::countRestart();
+                    yield(++restartCount);
+                }
+            }
+
+            void insert(Key k, Value v) {
+                descent::AncestorStack<NodeBase> path;
+                uint64_t version;
+                NodeBase* node = findNode(root, k, 0, version, &path);
+
+                // Lock the leaf, right of it if it split in the meantime
+                bool needRestart = false;
+                node->upgradeToWriteLockOrRestart(version, needRestart);
+                if (needRestart)
+                    node = lockCovering(node, k);
+                auto leaf = static_cast<Leaf*>(node);
+
+                if (!leaf->isFull() || leaf->contains(k)) {
+                    leaf->insert(k, v);
+                    leaf->writeUnlock();
+                    return;
+                }
+
+                Key sep; Leaf* newLeaf = leaf->split(sep);
+                TRACE_EVENT(SplitLeaf, leaf, leaf->count);
+                if (!(sep < k))
+                    leaf->insert(k, v);
+                else
+                    newLeaf->insert(k, v);
+                insertIntoParent(path, leaf, sep, newLeaf);
+            }
+
+            /**
+             * Adds the separator of a split to the level above. node is the
+             * left half of the split and still locked; it is unlocked before
+             * the parent is locked, so a split never holds two levels. Parents
+             * come from the path of the descent, or from a new descent if the
+             * tree grew since
+             */
+            void insertIntoParent(descent::AncestorStack<NodeBase>& path, NodeBase* node, Key sep, NodeBase* child) {
+                while (true) {
+                    if (node == root) {
+                        makeRoot(sep, node, child);
+                        node->writeUnlock();
+                        return;
+                    }
+                    node->writeUnlock();
+
+                    NodeBase* parent;
+                    if (!path.empty()) {
+                        parent = path.pop().node;
+                    } else {
+                        uint64_t version;
+                        parent = findNode(root, sep, node->level + 1, version, nullptr);
+                    }
+                    auto inner = static_cast<Inner*>(lockCovering(parent, sep));
+                    if (!inner->isFull()) {
+                        inner->insert(sep, child);
+                        inner->writeUnlock();
+                        return;
+                    }
+
+                    Key upSep; Inner* newInner = inner->split(upSep);
+                    TRACE_EVENT(SplitInner, inner, inner->count);
+                    if (!(upSep < sep))
+                        inner->insert(sep, child);
+                    else
+                        newInner->insert(sep, child);
+                    node = inner;
+                    sep = upSep;
+                    child = newInner;
+                }
+            }
+
+            bool lookup(Key k, Value& result) {
+                uint64_t version;
+                NodeBase* node = root;
+                while (true) {
+                    node = findNode(node, k, 0, version, nullptr);
+                    auto leaf = static_cast<Leaf*>(node);
+                    unsigned pos = leaf->lowerBound(k);
+                    bool success = false;
+                    if ((pos<leaf->count) && (leaf->keys[pos]==k)) {
+                        success = true;
+                        result = leaf->payloads[pos];
+                    }
+                    bool needRestart = false;
+                    node->readUnlockOrRestart(version, needRestart);
+                    if (!needRestart)
+                        return success;
+                    timeline::countRestart();
+                }
+            }
+
+            /**
+             * Reads up to range payloads of keys from k on, following the
+             * leaf links. Each leaf is validated on its own, so the result is
+             * not a snapshot across leaves
+             */
+            uint64_t scan(Key k, int range, Value* output) {
+                uint64_t version;
+                NodeBase* node = findNode(root, k, 0, version, nullptr);
+                int count = 0;
+                while (true) {
+                    auto leaf = static_cast<Leaf*>(node);
+                    int read = 0;
+                    for (unsigned i = leaf->lowerBound(k); i < leaf->count && count + read < range; i++) {
+                        output[count + read++] = leaf->payloads[i];
+                    }
+                    bool hasNext = leaf->hasHighKey;
+                    Key highKey = leaf->highKey;
+                    NodeBase* next = leaf->next;
+                    bool needRestart = false;
+                    node->readUnlockOrRestart(version, needRestart);
+                    if (needRestart) {
+                        timeline::countRestart();
+                        node = findNode(node, k, 0, version, nullptr);
+                        continue;
+                    }
+                    count += read;
+                    if (count == range || !hasNext)
+                        return count;
+                    // Every key in next is above the high key
+                    k = highKey;
+                    node = findNode(next, k, 0, version, nullptr);
+                }
+            }
+        };
+
+}
@@ -0,0 +1,384 @@
+#pragma once
+
+/*
+ * Multi-version mode on top of btreeolc. The index maps every key to a
+ * version chain, newest version first, and the chain object stays put for
+ * the lifetime of the tree. Writers of an existing key only prepend a
+ * version to its chain, so the leaf and its version are left alone and
+ * optimistic readers of that leaf are not restarted. Only inserts of new
+ * keys and splits still change leaves.
+ *
+ * Each version is stamped with a timestamp from a global clock, taken while
+ * holding the chain's lock. A snapshot is a reading of the clock, and a
+ * reader waits for a locked chain before walking it, so any version stamped
+ * at or below the snapshot is in place by then. The snapshot sees exactly
+ * the writes up to it, no matter how long it runs.
+ *
+ * A snapshot holds an epoch guard (see Epoch.h). The collector reads the
+ * clock, waits for a grace period and then knows that no snapshot
+ * older than what it read is left. It keeps the newest version at or below
+ * that horizon on every chain and frees the older ones.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <limits>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "BTreeOLC.h"
+#include "Epoch.h"
+#include "Parallel.h"
+
+namespace btreemvcc {
+
+    template<class Value>
+    struct Version {
+        uint64_t ts;
+        Value value;
+        bool deleted;           // tombstone written by remove
+        Version* older;         // never changes once published, except when the collector cuts it
+    };
+
+    template<class Value>
+    struct Chain {
+        std::atomic<Version<Value>*> head{nullptr};
+        std::atomic<bool> locked{false}; // held while a version is stamped and prepended
+        std::atomic<bool> queued{false}; // on the collector's list
+        Chain* nextQueued = nullptr;
+
+        void lock() {
+            int spins = 0;
+            while (locked.exchange(true)) {
+                parallel::backoff(spins);
+            }
+        }
+
+        void unlock() {
+            locked.store(false, std::memory_order_release);
+        }
+
+        /**
+         * Newest version with a timestamp of at most ts, or nullptr. Waits
+         * for a writer that may be prepending a version stamped below ts
+         */
+        const Version<Value>* at(uint64_t ts) const {
+            int spins = 0;
+            while (locked.load()) {
+                parallel::backoff(spins);
+            }
+            const Version<Value>* v = head.load(std::memory_order_acquire);
+            while (v && v->ts > ts) {
+                v = v->older;
+            }
+            return v;
+        }
+    };
+
+    template<class Key, class Value>
+    struct BTree {
+        typedef Key KeyType;
+        typedef Value ValueType;
+        typedef Chain<Value> ChainType;
+        typedef Version<Value> VersionType;
+
+        /**
+         * Read view of the tree at a fixed timestamp. Holds an epoch guard,
+         * so the collector does not free versions it may still need. Keep it
+         * on the thread that took it
+         */
+        struct Snapshot {
+            epoch::Guard guard;
+            uint64_t ts;
+
+            explicit Snapshot(const std::atomic<uint64_t>& clock) : ts(clock.load()) {}
+        };
+
+        btreeolc::BTree<Key, ChainType*> index;
+        std::atomic<uint64_t> clock{0}; // last timestamp handed out
+        std::atomic<ChainType*> queued{nullptr};
+        std::mutex collectLock;
+
+        std::thread collector;
+        std::mutex collectorLock;
+        std::condition_variable collectorWake;
+        bool collectorStopping = false;
+
+        static const int scanChunk = 256;
+
+        BTree() {}
+
+        ~BTree() {
+            stopGarbageCollector();
+            freeChains();
+        }
+
+        /**
+         * Inserts k or writes a new version of it
+         */
+        void insert(Key k, Value v) {
+            write(chainFor(k), v, false);
+        }
+
+        /**
+         * Writes a tombstone for k. The key stays in the index, snapshots
+         * taken before still see the old value
+         * @return whether k had a live version
+         */
+        bool remove(Key k) {
+            ChainType* chain;
+            if (!index.lookup(k, chain)) {
+                return false;
+            }
+            return write(chain, Value(), true);
+        }
+
+        /**
+         * Takes a snapshot at the current timestamp
+         */
+        Snapshot snapshot() {
+            return Snapshot(clock);
+        }
+
+        /**
+         * Last timestamp handed out
+         */
+        uint64_t timestamp() const {
+            return clock.load();
+        }
+
+        bool lookup(Key k, Value& result, const Snapshot& snap) {
+            ChainType* chain;
+            if (!index.lookup(k, chain)) {
+                return false;
+            }
+            const VersionType* v = chain->at(snap.ts);
+            if (!v || v->deleted) {
+                return false;
+            }
+            result = v->value;
+            return true;
+        }
+
+        bool lookup(Key k, Value& result) {
+            Snapshot snap = snapshot();
+            return lookup(k, result, snap);
+        }
+
+        /**
+         * Copies up to range entries with keys >= k that are live at snap, in
+         * key order. Leaves are read in chunks with btreeolc::scanEntries,
+         * which only restarts a chunk when a new key lands in it
+         * @return number of entries written to keysOut and valuesOut
+         */
+        uint64_t scan(Key k, int range, Key* keysOut, Value* valuesOut, const Snapshot& snap) {
+            Key keys[scanChunk];
+            ChainType* chains[scanChunk];
+            int count = 0;
+            bool exclusive = false;
+            while (count < range) {
+                uint64_t got = index.scanEntries(k, scanChunk, keys, chains, exclusive);
+                for (uint64_t i = 0; i < got && count < range; i++) {
+                    const VersionType* v = chains[i]->at(snap.ts);
+                    if (v && !v->deleted) {
+                        keysOut[count] = keys[i];
+                        valuesOut[count] = v->value;
+                        count++;
+                    }
+                }
+                if (got < (uint64_t)scanChunk) {
+                    break;
+                }
+                k = keys[got - 1];
+                exclusive = true;
+            }
+            return count;
+        }
+
+        uint64_t scan(Key k, int range, Key* keysOut, Value* valuesOut) {
+            Snapshot snap = snapshot();
+            return scan(k, range, keysOut, valuesOut, snap);
+        }
+
+        /**
+         * Frees versions no snapshot can see anymore. Waits for snapshots
+         * that are open when it starts, so it must not be called while
+         * holding one
+         * @return number of versions freed
+         */
+        uint64_t collectGarbage() {
+            std::lock_guard<std::mutex> guard(collectLock);
+            uint64_t horizon = clock.load();
+            epoch::synchronize();
+
+            uint64_t freed = 0;
+            ChainType* chain = queued.exchange(nullptr);
+            while (chain) {
+                ChainType* next = chain->nextQueued;
+                freed += prune(chain, horizon);
+                if (chain->head.load()->older) {
+                    push(chain);
+                } else {
+                    chain->queued.store(false);
+                    // A writer may have added a version while the flag was set
+                    if (chain->head.load()->older) {
+                        enqueue(chain);
+                    }
+                }
+                chain = next;
+            }
+            return freed;
+        }
+
+        /**
+         * Runs collectGarbage every interval on a background thread until
+         * stopGarbageCollector or destruction
+         */
+        void startGarbageCollector(std::chrono::milliseconds interval = std::chrono::milliseconds(10)) {
+            stopGarbageCollector();
+            collectorStopping = false;
+            collector = std::thread([this, interval]() {
+                std::unique_lock<std::mutex> lock(collectorLock);
+                while (!collectorStopping) {
+                    lock.unlock();
+                    collectGarbage();
+                    lock.lock();
+                    collectorWake.wait_for(lock, interval, [this]() { return collectorStopping; });
+                }
+            });
+        }
+
+        void stopGarbageCollector() {
+            if (!collector.joinable()) {
+                return;
+            }
+            {
+                std::lock_guard<std::mutex> lock(collectorLock);
+                collectorStopping = true;
+            }
+            collectorWake.notify_all();
+            collector.join();
+        }
+
+        /**
+         * Frees all keys and versions. No operation or snapshot may be
+         * running, the collector may
+         */
+        void clear() {
+            std::lock_guard<std::mutex> guard(collectLock);
+            freeChains();
+            queued = nullptr;
+            index.clear();
+        }
+
+        treeverify::VerifyResult verify(int numThreads = parallel::defaultThreads()) {
+            return index.verify(numThreads);
+        }
+
+        /**
+         * Stats of the index, version chains are not included
+         */
+        treestats::TreeStats stats(int numThreads = parallel::defaultThreads()) {
+            return index.stats(numThreads);
+        }
+
+    private:
+        ChainType* chainFor(Key k) {
+            ChainType* chain;
+            if (index.lookup(k, chain)) {
+                return chain;
+            }
+            ChainType* fresh = new ChainType();
+            if (index.insertIfAbsent(k, fresh, chain)) {
+                return fresh;
+            }
+            delete fresh;
+            return chain;
+        }
+
+        /**
+         * Stamps and prepends a version under the chain lock, which also
+         * keeps timestamps descending along the chain
+         * @return whether the chain had a live version before
+         */
+        bool write(ChainType* chain, Value v, bool deleted) {
+            chain->lock();
+            VersionType* head = chain->head.load(std::memory_order_relaxed);
+            bool wasLive = head && !head->deleted;
+            if (deleted && !wasLive) {
+                chain->unlock();
+                return false;
+            }
+            uint64_t ts = clock.fetch_add(1) + 1;
+            chain->head.store(new VersionType{ts, v, deleted, head}, std::memory_order_release);
+            chain->unlock();
+            if (head) {
+                enqueue(chain);
+            }
+            return wasLive;
+        }
+
+        void enqueue(ChainType* chain) {
+            if (!chain->queued.exchange(true)) {
+                push(chain);
+            }
+        }
+
+        void push(ChainType* chain) {
+            ChainType* top = queued.load();
+            do {
+                chain->nextQueued = top;
+            } while (!queued.compare_exchange_weak(top, chain));
+        }
+
+        /**
+         * Cuts the chain after its newest version at or below horizon
+         */
+        uint64_t prune(ChainType* chain, uint64_t horizon) {
+            VersionType* keep = chain->head.load();
+            while (keep && keep->ts > horizon) {
+                keep = keep->older;
+            }
+            if (!keep) {
+                return 0;
+            }
+            VersionType* old = keep->older;
+            keep->older = nullptr;
+            return freeVersions(old);
+        }
+
+        static uint64_t freeVersions(VersionType* v) {
+            uint64_t count = 0;
+            while (v) {
+                VersionType* older = v->older;
+                delete v;
+                v = older;
+                count++;
+            }
+            return count;
+        }
+
+        void freeChains() {
+            Key keys[scanChunk];
+            ChainType* chains[scanChunk];
+            Key k = std::numeric_limits<Key>::lowest();
+            bool exclusive = false;
+            for (;;) {
+                uint64_t got = index.scanEntries(k, scanChunk, keys, chains, exclusive);
+                for (uint64_t i = 0; i < got; i++) {
+                    freeVersions(chains[i]->head.load());
+                    delete chains[i];
+                }
+                if (got < (uint64_t)scanChunk) {
+                    break;
+                }
+                k = keys[got - 1];
+                exclusive = true;
+            }
+        }
+    };
+}
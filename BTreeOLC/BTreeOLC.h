@@ -7,10 +7,30 @@
 
 #include <cassert>
 #include <cstring>
+#include <cmath>
 #include <atomic>
 #include <immintrin.h>
 #include <sched.h>
 #include <iostream>
+#include <vector>
+#include <algorithm>
+#include <limits>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <stdio.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "Timeline.h"
+#include "Trace.h"
+#include "Heatmap.h"
+#include "TreeStats.h"
+#include "TreeVerifier.h"
+#include "Teardown.h"
+#include "AncestorStack.h"
+#include "Combining.h"
 
 namespace btreeolc {
 
@@ -31,6 +51,8 @@ namespace btreeolc {
             if (isLocked(version) || isObsolete(version)) {
                 _mm_pause();
                 needRestart = true;
+                TRACE_EVENT(RestartReadLock, this, 0);
+                HEATMAP_RESTART(this);
             }
             return version;
         }
@@ -50,6 +72,8 @@ namespace btreeolc {
             } else {
                 _mm_pause();
                 needRestart = true;
+                TRACE_EVENT(RestartUpgrade, this, 0);
+                HEATMAP_RESTART(this);
             }
         }
 
@@ -62,11 +86,19 @@ namespace btreeolc {
         }
 
         void checkOrRestart(uint64_t startRead, bool &needRestart) const {
-            readUnlockOrRestart(startRead, needRestart);
+            needRestart = (startRead != typeVersionLockObsolete.load());
+            if (needRestart) {
+                TRACE_EVENT(RestartCheck, this, 0);
+                HEATMAP_RESTART(this);
+            }
         }
 
         void readUnlockOrRestart(uint64_t startRead, bool &needRestart) const {
             needRestart = (startRead != typeVersionLockObsolete.load());
+            if (needRestart) {
+                TRACE_EVENT(RestartReadUnlock, this, 0);
+                HEATMAP_RESTART(this);
+            }
         }
 
         void writeUnlockObsolete() {
@@ -81,6 +113,13 @@ namespace btreeolc {
 
     struct BTreeLeafBase : public NodeBase {
         static const PageType typeMarker=PageType::BTreeLeaf;
+
+        // Id of the last snapshot this leaf was copied for, or of the
+        // snapshot it was split off in. Changes under the write lock
+        uint64_t snapshotEpoch = 0;
+        // The leaf as of snapshot snapshotEpoch, null if split off after it.
+        // On a frozen copy, the next copy to free
+        BTreeLeafBase* frozen = nullptr;
     };
 
     template<class Key,class Payload>
@@ -90,7 +129,7 @@ namespace btreeolc {
                 Payload p;
             };
 
-            static const uint64_t maxEntries=(pageSize-sizeof(NodeBase))/(sizeof(Key)+sizeof(Payload));
+            static const uint64_t maxEntries=(pageSize-sizeof(BTreeLeafBase))/(sizeof(Key)+sizeof(Payload));
 
             Key keys[maxEntries];
             Payload payloads[maxEntries];
@@ -149,10 +188,75 @@ namespace btreeolc {
                 count++;
             }
 
+            Payload* payloadFor(Key k) {
+                unsigned pos=lowerBound(k);
+                return ((pos<count) && (keys[pos]==k)) ? &payloads[pos] : nullptr;
+            }
+
+            bool remove(Key k) {
+                unsigned pos=count ? lowerBound(k) : 0;
+                if ((pos>=count) || !(keys[pos]==k)) {
+                    return false;
+                }
+                memmove(keys+pos,keys+pos+1,sizeof(Key)*(count-pos-1));
+                memmove(payloads+pos,payloads+pos+1,sizeof(Payload)*(count-pos-1));
+                count--;
+                return true;
+            }
+
+            /**
+             * Removes the keys in (low, high]
+             * @return number of keys removed
+             */
+            unsigned removeRange(Key low, Key high) {
+                unsigned begin=count ? lowerBound(low) : 0;
+                if ((begin<count) && (keys[begin]==low)) {
+                    begin++;
+                }
+                unsigned end=begin;
+                while ((end<count) && !(high<keys[end])) {
+                    end++;
+                }
+                memmove(keys+begin,keys+end,sizeof(Key)*(count-end));
+                memmove(payloads+begin,payloads+end,sizeof(Payload)*(count-end));
+                count-=end-begin;
+                return end-begin;
+            }
+
+            /**
+             * Inserts n sorted keys that are not in the leaf yet and fit,
+             * merging from the back so every entry moves at most once
+             */
+            void insertSorted(const Key* newKeys, const Payload* newPayloads, unsigned n) {
+                assert(count+n<=maxEntries);
+                int i=count-1;
+                int j=n-1;
+                for (int out=count+n-1; j>=0; out--) {
+                    if (i>=0 && newKeys[j]<keys[i]) {
+                        keys[out]=keys[i];
+                        payloads[out]=payloads[i];
+                        i--;
+                    } else {
+                        keys[out]=newKeys[j];
+                        payloads[out]=newPayloads[j];
+                        j--;
+                    }
+                }
+                count+=n;
+            }
+
             BTreeLeaf* split(Key& sep) {
+                return split(sep, count/2);
+            }
+
+            /**
+             * Splits so that this leaf keeps its first keep entries
+             */
+            BTreeLeaf* split(Key& sep, unsigned keep) {
                 BTreeLeaf* newLeaf = new BTreeLeaf();
-                newLeaf->count = count-(count/2);
-                count = count-newLeaf->count;
+                newLeaf->snapshotEpoch = snapshotEpoch;
+                newLeaf->count = count-keep;
+                count = keep;
                 memcpy(newLeaf->keys, keys+count, sizeof(Key)*newLeaf->count);
                 memcpy(newLeaf->payloads, payloads+count, sizeof(Payload)*newLeaf->count);
                 sep = keys[count-1];
@@ -205,9 +309,17 @@ namespace btreeolc {
             }
 
             BTreeInner* split(Key& sep) {
+                return split(sep, count/2-1);
+            }
+
+            /**
+             * Splits so that this node keeps its first keep separators, the
+             * next one moves up as sep
+             */
+            BTreeInner* split(Key& sep, unsigned keep) {
                 BTreeInner* newInner=new BTreeInner();
-                newInner->count=count-(count/2);
-                count=count-newInner->count-1;
+                newInner->count=count-keep-1;
+                count=keep;
                 sep=keys[count];
                 memcpy(newInner->keys,keys+count+1,sizeof(Key)*(newInner->count+1));
                 memcpy(newInner->children,children+count+1,sizeof(NodeBase*)*(newInner->count+1));
@@ -228,18 +340,191 @@ namespace btreeolc {
         };
 
 
+    /**
+     * A leaf and the version a scan read it at
+     */
+    struct NodeSetEntry {
+        const NodeBase* node;
+        uint64_t version;
+    };
+
+    typedef std::vector<NodeSetEntry> NodeSet;
+
+    /**
+     * First page of a file written by BTree::saveImage. Leaf pages follow,
+     * then the inner pages level by level, the root last. Inner nodes hold
+     * the byte offsets of their children instead of pointers
+     */
+    struct ImageHeader {
+        char magic[8];
+        uint64_t pageSize;
+        uint64_t keySize;
+        uint64_t valueSize;
+        uint64_t leafPages;
+        uint64_t innerPages;
+        uint64_t rootOffset;
+        uint64_t height;
+        uint64_t numKeys;
+    };
+
+    static const char imageMagic[8] = {'B', 'T', 'O', 'L', 'C', 'I', 'M', 'G'};
+
+    /**
+     * A page image mapped by BTree::openImage. The mapping is private, so
+     * a page is copied the first time it is written and the file never
+     * changes. Leaf pages are checked the first time an operation reaches
+     * them, see checkLeaf
+     */
+    struct Image {
+        enum : uint8_t { Unchecked, Checking, Checked };
+
+        char* base;
+        size_t size;
+        size_t innerStart; // offset of the first inner page
+        std::unique_ptr<std::atomic<uint8_t>[]> leafState; // per leaf page
+        std::atomic<uint64_t> corruptLeaves{0};
+
+        Image(char* base_, size_t size_, size_t innerStart_)
+            : base(base_), size(size_), innerStart(innerStart_),
+              leafState(new std::atomic<uint8_t>[innerStart_ / pageSize - 1]()) {}
+        Image(const Image&) = delete;
+        Image& operator=(const Image&) = delete;
+
+        ~Image() {
+            munmap(base, size);
+        }
+
+        bool contains(const void* p) const {
+            return (const char*)p >= base && (const char*)p < base + size;
+        }
+
+        /**
+         * Makes sure node, if it is a leaf page of the image, is used as a
+         * leaf: on the first call for a page, a page that is not a leaf as
+         * saveImage writes it (type, entry count, unlocked, no snapshot
+         * state) is reset to an empty leaf and counted in corruptLeaves.
+         * Concurrent callers for the same page wait for the check
+         */
+        template<class Leaf>
+        void checkLeaf(const NodeBase* node) {
+            if (!contains(node)) return;
+            size_t offset = (const char*)node - base;
+            if (offset >= innerStart) return;
+            std::atomic<uint8_t>& state = leafState[offset / pageSize - 1];
+            if (state.load(std::memory_order_acquire) == Checked) return;
+            uint8_t expected = Unchecked;
+            if (state.compare_exchange_strong(expected, Checking)) {
+                Leaf* leaf = reinterpret_cast<Leaf*>(base + offset);
+                if (leaf->type != Leaf::typeMarker || leaf->count > Leaf::maxEntries ||
+                    leaf->typeVersionLockObsolete.load() != 0b100 || leaf->snapshotEpoch != 0 || leaf->frozen) {
+                    new (leaf) Leaf();
+                    corruptLeaves++;
+                }
+                state.store(Checked, std::memory_order_release);
+                return;
+            }
+            while (state.load(std::memory_order_acquire) != Checked) {
+                _mm_pause();
+            }
+        }
+
+        /**
+         * Image pages are not freed with the tree. Nothing below a leaf page
+         * needs to be read either
+         */
+        teardown::Ownership ownershipOf(const NodeBase* node) const {
+            if (!contains(node)) return teardown::Ownership::Owned;
+            return (size_t)((const char*)node - base) < innerStart ? teardown::Ownership::BorrowedSubtree
+                                                                    : teardown::Ownership::Borrowed;
+        }
+    };
+
     template<class Key,class Value>
         struct BTree {
+            typedef Key KeyType;
+            typedef Value ValueType;
+
             std::atomic<NodeBase*> root;
+            std::atomic<int> treeHeight{1};
             int insertFallbackTimes;
             int lookupFallbackTimes;
+            teardown::Reclaimer reclaimer;
+
+            // The right-most leaf. Only changes while that leaf is write locked
+            // (or no operation runs), so appends can validate it and skip the descent
+            std::atomic<BTreeLeaf<Key,Value>*> tailLeaf;
+
+            // Share of entries the left node keeps when the right-most node splits on an append
+            static constexpr double appendSplitKeep = 0.9;
+
+            // Inserts waiting on hot leaves, see Combining.h
+            combining::Table<Key,Value> combiner;
+
+            // Id of the snapshot leaves are copied for before they change, 0 if none
+            std::atomic<uint64_t> activeSnapshot{0};
+            std::atomic<uint64_t> lastSnapshot{0};
+            // Frozen copies, linked through their frozen field
+            std::atomic<BTreeLeafBase*> frozenLeaves{nullptr};
+            teardown::Reclaimer checkpointer;
+            bool checkpointOk = false;
+
+            // Entries exportSnapshot buffers per write
+            static const size_t exportBuffer = 1 << 16;
+
+            // Page image the tree was opened from, see openImage
+            Image* image = nullptr;
 
             BTree() {
-                root = new BTreeLeaf<Key,Value>();
+                root = tailLeaf = new BTreeLeaf<Key,Value>();
             }
 
+            ~BTree() {
+                checkpointer.wait();
+                reclaimer.wait();
+                freeFrozen();
+                freeNodes(root, parallel::defaultThreads(), image);
+            }
+
+            /**
+             * Frees the tree below node. Pages of nodeImage are skipped and
+             * the image is unmapped afterwards
+             */
+            void freeNodes(NodeBase* node, int numThreads = parallel::defaultThreads(), Image* nodeImage = nullptr) {
+                if (!nodeImage) {
+                    teardown::freeTree<BTreeInner<Key>, BTreeLeaf<Key,Value>>(node, numThreads);
+                    return;
+                }
+                teardown::freeTree<BTreeInner<Key>, BTreeLeaf<Key,Value>>(node, numThreads,
+                    [nodeImage](const NodeBase* n) { return nodeImage->ownershipOf(n); });
+                delete nodeImage;
+            }
+
+            /**
+             * Frees the old tree on all cores. No operation or snapshot may
+             * be running
+             */
             void clear() {
-                root = new BTreeLeaf<Key,Value>();
+                freeFrozen();
+                NodeBase* old = root;
+                Image* oldImage = image;
+                root = tailLeaf = new BTreeLeaf<Key,Value>();
+                treeHeight = 1;
+                image = nullptr;
+                freeNodes(old, parallel::defaultThreads(), oldImage);
+            }
+
+            /**
+             * Swaps in an empty tree right away and frees the old one on a
+             * background thread. Operations started before the swap must have
+             * finished
+             */
+            void clearAsync() {
+                NodeBase* old = root;
+                Image* oldImage = image;
+                root = tailLeaf = new BTreeLeaf<Key,Value>();
+                treeHeight = 1;
+                image = nullptr;
+                reclaimer.run([this, old, oldImage]() { freeNodes(old, 1, oldImage); });
             }
 
             bool checkTree() {
@@ -253,7 +538,7 @@ namespace btreeolc {
                     auto inner = static_cast<BTreeInner<Key>*>(node);
                     int height1  = 0, height2 = 0;
                     for(int i = 0; i < inner->count; i++) {
-                        auto child = inner->children[i];
+                        auto child = childAt(inner, i);
                         if(height1 == 0) {
                             height1 = checkTreeRecursive(child);
                         } else {
@@ -270,6 +555,58 @@ namespace btreeolc {
                     return 1;
                 }
             }
+            /**
+             * Checks ordering, separator and fanout invariants in parallel,
+             * see TreeVerifier.h. Needs a tree without concurrent writers
+             */
+            treeverify::VerifyResult verify(int numThreads = parallel::defaultThreads()) {
+                checkImageLeaves();
+                auto result = treeverify::verify<Key, BTreeInner<Key>, BTreeLeaf<Key,Value>>(root.load(), numThreads);
+                if (image && image->corruptLeaves) {
+                    result.fail(std::to_string(image->corruptLeaves) + " corrupt leaf pages in the image");
+                }
+                return result;
+            }
+
+            /**
+             * Node counts per level, fill histograms and memory use, see
+             * TreeStats.h. Only exact while no writer is running
+             */
+            treestats::TreeStats stats(int numThreads = parallel::defaultThreads()) {
+                checkImageLeaves();
+                return treestats::collect<BTreeInner<Key>, BTreeLeaf<Key,Value>>(root.load(), numThreads);
+            }
+
+            /**
+             * Prints contention per level and the topN hottest nodes, see
+             * Heatmap.h. Call while no operation is running
+             */
+            void printHeatmap(int topN = 10) {
+                checkImageLeaves();
+                heatmap::report<Key, BTreeInner<Key>, BTreeLeaf<Key,Value>>(root.load(), topN);
+            }
+
+            /**
+             * Child pos of inner. Leaf pages of an image are checked when
+             * they are first reached this way
+             */
+            NodeBase* childAt(BTreeInner<Key>* inner, unsigned pos) {
+                NodeBase* child = inner->children[pos];
+                if (image) image->checkLeaf<BTreeLeaf<Key,Value>>(child);
+                return child;
+            }
+
+            /**
+             * Checks all leaf pages of the image, for walks that read every
+             * leaf without childAt
+             */
+            void checkImageLeaves() {
+                if (!image) return;
+                for (size_t offset = pageSize; offset < image->innerStart; offset += pageSize) {
+                    image->checkLeaf<BTreeLeaf<Key,Value>>(reinterpret_cast<NodeBase*>(image->base + offset));
+                }
+            }
+
             void makeRoot(Key k,NodeBase* leftChild,NodeBase* rightChild) {
                 auto inner = new BTreeInner<Key>();
                 inner->count = 1;
@@ -277,23 +614,174 @@ namespace btreeolc {
                 inner->children[0] = leftChild;
                 inner->children[1] = rightChild;
                 root = inner;
+                treeHeight++;
+                TRACE_EVENT(MakeRoot, inner, treeHeight);
             }
 
-            void yield(int count) {
-                if (count>3)
-                    sched_yield();
-                else
-                    _mm_pause();
+            /**
+             * Builds the inner levels above a complete level of nodes, where
+             * seps[i] is the largest key below nodes[i]. Parents get at most
+             * fanout children; by default maxEntries-1, one below full, so
+             * the first split below a parent fills it. Each level is built in
+             * parallel
+             * @return the root, height is set to the number of levels
+             */
+            NodeBase* buildInnerLevels(std::vector<NodeBase*> nodes, std::vector<Key> seps, int numThreads, int& height,
+                                       size_t fanout = BTreeInner<Key>::maxEntries - 1) {
+                height = 1;
+                while (nodes.size() > 1) {
+                    size_t numParents = (nodes.size() + fanout - 1) / fanout;
+                    std::vector<NodeBase*> parents(numParents);
+                    std::vector<Key> parentSeps(numParents);
+                    parallel::parallelFor(numParents, numThreads, [&](int threadId, size_t p) {
+                        size_t begin = p * nodes.size() / numParents;
+                        size_t end = (p + 1) * nodes.size() / numParents;
+                        auto inner = new BTreeInner<Key>();
+                        inner->count = end - begin - 1;
+                        for (size_t i = begin; i < end; i++) {
+                            inner->children[i - begin] = nodes[i];
+                            inner->keys[i - begin] = seps[i];
+                        }
+                        parents[p] = inner;
+                        parentSeps[p] = seps[end - 1];
+                    });
+                    nodes.swap(parents);
+                    seps.swap(parentSeps);
+                    height++;
+                }
+                return nodes[0];
             }
 
-            void insert(Key k, Value v) {
+            /**
+             * Replaces the contents of the tree with n sorted, unique keys.
+             * Leaves are filled to leafFill of their capacity, capped at full,
+             * and every level is built in parallel. No other operation may be
+             * running
+             */
+            void bulkLoad(const Key* keys, const Value* values, size_t n, double leafFill = 1.0,
+                          int numThreads = parallel::defaultThreads()) {
+                const double capacity = BTreeLeaf<Key,Value>::maxEntries;
+                size_t perLeaf = std::max(1.0, std::min(capacity, capacity * leafFill));
+                size_t numLeaves = std::max<size_t>(1, (n + perLeaf - 1) / perLeaf);
+                std::vector<NodeBase*> leaves(numLeaves);
+                std::vector<Key> seps(numLeaves);
+                parallel::parallelFor(numLeaves, numThreads, [&](int threadId, size_t l) {
+                    size_t begin = l * n / numLeaves;
+                    size_t end = (l + 1) * n / numLeaves;
+                    auto leaf = new BTreeLeaf<Key,Value>();
+                    leaf->count = end - begin;
+                    memcpy(leaf->keys, keys + begin, sizeof(Key) * leaf->count);
+                    memcpy(leaf->payloads, values + begin, sizeof(Value) * leaf->count);
+                    leaves[l] = leaf;
+                    seps[l] = leaf->count ? keys[end - 1] : Key();
+                });
+
+                int height;
+                NodeBase* newRoot = buildInnerLevels(leaves, seps, numThreads, height);
+                NodeBase* old = root;
+                Image* oldImage = image;
+                root = newRoot;
+                tailLeaf = static_cast<BTreeLeaf<Key,Value>*>(leaves.back());
+                treeHeight = height;
+                image = nullptr;
+                freeNodes(old, numThreads, oldImage);
+            }
+
+            /**
+             * Pre-builds an empty tree for about expectedCount keys in
+             * [minKey, maxKey]: leaves with evenly spread separators that end
+             * up about reserveFill full, and inner levels above them filled to
+             * reserveFill as well, so that loading the range barely splits.
+             * Only works on an empty tree and for arithmetic keys. No other
+             * operation may be running
+             * @return false if the tree is not empty or the range is empty
+             */
+            bool reserve(Key minKey, Key maxKey, size_t expectedCount, int numThreads = parallel::defaultThreads()) {
+                const double reserveFill = 0.7;
+                NodeBase* old = root;
+                if (old->type != PageType::BTreeLeaf || old->count != 0 || maxKey < minKey) {
+                    return false;
+                }
+                long double span = (long double)maxKey - (long double)minKey + 1;
+                size_t numLeaves = std::ceil(expectedCount / (BTreeLeaf<Key,Value>::maxEntries * reserveFill));
+                numLeaves = std::max<size_t>(1, std::min<long double>(numLeaves, span));
+
+                // Leaf l takes keys up to seps[l], the last leaf everything above
+                std::vector<Key> seps;
+                for (size_t l = 1; l < numLeaves; l++) {
+                    Key sep = parallel::evenBound(minKey, maxKey, l, numLeaves);
+                    if (seps.empty() || seps.back() < sep) {
+                        seps.push_back(sep);
+                    }
+                }
+                seps.push_back(maxKey);
+                std::vector<NodeBase*> leaves(seps.size());
+                parallel::parallelFor(leaves.size(), numThreads, [&](int threadId, size_t l) {
+                    leaves[l] = new BTreeLeaf<Key,Value>();
+                });
+
+                // Parents keep room for the splits of their leaves as well
+                size_t fanout = std::max<size_t>(2, (BTreeInner<Key>::maxEntries - 1) * reserveFill);
+                int height;
+                Image* oldImage = image;
+                root = buildInnerLevels(leaves, seps, numThreads, height, fanout);
+                tailLeaf = static_cast<BTreeLeaf<Key,Value>*>(leaves.back());
+                treeHeight = height;
+                image = nullptr;
+                freeNodes(old, 1, oldImage);
+                return true;
+            }
+
+            /**
+             * Merges a sorted run of (key, value) pairs into the tree, later
+             * pairs win on equal keys. The run is applied in segments of keys
+             * that belong to the same leaf: each segment costs one descent and
+             * one leaf lock, and a leaf that overflows is split into as many
+             * leaves as it needs under a single parent lock. Safe to run next
+             * to other operations
+             */
+            template<class Iterator>
+            void mergeSorted(Iterator begin, Iterator end) {
+                std::vector<Key> keys;
+                std::vector<Value> values;
+                while (begin != end) {
+                    begin = mergeSegment(begin, end, keys, values);
+                }
+            }
+
+            /**
+             * Inserts a micro-batch of n pairs. The batch is sorted and then
+             * merged with mergeSorted, so each target leaf costs one descent
+             * and one write lock. Later pairs win on equal keys
+             */
+            void insertBatch(const Key* keys, const Value* values, size_t n) {
+                std::vector<std::pair<Key,Value>> batch(n);
+                for (size_t i = 0; i < n; i++) {
+                    batch[i] = {keys[i], values[i]};
+                }
+                std::stable_sort(batch.begin(), batch.end(),
+                    [](const std::pair<Key,Value>& a, const std::pair<Key,Value>& b) { return a.first < b.first; });
+                mergeSorted(batch.begin(), batch.end());
+            }
+
+            /**
+             * Merges the longest prefix of [begin, end) that fits into the
+             * leaf of begin->first and the free slots of its parent. keys and
+             * values are scratch space
+             * @return the first pair that was not merged
+             */
+            template<class Iterator>
+            Iterator mergeSegment(Iterator begin, Iterator end, std::vector<Key>& keys, std::vector<Value>& values) {
+                typedef BTreeLeaf<Key,Value> Leaf;
+                const Key k = begin->first;
                 int restartCount = 0;
 restart:
-                if (restartCount++)
+                if (restartCount++) {
+                    timeline::countRestart();
                     yield(restartCount);
+                }
                 bool needRestart = false;
 
-                // Current node
                 NodeBase* node = root;
                 uint64_t versionNode = node->readLockOrRestart(needRestart);
                 if (needRestart || (node!=root)) goto restart;
@@ -302,6 +790,404 @@ restart:
                 BTreeInner<Key>* parent = nullptr;
                 uint64_t versionParent;
 
+                // The leaf holds keys up to upper, leaf splits bump its version
+                bool hasUpper = false;
+                Key upper = Key();
+
+                while (node->type==PageType::BTreeInner) {
+                    auto inner = static_cast<BTreeInner<Key>*>(node);
+
+                    if (parent) {
+                        parent->readUnlockOrRestart(versionParent, needRestart);
+                        if (needRestart) goto restart;
+                    }
+
+                    parent = inner;
+                    versionParent = versionNode;
+
+                    unsigned pos = inner->lowerBound(k);
+                    if (pos < inner->count) {
+                        hasUpper = true;
+                        upper = inner->keys[pos];
+                    }
+                    node = childAt(inner, pos);
+                    inner->checkOrRestart(versionNode, needRestart);
+                    if (needRestart) goto restart;
+                    versionNode = node->readLockOrRestart(needRestart);
+                    if (needRestart) goto restart;
+                }
+
+                auto leaf = static_cast<Leaf*>(node);
+
+                // Both counts are read optimistically and validated by the upgrades below
+                unsigned leafCount = leaf->count;
+                unsigned parentCount = parent ? parent->count : 0;
+                if (leafCount > Leaf::maxEntries || parentCount > BTreeInner<Key>::maxEntries - 1) goto restart;
+                size_t freeSlots = BTreeInner<Key>::maxEntries - 1 - parentCount;
+                size_t room = (freeSlots + 1) * Leaf::maxEntries - leafCount;
+                if (room == 0) {
+                    // Leaf and parent are full, let insert split them
+                    insert(k, begin->second);
+                    return ++begin;
+                }
+
+                Iterator segmentEnd = begin;
+                size_t segmentSize = 0;
+                while (segmentEnd != end && segmentSize < room && (!hasUpper || !(upper < segmentEnd->first))) {
+                    ++segmentEnd;
+                    segmentSize++;
+                }
+
+                // Lock, the parent only if the leaf may split
+                bool mayOverflow = leafCount + segmentSize > Leaf::maxEntries;
+                if (parent && mayOverflow) {
+                    parent->upgradeToWriteLockOrRestart(versionParent, needRestart);
+                    if (needRestart) goto restart;
+                }
+                node->upgradeToWriteLockOrRestart(versionNode, needRestart);
+                if (needRestart) {
+                    if (parent && mayOverflow) parent->writeUnlock();
+                    goto restart;
+                }
+                if (!parent && (node != root)) { // there's a new parent
+                    node->writeUnlock();
+                    goto restart;
+                }
+                if (parent && !mayOverflow) {
+                    parent->readUnlockOrRestart(versionParent, needRestart);
+                    if (needRestart) {
+                        node->writeUnlock();
+                        goto restart;
+                    }
+                }
+
+                copyOnWrite(leaf);
+                size_t total = mergeIntoBuffer(leaf, begin, segmentEnd, keys, values);
+                if (total <= Leaf::maxEntries) {
+                    memcpy(leaf->keys, keys.data(), sizeof(Key) * total);
+                    memcpy(leaf->payloads, values.data(), sizeof(Value) * total);
+                    leaf->count = total;
+                    node->writeUnlock();
+                    if (parent && mayOverflow)
+                        parent->writeUnlock();
+                    return segmentEnd;
+                }
+
+                // Split into leaves about three quarters full, as far as the parent has room
+                size_t minLeaves = (total + Leaf::maxEntries - 1) / Leaf::maxEntries;
+                size_t numLeaves = (total * 4 + Leaf::maxEntries * 3 - 1) / (Leaf::maxEntries * 3);
+                numLeaves = std::max(minLeaves, std::min(numLeaves, freeSlots + 1));
+                BTreeInner<Key>* target = parent;
+                unsigned pos = 0;
+                if (parent) {
+                    pos = parent->lowerBound(k);
+                } else {
+                    target = new BTreeInner<Key>();
+                    target->children[0] = leaf;
+                }
+                // Open a gap behind the leaf for the new separators and leaves
+                size_t shift = numLeaves - 1;
+                memmove(target->keys + pos + shift, target->keys + pos, sizeof(Key) * (target->count - pos));
+                memmove(target->children + pos + 1 + shift, target->children + pos + 1, sizeof(NodeBase*) * (target->count - pos));
+                for (size_t l = 1; l < numLeaves; l++) {
+                    size_t from = l * total / numLeaves;
+                    size_t to = (l + 1) * total / numLeaves;
+                    auto newLeaf = new Leaf();
+                    newLeaf->snapshotEpoch = leaf->snapshotEpoch;
+                    newLeaf->count = to - from;
+                    memcpy(newLeaf->keys, keys.data() + from, sizeof(Key) * newLeaf->count);
+                    memcpy(newLeaf->payloads, values.data() + from, sizeof(Value) * newLeaf->count);
+                    target->keys[pos + l - 1] = keys[from - 1];
+                    target->children[pos + l] = newLeaf;
+                    if (!hasUpper && l == numLeaves - 1) {
+                        tailLeaf = newLeaf;
+                    }
+                }
+                target->count += shift;
+                leaf->count = total / numLeaves;
+                memcpy(leaf->keys, keys.data(), sizeof(Key) * leaf->count);
+                memcpy(leaf->payloads, values.data(), sizeof(Value) * leaf->count);
+                TRACE_EVENT(SplitLeaf, leaf, numLeaves);
+                if (!parent) {
+                    root = target;
+                    treeHeight++;
+                    TRACE_EVENT(MakeRoot, target, treeHeight);
+                }
+
+                node->writeUnlock();
+                if (parent)
+                    parent->writeUnlock();
+                return segmentEnd;
+            }
+
+            /**
+             * Merges the leaf's entries with the sorted pairs [begin, end)
+             * into keys and values, pairs win over the leaf and later pairs
+             * over earlier ones
+             * @return number of merged entries
+             */
+            template<class Iterator>
+            size_t mergeIntoBuffer(BTreeLeaf<Key,Value>* leaf, Iterator begin, Iterator end,
+                                   std::vector<Key>& keys, std::vector<Value>& values) {
+                size_t total = 0;
+                auto append = [&](const Key& key, const Value& value) {
+                    if (total && keys[total - 1] == key) {
+                        values[total - 1] = value;
+                        return;
+                    }
+                    if (total == keys.size()) {
+                        keys.resize(std::max<size_t>(2 * total, size_t(BTreeLeaf<Key,Value>::maxEntries)));
+                        values.resize(keys.size());
+                    }
+                    keys[total] = key;
+                    values[total] = value;
+                    total++;
+                };
+                unsigned i = 0;
+                for (Iterator it = begin; it != end; ++it) {
+                    while (i < leaf->count && leaf->keys[i] < it->first) {
+                        append(leaf->keys[i], leaf->payloads[i]);
+                        i++;
+                    }
+                    if (i < leaf->count && leaf->keys[i] == it->first) {
+                        i++;
+                    }
+                    append(it->first, it->second);
+                }
+                for (; i < leaf->count; i++) {
+                    append(leaf->keys[i], leaf->payloads[i]);
+                }
+                return total;
+            }
+
+            void yield(int count) {
+                if (count>3)
+                    sched_yield();
+                else
+                    _mm_pause();
+            }
+
+            /**
+             * Appends k to the right-most leaf without a descent if k is
+             * larger than every key in it and the leaf has room
+             * @return false if the caller has to take the regular path
+             */
+            bool appendToTail(Key k, Value v) {
+                bool needRestart = false;
+                BTreeLeaf<Key,Value>* leaf = tailLeaf;
+                uint64_t version = leaf->readLockOrRestart(needRestart);
+                if (needRestart || leaf != tailLeaf) return false;
+                unsigned count = leaf->count;
+                if (count == 0 || count >= BTreeLeaf<Key,Value>::maxEntries || !(leaf->keys[count-1] < k)) return false;
+                leaf->upgradeToWriteLockOrRestart(version, needRestart);
+                if (needRestart) return false;
+                copyOnWrite(leaf);
+                leaf->keys[count] = k;
+                leaf->payloads[count] = v;
+                leaf->count = count + 1;
+                leaf->writeUnlock();
+                return true;
+            }
+
+            /**
+             * Called with leaf write locked at version: applies the inserts
+             * other threads published for this lock session, sorted and in
+             * one merge. Requests that do not fit are sent back to retry
+             */
+            void combine(BTreeLeaf<Key,Value>* leaf, uint64_t version) {
+                typedef combining::Request<Key,Value> Request;
+                Request* claimed[combining::slotsPerBucket];
+                unsigned n = combiner.claim(leaf, version, claimed);
+                if (n == 0) return;
+                std::sort(claimed, claimed + n, [](Request* a, Request* b) { return a->key < b->key; });
+
+                Key keys[combining::slotsPerBucket];
+                Value values[combining::slotsPerBucket];
+                Request* applied[combining::slotsPerBucket];
+                unsigned m = 0, numApplied = 0;
+                for (unsigned i = 0; i < n; i++) {
+                    Request* req = claimed[i];
+                    unsigned pos = leaf->count ? leaf->lowerBound(req->key) : 0;
+                    if (pos < leaf->count && leaf->keys[pos] == req->key) {
+                        leaf->payloads[pos] = req->value;
+                    } else if (m && keys[m-1] == req->key) {
+                        values[m-1] = req->value;
+                    } else if (leaf->count + m < BTreeLeaf<Key,Value>::maxEntries) {
+                        keys[m] = req->key;
+                        values[m] = req->value;
+                        m++;
+                    } else {
+                        req->state.store(combining::RequestState::Retry, std::memory_order_release);
+                        continue;
+                    }
+                    applied[numApplied++] = req;
+                }
+                leaf->insertSorted(keys, values, m);
+                for (unsigned i = 0; i < numApplied; i++) {
+                    applied[i]->state.store(combining::RequestState::Done, std::memory_order_release);
+                }
+            }
+
+            /**
+             * Called when the leaf k was routed to is write locked. If the
+             * leaf is hot, hands the insert to the lock holder instead of
+             * restarting. The parent check makes sure the leaf still covered
+             * k when its locked version was read
+             * @return true if the lock holder applied the insert
+             */
+            bool joinCombining(NodeBase* leaf, uint64_t version, BTreeInner<Key>* parent, uint64_t versionParent,
+                               Key k, Value v) {
+                if (!parent || !leaf->isLocked(version) || leaf->isObsolete(version)) return false;
+                bool needRestart = false;
+                parent->readUnlockOrRestart(versionParent, needRestart);
+                if (needRestart) return false;
+                combining::Request<Key,Value> req;
+                req.key = k;
+                req.value = v;
+                req.leaf = leaf;
+                req.version = version;
+                return combiner.publishAndWait(req, [leaf]() { return leaf->typeVersionLockObsolete.load(); });
+            }
+
+            void insert(Key k, Value v) {
+                if (appendToTail(k, v)) return;
+                writeLeaf(k, true, &v, [&](BTreeLeaf<Key,Value>* leaf) {
+                    leaf->insert(k, v);
+                    return true;
+                });
+            }
+
+            /**
+             * Inserts k unless it is already present
+             * @return false if k was present, its value is then in existing
+             */
+            bool insertIfAbsent(Key k, Value v, Value& existing) {
+                if (appendToTail(k, v)) return true;
+                return writeLeaf(k, true, nullptr, [&](BTreeLeaf<Key,Value>* leaf) {
+                    if (Value* current = leaf->payloadFor(k)) {
+                        existing = *current;
+                        return false;
+                    }
+                    leaf->insert(k, v);
+                    return true;
+                });
+            }
+
+            /**
+             * Overwrites the value of k
+             * @return false if k is absent
+             */
+            bool update(Key k, Value v) {
+                return writeLeaf(k, false, nullptr, [&](BTreeLeaf<Key,Value>* leaf) {
+                    Value* current = leaf->payloadFor(k);
+                    if (current) {
+                        *current = v;
+                    }
+                    return current != nullptr;
+                });
+            }
+
+            /**
+             * Sets the value of k to desired if it is expected
+             * @return false if k is absent or holds another value
+             */
+            bool compareAndSwap(Key k, Value expected, Value desired) {
+                return writeLeaf(k, false, nullptr, [&](BTreeLeaf<Key,Value>* leaf) {
+                    Value* current = leaf->payloadFor(k);
+                    if (!current || !(*current == expected)) {
+                        return false;
+                    }
+                    *current = desired;
+                    return true;
+                });
+            }
+
+            /**
+             * Removes k. Leaves are not merged, an emptied leaf stays in place
+             * @return false if k is absent
+             */
+            bool remove(Key k) {
+                return writeLeaf(k, false, nullptr, [&](BTreeLeaf<Key,Value>* leaf) {
+                    return leaf->remove(k);
+                });
+            }
+
+            /**
+             * Removes the keys in (low, high], one descent and one leaf lock
+             * per leaf they are in. Leaves are not merged
+             * @return number of keys removed
+             */
+            uint64_t removeRange(Key low, Key high) {
+                uint64_t removed = 0;
+                Key first;
+                Value value;
+                while (scanEntries(low, 1, &first, &value, true) == 1 && !(high < first)) {
+                    writeLeaf(first, false, nullptr, [&](BTreeLeaf<Key,Value>* leaf) {
+                        removed += leaf->removeRange(low, high);
+                        return true;
+                    });
+                }
+                return removed;
+            }
+
+            /**
+             * Replaces the value of k with fn(value) under the leaf lock
+             * @return false if k is absent, otherwise the old value is in previous
+             */
+            template<class Fn>
+            bool fetchAndApply(Key k, Fn fn, Value& previous) {
+                return writeLeaf(k, false, nullptr, [&](BTreeLeaf<Key,Value>* leaf) {
+                    Value* current = leaf->payloadFor(k);
+                    if (!current) {
+                        return false;
+                    }
+                    previous = *current;
+                    *current = fn(previous);
+                    return true;
+                });
+            }
+
+            /**
+             * Descends to the leaf of k and runs apply on it under the leaf's
+             * write lock, splitting full nodes on the way if mayGrow. If
+             * combinable is set, a hot locked leaf may take the insert of
+             * (k, *combinable) through combining instead
+             * @return what apply returned (true if the insert was combined)
+             */
+            template<class Apply>
+            bool writeLeaf(Key k, bool mayGrow, const Value* combinable, Apply apply) {
+                int restartCount = 0;
+                descent::AncestorStack<NodeBase> path;
+restart:
+                if (restartCount++) {
+                    timeline::countRestart();
+                    yield(restartCount);
+                }
+                bool needRestart = false;
+
+                // Current node, the deepest ancestor that is still valid or the root
+                NodeBase* node;
+                uint64_t versionNode;
+
+                // Whether node is the right-most node of its level
+                bool rightmost;
+
+                if (path.trim(root)) {
+                    auto resume = path.pop();
+                    node = resume.node;
+                    versionNode = resume.version;
+                    rightmost = resume.rightmost;
+                } else {
+                    node = root;
+                    versionNode = node->readLockOrRestart(needRestart);
+                    if (needRestart || (node!=root)) goto restart;
+                    rightmost = true;
+                }
+
+                // Parent of current node, always the top of path
+                BTreeInner<Key>* parent = path.empty() ? nullptr : static_cast<BTreeInner<Key>*>(path.top().node);
+                uint64_t versionParent = path.empty() ? 0 : path.top().version;
+
                 while (node->type==PageType::BTreeInner) {
                     auto inner = static_cast<BTreeInner<Key>*>(node);
 
@@ -322,16 +1208,23 @@ restart:
                             node->writeUnlock();
                             goto restart;
                         }
-                        // Split
-                        Key sep; BTreeInner<Key>* newInner = inner->split(sep);
+                        // Split, appends leave the left node nearly full
+                        Key sep; BTreeInner<Key>* newInner;
+                        if (rightmost && inner->keys[inner->count-1] < k)
+                            newInner = inner->split(sep, inner->count * appendSplitKeep);
+                        else
+                            newInner = inner->split(sep);
+                        TRACE_EVENT(SplitInner, inner, inner->count);
                         if (parent)
                             parent->insert(sep,newInner);
                         else
                             makeRoot(sep,inner,newInner);
-                        // Unlock and restart
+                        // Unlock and continue from the parent, at the version the unlock leaves
                         node->writeUnlock();
-                        if (parent)
+                        if (parent) {
                             parent->writeUnlock();
+                            path.top().version = versionParent + 0b10;
+                        }
                         goto restart;
                     }
 
@@ -342,18 +1235,26 @@ restart:
 
                     parent = inner;
                     versionParent = versionNode;
+                    path.push(inner, versionNode, rightmost);
 
-                    node = inner->children[inner->lowerBound(k)];
+                    unsigned pos = inner->lowerBound(k);
+                    rightmost = rightmost && pos == inner->count;
+                    node = childAt(inner, pos);
                     inner->checkOrRestart(versionNode, needRestart);
                     if (needRestart) goto restart;
                     versionNode = node->readLockOrRestart(needRestart);
-                    if (needRestart) goto restart;
+                    if (needRestart) {
+                        if (combinable && node->type==PageType::BTreeLeaf &&
+                            joinCombining(node, versionNode, parent, versionParent, k, *combinable))
+                            return true;
+                        goto restart;
+                    }
                 }
 
                 auto leaf = static_cast<BTreeLeaf<Key,Value>*>(node);
 
                 // Split leaf if full
-                if (leaf->count==leaf->maxEntries) {
+                if (mayGrow && leaf->count==leaf->maxEntries) {
                     // Lock
                     if (parent) {
                         parent->upgradeToWriteLockOrRestart(versionParent, needRestart);
@@ -368,16 +1269,26 @@ restart:
                         node->writeUnlock();
                         goto restart;
                     }
-                    // Split
-                    Key sep; BTreeLeaf<Key,Value>* newLeaf = leaf->split(sep);
+                    // Split, appends leave the left leaf nearly full
+                    copyOnWrite(leaf);
+                    Key sep; BTreeLeaf<Key,Value>* newLeaf;
+                    if (rightmost && leaf->keys[leaf->count-1] < k)
+                        newLeaf = leaf->split(sep, leaf->count * appendSplitKeep);
+                    else
+                        newLeaf = leaf->split(sep);
+                    if (rightmost)
+                        tailLeaf = newLeaf;
+                    TRACE_EVENT(SplitLeaf, leaf, leaf->count);
                     if (parent)
                         parent->insert(sep, newLeaf);
                     else
                         makeRoot(sep, leaf, newLeaf);
-                    // Unlock and restart
+                    // Unlock and continue from the parent, at the version the unlock leaves
                     node->writeUnlock();
-                    if (parent)
+                    if (parent) {
                         parent->writeUnlock();
+                        path.top().version = versionParent + 0b10;
+                    }
                     goto restart;
                 } else {
                     // only lock leaf node
@@ -390,26 +1301,40 @@ restart:
                             goto restart;
                         }
                     }
-                    leaf->insert(k, v);
+                    copyOnWrite(leaf);
+                    bool result = apply(leaf);
+                    combine(leaf, versionNode);
                     node->writeUnlock();
-                    return; // success
+                    return result; // success
                 }
             }
 
             bool lookup(Key k, Value& result) {
                 int restartCount = 0;
+                descent::AncestorStack<NodeBase> path;
 restart:
-                if (restartCount++)
+                if (restartCount++) {
+                    timeline::countRestart();
                     yield(restartCount);
+                }
                 bool needRestart = false;
 
-                NodeBase* node = root;
-                uint64_t versionNode = node->readLockOrRestart(needRestart);
-                if (needRestart || (node!=root)) goto restart;
+                // Current node, the deepest ancestor that is still valid or the root
+                NodeBase* node;
+                uint64_t versionNode;
+                if (path.trim(root)) {
+                    auto resume = path.pop();
+                    node = resume.node;
+                    versionNode = resume.version;
+                } else {
+                    node = root;
+                    versionNode = node->readLockOrRestart(needRestart);
+                    if (needRestart || (node!=root)) goto restart;
+                }
 
-                // Parent of current node
-                BTreeInner<Key>* parent = nullptr;
-                uint64_t versionParent;
+                // Parent of current node, always the top of path
+                BTreeInner<Key>* parent = path.empty() ? nullptr : static_cast<BTreeInner<Key>*>(path.top().node);
+                uint64_t versionParent = path.empty() ? 0 : path.top().version;
 
                 while (node->type==PageType::BTreeInner) {
                     auto inner = static_cast<BTreeInner<Key>*>(node);
@@ -421,8 +1346,9 @@ restart:
 
                     parent = inner;
                     versionParent = versionNode;
+                    path.push(inner, versionNode);
 
-                    node = inner->children[inner->lowerBound(k)];
+                    node = childAt(inner, inner->lowerBound(k));
                     inner->checkOrRestart(versionNode, needRestart);
                     if (needRestart) goto restart;
                     versionNode = node->readLockOrRestart(needRestart);
@@ -431,7 +1357,7 @@ restart:
 
                 BTreeLeaf<Key,Value>* leaf = static_cast<BTreeLeaf<Key,Value>*>(node);
                 unsigned pos = leaf->lowerBound(k);
-                bool success;
+                bool success = false;
                 if ((pos<leaf->count) && (leaf->keys[pos]==k)) {
                     success = true;
                     result = leaf->payloads[pos];
@@ -449,8 +1375,10 @@ restart:
             uint64_t scan(Key k, int range, Value* output) {
                 int restartCount = 0;
 restart:
-                if (restartCount++)
+                if (restartCount++) {
+                    timeline::countRestart();
                     yield(restartCount);
+                }
                 bool needRestart = false;
 
                 NodeBase* node = root;
@@ -472,7 +1400,7 @@ restart:
                     parent = inner;
                     versionParent = versionNode;
 
-                    node = inner->children[inner->lowerBound(k)];
+                    node = childAt(inner, inner->lowerBound(k));
                     inner->checkOrRestart(versionNode, needRestart);
                     if (needRestart) goto restart;
                     versionNode = node->readLockOrRestart(needRestart);
@@ -498,6 +1426,494 @@ restart:
                 return count;
             }
 
+            /**
+             * Copies up to range entries with keys >= k (> k if exclusive) in
+             * key order, following on into the next leaves. Each leaf is read
+             * consistently, entries of different leaves may come from
+             * different points in time
+             * @return number of entries written to keysOut and valuesOut
+             */
+            uint64_t scanEntries(Key k, int range, Key* keysOut, Value* valuesOut, bool exclusive = false) {
+                return scanEntries(k, range, keysOut, valuesOut, exclusive, nullptr);
+            }
+
+            /**
+             * Same as scanEntries, and adds every leaf it read with the
+             * version it read it at to nodeSet. The leaves cover the whole
+             * scanned range, so validate(nodeSet) fails after any insert into
+             * that range as well as after changes to the entries returned
+             */
+            uint64_t scanEntries(Key k, int range, Key* keysOut, Value* valuesOut, NodeSet& nodeSet, bool exclusive = false) {
+                return scanEntries(k, range, keysOut, valuesOut, exclusive, &nodeSet);
+            }
+
+            /**
+             * Whether no leaf of nodeSet has changed since it was read. Takes
+             * no locks, a leaf that is locked right now counts as changed
+             */
+            bool validate(const NodeSet& nodeSet) const {
+                for (const NodeSetEntry& entry : nodeSet) {
+                    if (entry.node->typeVersionLockObsolete.load() != entry.version) {
+                        return false;
+                    }
+                }
+                return true;
+            }
+
+            uint64_t scanEntries(Key k, int range, Key* keysOut, Value* valuesOut, bool exclusive, NodeSet* nodeSet) {
+                int count = 0;
+                int restartCount = 0;
+                while (count < range) {
+restart:
+                    if (restartCount++) {
+                        timeline::countRestart();
+                        yield(restartCount);
+                    }
+                    bool needRestart = false;
+
+                    NodeBase* node = root;
+                    uint64_t versionNode = node->readLockOrRestart(needRestart);
+                    if (needRestart || (node!=root)) goto restart;
+
+                    // Parent of current node
+                    BTreeInner<Key>* parent = nullptr;
+                    uint64_t versionParent;
+
+                    // The leaf holds keys up to upper, the next leaf starts after it
+                    bool hasUpper = false;
+                    Key upper = Key();
+
+                    while (node->type==PageType::BTreeInner) {
+                        auto inner = static_cast<BTreeInner<Key>*>(node);
+
+                        if (parent) {
+                            parent->readUnlockOrRestart(versionParent, needRestart);
+                            if (needRestart) goto restart;
+                        }
+
+                        parent = inner;
+                        versionParent = versionNode;
+
+                        unsigned pos = inner->lowerBound(k);
+                        if (exclusive && pos < inner->count && inner->keys[pos] == k) {
+                            pos++;
+                        }
+                        if (pos < inner->count) {
+                            hasUpper = true;
+                            upper = inner->keys[pos];
+                        }
+                        node = childAt(inner, pos);
+                        inner->checkOrRestart(versionNode, needRestart);
+                        if (needRestart) goto restart;
+                        versionNode = node->readLockOrRestart(needRestart);
+                        if (needRestart) goto restart;
+                    }
+
+                    BTreeLeaf<Key,Value>* leaf = static_cast<BTreeLeaf<Key,Value>*>(node);
+                    unsigned leafCount = leaf->count;
+                    if (leafCount > BTreeLeaf<Key,Value>::maxEntries) goto restart;
+                    unsigned pos = leaf->lowerBound(k);
+                    if (exclusive && pos < leafCount && leaf->keys[pos] == k) {
+                        pos++;
+                    }
+                    // Written optimistically, a restart overwrites the same slots
+                    int read = 0;
+                    for (unsigned i=pos; i<leafCount && count+read<range; i++) {
+                        keysOut[count+read] = leaf->keys[i];
+                        valuesOut[count+read] = leaf->payloads[i];
+                        read++;
+                    }
+
+                    if (parent) {
+                        parent->readUnlockOrRestart(versionParent, needRestart);
+                        if (needRestart) goto restart;
+                    }
+                    node->readUnlockOrRestart(versionNode, needRestart);
+                    if (needRestart) goto restart;
+
+                    if (nodeSet) {
+                        nodeSet->push_back(NodeSetEntry{node, versionNode});
+                    }
+                    count += read;
+                    if (!hasUpper) {
+                        break;
+                    }
+                    k = upper;
+                    exclusive = true;
+                    restartCount = 0;
+                }
+                return count;
+            }
+
+            /**
+             * Takes a copy-on-write snapshot of the tree in O(1): from now on
+             * every leaf is copied before its first change. Writes that
+             * locked their leaf before are part of the snapshot. One
+             * snapshot can be active at a time
+             * @return false if a snapshot is already active
+             */
+            bool beginSnapshot() {
+                uint64_t expected = 0;
+                return activeSnapshot.compare_exchange_strong(expected, lastSnapshot.fetch_add(1) + 1);
+            }
+
+            /**
+             * Drops the active snapshot and frees the copies made for it.
+             * exportSnapshot must have returned
+             */
+            void endSnapshot() {
+                activeSnapshot = 0;
+                freeFrozen();
+            }
+
+            /**
+             * Streams the active snapshot to path in key order as packed
+             * BTreeLeaf::Entry records, the format ingest::ingestFile reads
+             * for int64 keys and values. Writers go on meanwhile, the leaves
+             * they change are read from their frozen copies
+             * @return false if no snapshot is active or path cannot be written
+             */
+            bool exportSnapshot(const char* path, uint64_t* written = nullptr) {
+                typedef BTreeLeaf<Key,Value> Leaf;
+                uint64_t snapshot = activeSnapshot.load();
+                if (!snapshot) return false;
+                FILE* file = fopen(path, "wb");
+                if (!file) return false;
+
+                std::vector<typename Leaf::Entry> buffer;
+                buffer.reserve(exportBuffer);
+                Key keys[Leaf::maxEntries];
+                Value values[Leaf::maxEntries];
+                uint64_t count = 0;
+                bool ok = true;
+                bool hasLast = false;
+                Key last = Key();
+                bool first = true;
+                bool hasUpper;
+                Key upper = Key();
+                do {
+                    unsigned n = readSnapshotLeaf(upper, first, snapshot, keys, values, hasUpper, upper);
+                    first = false;
+                    for (unsigned i = 0; i < n; i++) {
+                        // A frozen copy also holds the keys of leaves split off after the snapshot
+                        if (hasLast && !(last < keys[i])) continue;
+                        buffer.push_back({keys[i], values[i]});
+                        last = keys[i];
+                        hasLast = true;
+                    }
+                    if (buffer.size() >= exportBuffer - Leaf::maxEntries || !hasUpper) {
+                        ok = ok && fwrite(buffer.data(), sizeof(buffer[0]), buffer.size(), file) == buffer.size();
+                        count += buffer.size();
+                        buffer.clear();
+                    }
+                } while (hasUpper);
+                ok = (fclose(file) == 0) && ok;
+                if (written) *written = count;
+                return ok;
+            }
+
+            /**
+             * Takes a snapshot and streams it to path on a background
+             * thread, see exportSnapshot. The snapshot ends with the export
+             * @return false if a snapshot is already active
+             */
+            bool checkpoint(const char* path) {
+                if (!beginSnapshot()) return false;
+                std::string file(path);
+                checkpointer.run([this, file]() {
+                    checkpointOk = exportSnapshot(file.c_str());
+                    endSnapshot();
+                });
+                return true;
+            }
+
+            /**
+             * Waits for the last checkpoint
+             * @return whether it was written completely
+             */
+            bool waitCheckpoint() {
+                checkpointer.wait();
+                return checkpointOk;
+            }
+
+            /**
+             * Writes the tree to path as a page image for openImage: leaf
+             * pages filled to leafFill in key order, then the inner levels
+             * above them, which link their children by byte offset. No
+             * writer may be running
+             * @return false if path cannot be written
+             */
+            bool saveImage(const char* path, double leafFill = 1.0) {
+                typedef BTreeLeaf<Key,Value> Leaf;
+                typedef BTreeInner<Key> Inner;
+                static_assert(std::is_trivially_copyable<Key>::value && std::is_trivially_copyable<Value>::value,
+                              "image pages are copied bytewise");
+                static_assert(sizeof(Leaf) <= pageSize && sizeof(Inner) <= pageSize, "nodes must fit into a page");
+                FILE* file = fopen(path, "wb");
+                if (!file) return false;
+
+                alignas(64) char page[pageSize];
+                uint64_t next = 0;
+                bool ok = true;
+                auto writePage = [&]() {
+                    ok = ok && fwrite(page, pageSize, 1, file) == 1;
+                    return pageSize * next++;
+                };
+                memset(page, 0, pageSize);
+                writePage(); // header, written last
+
+                const size_t capacity = Leaf::maxEntries;
+                size_t perLeaf = std::max<size_t>(1, std::min<size_t>(capacity, capacity * leafFill));
+                std::vector<uint64_t> offsets;
+                std::vector<Key> seps;
+                uint64_t numKeys = 0;
+                Key k = std::numeric_limits<Key>::lowest();
+                bool exclusive = false;
+                uint64_t got;
+                do {
+                    memset(page, 0, pageSize);
+                    auto leaf = new (page) Leaf();
+                    got = scanEntries(k, perLeaf, leaf->keys, leaf->payloads, exclusive);
+                    if (got == 0 && !offsets.empty()) break;
+                    leaf->count = got;
+                    seps.push_back(got ? leaf->keys[got - 1] : Key());
+                    offsets.push_back(writePage());
+                    numKeys += got;
+                    if (got) {
+                        k = leaf->keys[got - 1];
+                        exclusive = true;
+                    }
+                } while (got == perLeaf);
+                uint64_t leafPages = offsets.size();
+
+                // Same shape as buildInnerLevels
+                const size_t fanout = Inner::maxEntries - 1;
+                uint64_t height = 1;
+                while (offsets.size() > 1) {
+                    size_t numParents = (offsets.size() + fanout - 1) / fanout;
+                    std::vector<uint64_t> parentOffsets(numParents);
+                    std::vector<Key> parentSeps(numParents);
+                    for (size_t p = 0; p < numParents; p++) {
+                        size_t begin = p * offsets.size() / numParents;
+                        size_t end = (p + 1) * offsets.size() / numParents;
+                        memset(page, 0, pageSize);
+                        auto inner = new (page) Inner();
+                        inner->count = end - begin - 1;
+                        for (size_t i = begin; i < end; i++) {
+                            inner->children[i - begin] = reinterpret_cast<NodeBase*>(offsets[i]);
+                            inner->keys[i - begin] = seps[i];
+                        }
+                        parentOffsets[p] = writePage();
+                        parentSeps[p] = seps[end - 1];
+                    }
+                    offsets.swap(parentOffsets);
+                    seps.swap(parentSeps);
+                    height++;
+                }
+
+                memset(page, 0, pageSize);
+                auto header = reinterpret_cast<ImageHeader*>(page);
+                memcpy(header->magic, imageMagic, sizeof(imageMagic));
+                header->pageSize = pageSize;
+                header->keySize = sizeof(Key);
+                header->valueSize = sizeof(Value);
+                header->leafPages = leafPages;
+                header->innerPages = next - 1 - leafPages;
+                header->rootOffset = offsets[0];
+                header->height = height;
+                header->numKeys = numKeys;
+                ok = ok && fseek(file, 0, SEEK_SET) == 0 && fwrite(page, pageSize, 1, file) == 1;
+                ok = (fclose(file) == 0) && ok;
+                return ok;
+            }
+
+            /**
+             * Replaces the contents of the tree with the image at path, see
+             * saveImage. The file is opened read-only but mapped writable
+             * and private (PROT_WRITE, MAP_PRIVATE): pages become mutable
+             * through the kernel's copy-on-write on their first write rather
+             * than through an explicit promotion step, and the file itself
+             * never changes. All inner pages are checked and their child
+             * offsets rewritten to pointers in place here. Leaf pages are
+             * only faulted in by the operations that reach them and checked
+             * then, see Image::checkLeaf. No other operation may be running
+             * @return false if path cannot be mapped or is not an image of
+             * this tree type
+             */
+            bool openImage(const char* path) {
+                typedef BTreeInner<Key> Inner;
+                int fd = ::open(path, O_RDONLY);
+                if (fd < 0) return false;
+                ImageHeader header;
+                off_t fileSize = lseek(fd, 0, SEEK_END);
+                bool valid = pread(fd, &header, sizeof(header), 0) == sizeof(header)
+                    && memcmp(header.magic, imageMagic, sizeof(imageMagic)) == 0
+                    && header.pageSize == pageSize && header.keySize == sizeof(Key) && header.valueSize == sizeof(Value)
+                    && header.leafPages > 0
+                    && (uint64_t)fileSize == (1 + header.leafPages + header.innerPages) * pageSize
+                    && header.rootOffset == (uint64_t)fileSize - pageSize;
+                void* base = valid ? mmap(nullptr, fileSize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+                ::close(fd);
+                if (base == MAP_FAILED) return false;
+                auto newImage = new Image(static_cast<char*>(base), fileSize, (1 + header.leafPages) * pageSize);
+
+                // Where each level starts, leaves first, with the shape saveImage writes
+                const size_t fanout = Inner::maxEntries - 1;
+                std::vector<size_t> levelStart{pageSize, newImage->innerStart};
+                for (size_t pages = header.leafPages; pages > 1;) {
+                    pages = (pages + fanout - 1) / fanout;
+                    levelStart.push_back(levelStart.back() + pages * pageSize);
+                }
+                valid = levelStart.back() == newImage->size && levelStart.size() - 1 == header.height;
+
+                // Children of a level must lie on the level below, so no page is
+                // taken for one of another type or level before it is read
+                for (size_t level = 1; valid && level + 1 < levelStart.size(); level++) {
+                    for (size_t offset = levelStart[level]; valid && offset < levelStart[level + 1]; offset += pageSize) {
+                        auto inner = reinterpret_cast<Inner*>(newImage->base + offset);
+                        valid = inner->type == PageType::BTreeInner && inner->count < Inner::maxEntries &&
+                                inner->typeVersionLockObsolete.load() == 0b100;
+                        for (unsigned i = 0; valid && i <= inner->count; i++) {
+                            uint64_t child = reinterpret_cast<uint64_t>(inner->children[i]);
+                            valid = child >= levelStart[level - 1] && child < levelStart[level] && child % pageSize == 0;
+                            inner->children[i] = reinterpret_cast<NodeBase*>(newImage->base + child);
+                        }
+                    }
+                }
+                if (!valid) {
+                    delete newImage;
+                    return false;
+                }
+
+                NodeBase* newRoot = reinterpret_cast<NodeBase*>(newImage->base + header.rootOffset);
+                NodeBase* tail = newRoot;
+                for (uint64_t level = 1; level < header.height; level++) {
+                    tail = static_cast<Inner*>(tail)->children[tail->count];
+                }
+                newImage->checkLeaf<BTreeLeaf<Key,Value>>(tail);
+                NodeBase* old = root;
+                Image* oldImage = image;
+                root = newRoot;
+                tailLeaf = static_cast<BTreeLeaf<Key,Value>*>(tail);
+                treeHeight = header.height;
+                image = newImage;
+                freeNodes(old, parallel::defaultThreads(), oldImage);
+                return true;
+            }
+
+            /**
+             * Called with leaf write locked before changing it: the first
+             * change under a snapshot keeps a frozen copy of the leaf for it
+             */
+            void copyOnWrite(BTreeLeaf<Key,Value>* leaf) {
+                uint64_t snapshot = activeSnapshot.load();
+                if (!snapshot || leaf->snapshotEpoch >= snapshot) return;
+                auto copy = new BTreeLeaf<Key,Value>();
+                copy->count = leaf->count;
+                memcpy(copy->keys, leaf->keys, sizeof(Key) * leaf->count);
+                memcpy(copy->payloads, leaf->payloads, sizeof(Value) * leaf->count);
+                BTreeLeafBase* top = frozenLeaves.load();
+                do {
+                    copy->frozen = top;
+                } while (!frozenLeaves.compare_exchange_weak(top, copy));
+                leaf->frozen = copy;
+                leaf->snapshotEpoch = snapshot;
+            }
+
+            void freeFrozen() {
+                BTreeLeafBase* copy = frozenLeaves.exchange(nullptr);
+                while (copy) {
+                    BTreeLeafBase* next = copy->frozen;
+                    delete static_cast<BTreeLeaf<Key,Value>*>(copy);
+                    copy = next;
+                }
+            }
+
+            /**
+             * Reads the leaf after separator k, or the left-most leaf if
+             * first, as it was at snapshot. Leaves split off after the
+             * snapshot read as empty, their keys are in the frozen copy of
+             * the leaf they came from
+             * @return number of entries written to keys and values, hasUpper
+             * and upper are set to the leaf's upper separator
+             */
+            unsigned readSnapshotLeaf(Key k, bool first, uint64_t snapshot, Key* keys, Value* values,
+                                      bool& hasUpper, Key& upper) {
+                int restartCount = 0;
+restart:
+                if (restartCount++) {
+                    timeline::countRestart();
+                    yield(restartCount);
+                }
+                bool needRestart = false;
+                hasUpper = false;
+
+                NodeBase* node = root;
+                uint64_t versionNode = node->readLockOrRestart(needRestart);
+                if (needRestart || (node!=root)) goto restart;
+
+                // Parent of current node
+                BTreeInner<Key>* parent = nullptr;
+                uint64_t versionParent;
+
+                while (node->type==PageType::BTreeInner) {
+                    auto inner = static_cast<BTreeInner<Key>*>(node);
+
+                    if (parent) {
+                        parent->readUnlockOrRestart(versionParent, needRestart);
+                        if (needRestart) goto restart;
+                    }
+
+                    parent = inner;
+                    versionParent = versionNode;
+
+                    unsigned pos = 0;
+                    if (!first) {
+                        pos = inner->lowerBound(k);
+                        if (pos < inner->count && inner->keys[pos] == k) {
+                            pos++;
+                        }
+                    }
+                    if (pos < inner->count) {
+                        hasUpper = true;
+                        upper = inner->keys[pos];
+                    }
+                    node = childAt(inner, pos);
+                    inner->checkOrRestart(versionNode, needRestart);
+                    if (needRestart) goto restart;
+                    versionNode = node->readLockOrRestart(needRestart);
+                    if (needRestart) goto restart;
+                }
+
+                auto leaf = static_cast<BTreeLeaf<Key,Value>*>(node);
+                bool live = leaf->snapshotEpoch < snapshot;
+                auto frozen = static_cast<BTreeLeaf<Key,Value>*>(leaf->frozen);
+                unsigned n = 0;
+                if (live) {
+                    n = leaf->count;
+                    if (n > BTreeLeaf<Key,Value>::maxEntries) goto restart;
+                    // Written optimistically, a restart overwrites the same slots
+                    for (unsigned i = 0; i < n; i++) {
+                        keys[i] = leaf->keys[i];
+                        values[i] = leaf->payloads[i];
+                    }
+                }
+
+                if (parent) {
+                    parent->readUnlockOrRestart(versionParent, needRestart);
+                    if (needRestart) goto restart;
+                }
+                node->readUnlockOrRestart(versionNode, needRestart);
+                if (needRestart) goto restart;
+
+                // Frozen copies do not change, no need to validate them
+                if (!live && frozen) {
+                    n = frozen->count;
+                    memcpy(keys, frozen->keys, sizeof(Key) * n);
+                    memcpy(values, frozen->payloads, sizeof(Value) * n);
+                }
+                return n;
+            }
 
         };
 
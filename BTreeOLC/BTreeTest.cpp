@@ -2,8 +2,16 @@
 #include "BTreeOLC.h"
 #include "BTree_single_threaded.h"
 #include "BTree_rtm.h"
+#include "BTreeBLink.h"
 #include "timing.h"
 #include "WorkloadGenerator.h"
+#include "WorkStealing.h"
+#include "Timeline.h"
+#include "Ingest.h"
+#include "ShardedBTree.h"
+#include "DelegationExecutor.h"
+#include "BTreeMVCC.h"
+#include "WriteAheadLog.h"
 
 #include <cassert>
 #include <vector>
@@ -11,6 +19,7 @@
 #include <iostream>
 #include <algorithm>
 #include <thread>
+#include <functional>
 #include <random>
 #include <float.h>
 
@@ -19,6 +28,7 @@
 #define NUM_ELEMENTS_MULTI_TEST 1'000'000
 #define NUM_ELEMENTS_MULTI 10'000'000
 #define MULTI_NUM_THREADS 40
+#define STREAM_CHUNK_SIZE 2048
 
 void generateRandomValues(
     int64_t numValues,
@@ -135,6 +145,7 @@ void testTreeSingleThreaded(Index& idx) {
     indexInsert<Index>(0, idx, 0, keys.size(), keys, values); 
 
     assert(idx.checkTree());
+    assert(idx.verify().ok);
     indexLookupAssert<Index>(0, idx, 0, keys.size(), keys, values);
     idx.clear();
 }
@@ -181,6 +192,7 @@ void testMultiThreaded(Index &idx, int numThreads) {
 
     threads.clear();
     assert(idx.checkTree());
+    assert(idx.verify().ok);
 
     for(i = 0; i < numThreads-1; i++) {
         threads.push_back(std::thread([&](int threadId){
@@ -217,314 +229,2259 @@ void testMixedTreeMultiThreaded(Index& idx, int numThreads) {
     for(std::thread& t : threads) {
         t.join(); 
     }
+    assert(idx.verify().ok);
     idx.clear();
 }
 
 
+/**
+ * Interleaves inserts and lookups, generating each thread's workload on the
+ * fly in chunks
+ */
+template <class Index>
+void testStreamingMixedMultiThreaded(Index& idx, int numThreads) {
+    workload::WorkloadGenerator gen;
+    std::vector<workload::WorkloadStream> streams = gen.generateParallelStreams(0.5,
+                                                                                NUM_ELEMENTS_MULTI_TEST,
+                                                                                numThreads);
+    std::vector<std::thread> threads;
+    for(int i = 0; i < numThreads; i++) {
+        threads.push_back(std::thread([&](int threadId){
+            std::vector<workload::Operation> chunk;
+            while(streams[threadId].nextChunk(chunk, STREAM_CHUNK_SIZE)) {
+                executeWorkloadAssert(idx, chunk);
+            }
+        }, i));
+    }
+    for(std::thread& t : threads) {
+        t.join();
+    }
+    idx.clear();
+}
+
+/**
+ * Merges a sorted run with duplicates into a tree holding every other key,
+ * while the other threads look up the keys that were already there
+ */
+template <class Index>
+void testMergeSorted(Index& idx, int numThreads) {
+    const int64_t numKeys = NUM_ELEMENTS_MULTI_TEST;
+    for(int64_t key = 0; key < numKeys; key += 2) {
+        idx.insert(key, key);
+    }
+    std::vector<std::pair<int64_t, int64_t>> run;
+    for(int64_t key = 0; key < numKeys; key++) {
+        run.push_back({key, key + 1});
+        if(key % 7 == 0) {
+            run.push_back({key, -key});
+        }
+    }
+
+    std::atomic<bool> merging{true};
+    std::vector<std::thread> threads;
+    for(int i = 1; i < numThreads; i++) {
+        threads.push_back(std::thread([&](int threadId){
+            int64_t key = threadId * 2;
+            while(merging) {
+                int64_t result;
+                assert(idx.lookup(key, result));
+                key = (key + 2 * numThreads) % numKeys;
+            }
+        }, i));
+    }
+    idx.mergeSorted(run.begin(), run.end());
+    merging = false;
+    for(std::thread& t : threads) {
+        t.join();
+    }
+
+    assert(idx.verify().ok);
+    for(int64_t key = 0; key < numKeys; key++) {
+        int64_t result;
+        assert(idx.lookup(key, result));
+        assert(result == (key % 7 == 0 ? -key : key + 1));
+    }
+
+    // Into an empty tree the root leaf splits into a new root
+    idx.clear();
+    idx.mergeSorted(run.begin(), run.end());
+    assert(idx.verify().ok);
+    assert(idx.verify().keys == numKeys);
+    idx.clear();
+}
+
+/**
+ * Loads a reserved key range from all threads, the skeleton should absorb
+ * the load with few splits
+ */
+void testReserve(int numThreads) {
+    btreeolc::BTree<int64_t, int64_t> idx;
+    std::vector<int64_t> keys;
+    std::vector<int64_t> values;
+    generateRandomValues(NUM_ELEMENTS_MULTI_TEST, keys, values);
+
+    assert(idx.reserve(0, NUM_ELEMENTS_MULTI_TEST - 1, NUM_ELEMENTS_MULTI_TEST, numThreads));
+    assert(!idx.reserve(0, NUM_ELEMENTS_MULTI_TEST - 1, NUM_ELEMENTS_MULTI_TEST, numThreads));
+    treestats::TreeStats reserved = idx.stats(numThreads);
+    assert(idx.verify().ok);
+
+    std::vector<std::thread> threads;
+    int perThread = keys.size() / numThreads;
+    for(int i = 0; i < numThreads; i++) {
+        threads.push_back(std::thread([&](int threadId){
+            int end = threadId == numThreads - 1 ? keys.size() : (threadId + 1) * perThread;
+            indexInsert(threadId, idx, threadId * perThread, end, keys, values);
+        }, i));
+    }
+    for(std::thread& t : threads) {
+        t.join();
+    }
+
+    assert(idx.verify().ok);
+    treestats::TreeStats loaded = idx.stats(numThreads);
+    assert(loaded.leafNodes == reserved.leafNodes);
+    assert(loaded.innerNodes == reserved.innerNodes);
+    for(size_t i = 0; i < keys.size(); i++) {
+        int64_t result;
+        assert(idx.lookup(keys[i], result));
+        assert(result == values[i]);
+    }
+}
+
+/**
+ * Monotonic keys from every thread go through the tail leaf and skewed
+ * splits, the leaves they leave behind should stay nearly full
+ */
+template <class Index>
+void testAppendMultiThreaded(Index& idx, int numThreads) {
+    const int64_t numKeys = NUM_ELEMENTS_MULTI_TEST;
+    for(int64_t key = 0; key < numKeys; key++) {
+        idx.insert(key, key);
+    }
+    assert(idx.verify().ok);
+    assert(idx.stats().averageLeafFill() > 0.85);
+
+    std::vector<std::thread> threads;
+    for(int i = 0; i < numThreads; i++) {
+        threads.push_back(std::thread([&](int threadId){
+            for(int64_t key = numKeys + threadId; key < 2 * numKeys; key += numThreads) {
+                idx.insert(key, key);
+            }
+        }, i));
+    }
+    for(std::thread& t : threads) {
+        t.join();
+    }
+    assert(idx.verify().ok);
+    for(int64_t key = 0; key < 2 * numKeys; key++) {
+        int64_t result;
+        assert(idx.lookup(key, result));
+        assert(result == key);
+    }
+    idx.clear();
+}
+
+/**
+ * Every thread inserts into the same few leaves, which drives them hot and
+ * through the combining path
+ */
+template <class Index>
+void testHotLeafInserts(Index& idx, int numThreads) {
+    const int64_t hotKeys = 512;
+    const int rounds = 200;
+    std::vector<std::thread> threads;
+    for(int i = 0; i < numThreads; i++) {
+        threads.push_back(std::thread([&](int threadId){
+            for(int round = 0; round < rounds; round++) {
+                for(int64_t key = threadId; key < hotKeys; key += numThreads) {
+                    idx.insert(key, key * rounds + round);
+                }
+            }
+        }, i));
+    }
+    for(std::thread& t : threads) {
+        t.join();
+    }
+    assert(idx.verify().ok);
+    for(int64_t key = 0; key < hotKeys; key++) {
+        int64_t result;
+        assert(idx.lookup(key, result));
+        assert(result == key * rounds + rounds - 1);
+    }
+    idx.clear();
+}
+
+/**
+ * Ingests an unsorted dump with duplicate keys and checks every key
+ */
+void testIngestion(int numThreads) {
+    const char* path = "ingest_test.data";
+    btreeolc::BTree<int64_t, int64_t> idx;
+    assert(ingest::writeRandomDump(path, NUM_ELEMENTS_MULTI_TEST));
+
+    // Overwrite every tenth key at the end of the dump, the later record wins
+    FILE* file = fopen(path, "ab");
+    for(int64_t key = 0; key < NUM_ELEMENTS_MULTI_TEST; key += 10) {
+        ingest::Record record{key, -key};
+        fwrite(&record, sizeof(record), 1, file);
+    }
+    fclose(file);
+
+    ingest::IngestTimings timings;
+    assert(ingest::ingestFile(path, idx, timings, 1.0, numThreads));
+    assert(timings.keys == NUM_ELEMENTS_MULTI_TEST);
+    assert(idx.verify().ok);
+    for(int64_t key = 0; key < NUM_ELEMENTS_MULTI_TEST; key++) {
+        int64_t result;
+        assert(idx.lookup(key, result));
+        if(key % 10 == 0) {
+            assert(result == -key);
+        }
+    }
+
+    // A fill above 1 still builds full leaves
+    btreeolc::BTree<int64_t, int64_t> packed;
+    assert(ingest::ingestFile(path, packed, timings, 2.0, numThreads));
+    assert(packed.verify().ok);
+    const uint64_t perLeaf = btreeolc::BTreeLeaf<int64_t, int64_t>::maxEntries;
+    assert(packed.stats(numThreads).leafNodes == (NUM_ELEMENTS_MULTI_TEST + perLeaf - 1) / perLeaf);
+    remove(path);
+}
+
+/**
+ * Inserts keys that all start out in the first shard, so boundaries move
+ * while threads insert and look up, then scans across all shards
+ */
+void testShardedBTree(int numThreads) {
+    const int64_t numKeys = NUM_ELEMENTS_MULTI_TEST;
+    sharded::ShardedBTree<btreeolc::BTree<int64_t, int64_t>> idx(8, 0, numKeys * 8 - 1);
+
+    std::vector<std::thread> threads;
+    for(int i = 0; i < numThreads; i++) {
+        threads.push_back(std::thread([&](int threadId){
+            for(int64_t key = threadId; key < numKeys; key += numThreads) {
+                idx.insert(key, key * 2);
+                int64_t result;
+                assert(idx.lookup(key, result));
+                assert(result == key * 2);
+            }
+        }, i));
+    }
+    for(std::thread& t : threads) {
+        t.join();
+    }
+    idx.rebalancer.wait();
+    assert(idx.directory.load()->bounds[0] < numKeys / 2);
+    assert(idx.verify());
+
+    // Move boundaries by hand while other threads read
+    std::atomic<bool> moving{true};
+    threads.clear();
+    for(int i = 1; i < numThreads; i++) {
+        threads.push_back(std::thread([&](int threadId){
+            int64_t key = threadId;
+            while(moving) {
+                int64_t result;
+                assert(idx.lookup(key, result));
+                assert(result == key * 2);
+                key = (key + numThreads) % numKeys;
+            }
+        }, i));
+    }
+    for(unsigned shard = 0; shard + 1 < idx.numShards(); shard++) {
+        idx.rebalance(shard);
+    }
+    moving = false;
+    for(std::thread& t : threads) {
+        t.join();
+    }
+    // Shards gave away their copies of moved keys
+    assert(idx.stats().keys == (uint64_t)numKeys);
+    assert(idx.verify());
+
+    for(int64_t key = 0; key < numKeys; key++) {
+        int64_t result;
+        assert(idx.lookup(key, result));
+        assert(result == key * 2);
+    }
+    std::vector<int64_t> keys(numKeys + 10);
+    std::vector<int64_t> values(numKeys + 10);
+    assert(idx.scanEntries(0, numKeys + 10, keys.data(), values.data()) == (uint64_t)numKeys);
+    for(int64_t key = 0; key < numKeys; key++) {
+        assert(keys[key] == key && values[key] == key * 2);
+    }
+    int64_t boundary = idx.directory.load()->bounds[0];
+    assert(idx.scanEntries(boundary - 4, 8, keys.data(), values.data()) == 8);
+    for(int i = 0; i < 8; i++) {
+        assert(keys[i] == boundary - 4 + i);
+    }
+}
+
+/**
+ * Every thread inserts and looks up through its own client, lookups have to
+ * see the client's earlier inserts since both go to the same owner in order
+ */
+void testDelegation(int numThreads) {
+    const int64_t numKeys = NUM_ELEMENTS_MULTI_TEST;
+    delegation::Executor<int64_t, int64_t> executor(std::max(1, numThreads / 2), numThreads, 0, numKeys - 1);
+
+    std::vector<std::thread> threads;
+    for(int i = 0; i < numThreads; i++) {
+        threads.push_back(std::thread([&](int threadId){
+            auto& client = executor.client(threadId);
+            uint64_t submitted = 0;
+            uint64_t completed = 0;
+            for(int64_t key = threadId; key < numKeys; key += numThreads) {
+                client.insert(key, key * 3, key);
+                client.lookup(key, key);
+                submitted += 2;
+                if(client.completed.size() > 4096) {
+                    for(auto& done : client.completed) {
+                        assert(done.found);
+                    }
+                    completed += client.completed.size();
+                    client.completed.clear();
+                }
+            }
+            client.wait();
+            for(auto& done : client.completed) {
+                assert(done.found);
+            }
+            completed += client.completed.size();
+            client.completed.clear();
+            assert(completed == submitted);
+
+            int64_t result;
+            assert(client.lookupNow(threadId, result));
+            assert(result == threadId * 3);
+            assert(!client.lookupNow(numKeys + threadId, result));
+        }, i));
+    }
+    for(std::thread& t : threads) {
+        t.join();
+    }
+
+    auto& client = executor.client(0);
+    for(int64_t key = 0; key < numKeys; key++) {
+        client.lookup(key, key);
+    }
+    client.wait();
+    assert(client.completed.size() == (size_t)numKeys);
+    for(auto& done : client.completed) {
+        assert(done.found && done.value == (int64_t)done.tag * 3);
+    }
+    assert(executor.stats().keys == (uint64_t)numKeys);
+    for(unsigned worker = 0; worker < executor.numWorkers(); worker++) {
+        assert(executor.trees[worker]->verify().ok);
+    }
+}
+
+/**
+ * Every thread inserts its keys in unsorted micro-batches that repeat some
+ * keys, the last pair of a key within a batch has to win
+ */
+template <class Index>
+void testInsertBatch(Index& idx, int numThreads) {
+    const int64_t numKeys = NUM_ELEMENTS_MULTI_TEST;
+    const int batchSize = 256;
+    std::vector<int64_t> keys;
+    std::vector<int64_t> values;
+    generateRandomValues(numKeys, keys, values);
+
+    std::vector<std::thread> threads;
+    int perThread = keys.size() / numThreads;
+    for(int i = 0; i < numThreads; i++) {
+        threads.push_back(std::thread([&](int threadId){
+            int end = threadId == numThreads - 1 ? keys.size() : (threadId + 1) * perThread;
+            std::vector<int64_t> batchKeys;
+            std::vector<int64_t> batchValues;
+            for(int start = threadId * perThread; start < end; start += batchSize) {
+                batchKeys.clear();
+                batchValues.clear();
+                for(int j = start; j < std::min(end, start + batchSize); j++) {
+                    // A stale value first, the real one later in the batch
+                    if(j % 5 == 0) {
+                        batchKeys.push_back(keys[j]);
+                        batchValues.push_back(-1);
+                    }
+                    batchKeys.push_back(keys[j]);
+                    batchValues.push_back(values[j]);
+                }
+                idx.insertBatch(batchKeys.data(), batchValues.data(), batchKeys.size());
+            }
+        }, i));
+    }
+    for(std::thread& t : threads) {
+        t.join();
+    }
+
+    assert(idx.verify().ok);
+    for(size_t i = 0; i < keys.size(); i++) {
+        int64_t result;
+        assert(idx.lookup(keys[i], result));
+        assert(result == values[i]);
+    }
+    idx.clear();
+}
+
+/**
+ * Rows are a key plus secondary keys in other leaves. Threads rewrite whole
+ * rows and read them back with transact, and must never see a row half
+ * written. Runs with transactions (if the CPU has them) and with latches only
+ */
+template <class Index>
+void testTransact(Index& idx, int numThreads) {
+    const int64_t numRows = 4096;
+    const int keysPerRow = 4;
+    const int rounds = 20000;
+    typedef btreertm::TxOp<int64_t, int64_t> Op;
+    auto rowKey = [&](int64_t row, int j) { return j * numRows * 16 + row; };
+
+    bool useRtm = idx.useRtm;
+    for(bool rtm : {useRtm, false}) {
+        idx.useRtm = rtm;
+        for(int64_t row = 0; row < numRows; row++) {
+            Op ops[keysPerRow];
+            for(int j = 0; j < keysPerRow; j++) {
+                ops[j] = Op{btreertm::TxOpType::Insert, rowKey(row, j), 0, false};
+            }
+            idx.transact(ops, keysPerRow);
+        }
+
+        std::vector<std::thread> threads;
+        for(int i = 0; i < numThreads; i++) {
+            threads.push_back(std::thread([&](int threadId){
+                std::default_random_engine eng(threadId);
+                std::uniform_int_distribution<int64_t> rows(0, numRows - 1);
+                for(int round = 0; round < rounds; round++) {
+                    int64_t row = rows(eng);
+                    Op ops[keysPerRow];
+                    bool write = round % 2 == 0;
+                    for(int j = 0; j < keysPerRow; j++) {
+                        ops[j] = write ?
+                            Op{btreertm::TxOpType::Insert, rowKey(row, j), (int64_t)threadId * rounds + round + 1, false} :
+                            Op{btreertm::TxOpType::Lookup, rowKey(row, j), -1, false};
+                    }
+                    idx.transact(ops, keysPerRow);
+                    if(!write) {
+                        for(int j = 0; j < keysPerRow; j++) {
+                            assert(ops[j].found);
+                            assert(ops[j].value == ops[0].value);
+                        }
+                    }
+                }
+            }, i));
+        }
+        for(std::thread& t : threads) {
+            t.join();
+        }
+        assert(idx.verify().ok);
+        for(int64_t row = 0; row < numRows; row++) {
+            int64_t first;
+            assert(idx.lookup(rowKey(row, 0), first));
+            for(int j = 1; j < keysPerRow; j++) {
+                int64_t result;
+                assert(idx.lookup(rowKey(row, j), result));
+                assert(result == first);
+            }
+        }
+        idx.clear();
+    }
+    idx.useRtm = useRtm;
+}
+
+/**
+ * Counters bumped with fetchAndApply and compareAndSwap from all threads,
+ * and keys raced for with insertIfAbsent, of which exactly one thread wins
+ */
+template <class Index>
+void testConditionalOps(Index& idx, int numThreads) {
+    const int64_t numCounters = 64;
+    const int64_t numRaced = 10000;
+    const int rounds = 2000;
+    for(int64_t key = 0; key < numCounters; key++) {
+        idx.insert(key, 0);
+        idx.insert(numCounters + key, 0);
+    }
+    assert(!idx.update(-1, 1));
+    assert(!idx.compareAndSwap(-1, 0, 1));
+
+    std::vector<std::atomic<int>> wins(numRaced);
+    std::vector<std::thread> threads;
+    for(int i = 0; i < numThreads; i++) {
+        threads.push_back(std::thread([&](int threadId){
+            for(int round = 0; round < rounds; round++) {
+                int64_t previous;
+                int64_t key = (threadId + round) % numCounters;
+                assert(idx.fetchAndApply(key, [](int64_t value) { return value + 1; }, previous));
+
+                int64_t current;
+                do {
+                    assert(idx.lookup(numCounters + key, current));
+                } while(!idx.compareAndSwap(numCounters + key, current, current + 1));
+            }
+            for(int64_t j = 0; j < numRaced; j++) {
+                int64_t key = 2 * numCounters + j;
+                int64_t existing;
+                if(idx.insertIfAbsent(key, threadId, existing)) {
+                    wins[j]++;
+                } else {
+                    assert(existing >= 0 && existing < numThreads);
+                }
+            }
+        }, i));
+    }
+    for(std::thread& t : threads) {
+        t.join();
+    }
+
+    assert(idx.verify().ok);
+    int64_t total = 0;
+    int64_t totalSwapped = 0;
+    for(int64_t key = 0; key < numCounters; key++) {
+        int64_t result;
+        assert(idx.lookup(key, result));
+        total += result;
+        assert(idx.lookup(numCounters + key, result));
+        totalSwapped += result;
+    }
+    assert(total == (int64_t)numThreads * rounds);
+    assert(totalSwapped == (int64_t)numThreads * rounds);
+    for(int64_t j = 0; j < numRaced; j++) {
+        assert(wins[j] == 1);
+        assert(idx.update(2 * numCounters + j, -j));
+        int64_t result;
+        assert(idx.lookup(2 * numCounters + j, result));
+        assert(result == -j);
+    }
+    idx.clear();
+}
+
+/**
+ * Scans with a node set have to be invalidated by inserts into the scanned
+ * range and only by those. While a writer fills gaps, a node set that still
+ * validates after a second scan means both scans saw the same entries
+ */
+template <class Index>
+void testNodeSetValidation(Index& idx, int numThreads) {
+    const int64_t numKeys = NUM_ELEMENTS_MULTI_TEST;
+    const int range = 200;
+    for(int64_t key = 0; key < numKeys; key += 2) {
+        idx.insert(key, key);
+    }
+    std::vector<int64_t> keys(range);
+    std::vector<int64_t> values(range);
+    btreeolc::NodeSet nodeSet;
+    assert(idx.scanEntries(1000, range, keys.data(), values.data(), nodeSet) == (uint64_t)range);
+    assert(!nodeSet.empty() && idx.validate(nodeSet));
+    idx.insert(numKeys - 1, 0);
+    assert(idx.validate(nodeSet));
+    idx.insert(1000 + range - 1, 0);
+    assert(!idx.validate(nodeSet));
+
+    std::atomic<bool> writing{true};
+    std::vector<std::thread> threads;
+    for(int i = 1; i < numThreads; i++) {
+        threads.push_back(std::thread([&](int threadId){
+            std::vector<int64_t> keys1(range), values1(range), keys2(range), values2(range);
+            int64_t start = threadId * 1000;
+            while(writing) {
+                btreeolc::NodeSet first;
+                btreeolc::NodeSet second;
+                uint64_t count1 = idx.scanEntries(start, range, keys1.data(), values1.data(), first);
+                uint64_t count2 = idx.scanEntries(start, range, keys2.data(), values2.data(), second);
+                if(idx.validate(first)) {
+                    assert(count1 == count2);
+                    for(uint64_t j = 0; j < count1; j++) {
+                        assert(keys1[j] == keys2[j] && values1[j] == values2[j]);
+                    }
+                }
+                start = (start + 7919) % numKeys;
+            }
+        }, i));
+    }
+    for(int64_t key = 1; key < numKeys; key += 2) {
+        idx.insert(key, key);
+    }
+    writing = false;
+    for(std::thread& t : threads) {
+        t.join();
+    }
+    idx.clear();
+}
+
+/**
+ * Writers update even keys round by round and add odd keys while readers
+ * scan at snapshots and the collector runs. A snapshot has to read the same
+ * entries every time, however many versions are written or freed meanwhile
+ */
+void testMVCC(int numThreads) {
+    const int64_t numKeys = NUM_ELEMENTS_MULTI_TEST / 10;
+    const int numRounds = 3;
+    btreemvcc::BTree<int64_t, int64_t> idx;
+    for(int64_t key = 0; key < numKeys; key += 2) {
+        idx.insert(key, 0);
+    }
+    idx.startGarbageCollector(std::chrono::milliseconds(1));
+
+    std::vector<int64_t> keys(numKeys);
+    std::vector<int64_t> values(numKeys);
+    std::atomic<int> writersLeft{numThreads};
+    std::vector<std::thread> threads;
+    {
+        auto snap = idx.snapshot();
+        for(int i = 0; i < numThreads; i++) {
+            threads.push_back(std::thread([&](int threadId){
+                for(int round = 1; round <= numRounds; round++) {
+                    for(int64_t key = threadId * 2; key < numKeys; key += numThreads * 2) {
+                        idx.insert(key, round);
+                        if(round == 1) {
+                            idx.insert(key + 1, key + 1);
+                        }
+                    }
+                }
+                writersLeft--;
+            }, i));
+        }
+        for(int i = 0; i < numThreads; i++) {
+            threads.push_back(std::thread([&](){
+                std::vector<int64_t> keys1(numKeys), values1(numKeys), keys2(numKeys), values2(numKeys);
+                while(writersLeft > 0) {
+                    auto readerSnap = idx.snapshot();
+                    uint64_t count1 = idx.scan(0, numKeys, keys1.data(), values1.data(), readerSnap);
+                    uint64_t count2 = idx.scan(0, numKeys, keys2.data(), values2.data(), readerSnap);
+                    assert(count1 == count2);
+                    for(uint64_t j = 0; j < count1; j++) {
+                        assert(keys1[j] == keys2[j] && values1[j] == values2[j]);
+                    }
+                }
+            }));
+        }
+
+        // Nothing written after snap is visible through it. The collector
+        // waits until snap is released
+        assert(idx.scan(0, numKeys, keys.data(), values.data(), snap) == (uint64_t)numKeys / 2);
+        for(int64_t j = 0; j < numKeys / 2; j++) {
+            assert(keys[j] == j * 2 && values[j] == 0);
+        }
+        int64_t result;
+        assert(!idx.lookup(1, result, snap));
+    }
+    for(std::thread& t : threads) {
+        t.join();
+    }
+    idx.stopGarbageCollector();
+    idx.collectGarbage();
+
+    assert(idx.scan(0, numKeys, keys.data(), values.data()) == (uint64_t)numKeys);
+    for(int64_t key = 0; key < numKeys; key++) {
+        assert(keys[key] == key && values[key] == (key % 2 ? key : numRounds));
+        btreemvcc::Chain<int64_t>* chain;
+        assert(idx.index.lookup(key, chain));
+        assert(chain->head.load()->older == nullptr);
+    }
+
+    {
+        auto before = idx.snapshot();
+        assert(idx.remove(4));
+        assert(!idx.remove(4));
+        int64_t result;
+        assert(!idx.lookup(4, result));
+        assert(idx.lookup(4, result, before) && result == numRounds);
+    }
+    idx.insert(4, 40);
+    int64_t result;
+    assert(idx.lookup(4, result) && result == 40);
+    assert(idx.verify().ok);
+    idx.clear();
+}
+
+/**
+ * Exports a snapshot while writers overwrite its keys and add keys between
+ * and behind them, splitting its leaves. The file has to hold exactly the
+ * entries at the time of the snapshot, in key order
+ */
+template <class Index>
+void testSnapshotExport(Index& idx, int numThreads) {
+    const char* path = "snapshot_test.data";
+    const int64_t numKeys = NUM_ELEMENTS_MULTI_TEST;
+    for(int64_t key = 0; key < numKeys; key += 2) {
+        idx.insert(key, key);
+    }
+    assert(idx.beginSnapshot());
+    assert(!idx.beginSnapshot());
+
+    std::vector<std::thread> threads;
+    for(int i = 0; i < numThreads; i++) {
+        threads.push_back(std::thread([&](int threadId){
+            for(int64_t key = threadId * 2; key < numKeys; key += numThreads * 2) {
+                idx.insert(key + 1, -key);
+                assert(idx.update(key, -key));
+                idx.insert(numKeys + key, key);
+            }
+        }, i));
+    }
+    auto checkExport = [&]() {
+        uint64_t written;
+        assert(idx.exportSnapshot(path, &written));
+        assert(written == (uint64_t)numKeys / 2);
+        std::vector<ingest::Record> records(written + 1);
+        FILE* file = fopen(path, "rb");
+        assert(fread(records.data(), sizeof(ingest::Record), records.size(), file) == written);
+        fclose(file);
+        for(uint64_t i = 0; i < written; i++) {
+            assert(records[i].key == (int64_t)i * 2 && records[i].value == (int64_t)i * 2);
+        }
+    };
+    checkExport();
+    for(std::thread& t : threads) {
+        t.join();
+    }
+    checkExport();
+    idx.endSnapshot();
+    assert(!idx.exportSnapshot(path));
+
+    // A checkpoint sees everything written before it
+    assert(idx.checkpoint(path));
+    assert(idx.waitCheckpoint());
+    btreeolc::BTree<int64_t, int64_t> restored;
+    ingest::IngestTimings timings;
+    assert(ingest::ingestFile(path, restored, timings, 1.0, numThreads));
+    assert(timings.keys == (size_t)numKeys / 2 * 3);
+    for(int64_t key = 0; key < numKeys * 2; key++) {
+        int64_t expected, result;
+        bool found = idx.lookup(key, expected);
+        assert(restored.lookup(key, result) == found);
+        assert(!found || result == expected);
+    }
+    remove(path);
+    idx.clear();
+}
+
+/**
+ * Logs inserts, updates and removes from several threads, then recovers
+ * the tree from the log, also after a torn record at its end
+ */
+void testWriteAheadLog(int numThreads) {
+    const char* path = "wal_test.log";
+    const int64_t numKeys = NUM_ELEMENTS_MULTI_TEST / 10;
+    remove(path);
+    wal::Options options;
+    options.commitInterval = std::chrono::microseconds(200);
+    options.syncEvery = 2;
+    auto expect = [&](wal::LoggedBTree<int64_t, int64_t>& idx, int64_t end) {
+        for(int64_t key = 0; key < end; key++) {
+            int64_t result;
+            bool found = idx.lookup(key, result);
+            assert(found == (key % 5 != 0));
+            assert(!found || result == (key % 3 == 0 ? -key : key));
+        }
+        assert(idx.verify().ok);
+    };
+    {
+        wal::LoggedBTree<int64_t, int64_t> idx;
+        assert(idx.open(path, options));
+        std::vector<std::thread> threads;
+        for(int i = 0; i < numThreads; i++) {
+            threads.push_back(std::thread([&](int threadId){
+                for(int64_t key = threadId; key < numKeys; key += numThreads) {
+                    idx.insert(key, key);
+                    if(key % 3 == 0) {
+                        assert(idx.update(key, -key));
+                    }
+                    if(key % 5 == 0) {
+                        assert(idx.remove(key));
+                        assert(!idx.remove(key));
+                    }
+                }
+                assert(idx.commit());
+            }, i));
+        }
+        for(std::thread& t : threads) {
+            t.join();
+        }
+        expect(idx, numKeys);
+    }
+
+    // Half a record at the end, as if the process died while writing it
+    FILE* file = fopen(path, "ab");
+    int64_t garbage[2] = {numKeys * 10, 42};
+    fwrite(garbage, sizeof(garbage), 1, file);
+    fclose(file);
+
+    {
+        wal::LoggedBTree<int64_t, int64_t> idx;
+        wal::RecoveryResult recovered;
+        assert(idx.open(path, options, &recovered));
+        assert(recovered.lastLsn == recovered.records);
+        expect(idx, numKeys);
+        for(int64_t key = numKeys; key < numKeys * 2; key++) {
+            idx.insert(key, key % 3 == 0 ? -key : key);
+            if(key % 5 == 0) {
+                idx.remove(key);
+            }
+        }
+    }
+    {
+        wal::LoggedBTree<int64_t, int64_t> idx;
+        assert(idx.open(path, options));
+        expect(idx, numKeys * 2);
+    }
+
+    // Rounds are written in sequence order even with many writers. A record
+    // missing from the middle ends the log right before it
+    remove(path);
+    {
+        wal::LoggedBTree<int64_t, int64_t> idx;
+        assert(idx.open(path, options));
+        std::vector<std::thread> threads;
+        for(int i = 0; i < numThreads; i++) {
+            threads.push_back(std::thread([&](int threadId){
+                for(int64_t key = threadId; key < numKeys; key += numThreads) {
+                    idx.insert(key, key);
+                }
+                assert(idx.commit());
+            }, i));
+        }
+        for(std::thread& t : threads) {
+            t.join();
+        }
+    }
+    std::vector<wal::Record<int64_t, int64_t>> records(numKeys + 1);
+    file = fopen(path, "rb");
+    assert(fread(records.data(), sizeof(records[0]), records.size(), file) == (size_t)numKeys);
+    fclose(file);
+    records.pop_back();
+    for(int64_t i = 0; i < numKeys; i++) {
+        assert(records[i].lsn == (uint64_t)i + 1);
+    }
+    const int64_t dropped = numKeys / 2;
+    int64_t droppedKey = records[dropped].key;
+    records.erase(records.begin() + dropped);
+    file = fopen(path, "wb");
+    fwrite(records.data(), sizeof(records[0]), records.size(), file);
+    fclose(file);
+    auto expectPrefix = [&](wal::LoggedBTree<int64_t, int64_t>& idx) {
+        for(int64_t i = 0; i < numKeys - 1; i++) {
+            int64_t result;
+            assert(idx.lookup(records[i].key, result) == (i < dropped));
+        }
+        int64_t result;
+        assert(!idx.lookup(droppedKey, result));
+    };
+    {
+        wal::LoggedBTree<int64_t, int64_t> idx;
+        wal::RecoveryResult recovered;
+        assert(idx.open(path, options, &recovered));
+        assert(recovered.records == (uint64_t)dropped && recovered.lastLsn == (uint64_t)dropped);
+        expectPrefix(idx);
+        idx.insert(numKeys, numKeys);
+        assert(idx.commit());
+    }
+    {
+        wal::LoggedBTree<int64_t, int64_t> idx;
+        wal::RecoveryResult recovered;
+        assert(idx.open(path, options, &recovered));
+        assert(recovered.records == (uint64_t)dropped + 1);
+        expectPrefix(idx);
+        int64_t result;
+        assert(idx.lookup(numKeys, result) && result == numKeys);
+    }
+    remove(path);
+}
+
+/**
+ * Saves a tree as a page image and opens it again: lookups and scans are
+ * served from the mapping, writes copy the pages they change and the file
+ * stays as it was saved
+ */
+template <class Index>
+void testImage(Index& idx, int numThreads) {
+    const char* path = "image_test.data";
+    const int64_t numKeys = NUM_ELEMENTS_MULTI_TEST;
+    for(int64_t key = 0; key < numKeys; key += 2) {
+        idx.insert(key, key);
+    }
+    assert(idx.saveImage(path));
+    idx.clear();
+
+    auto expectSaved = [&](Index& opened) {
+        assert(opened.verify().ok);
+        for(int64_t key = 0; key < numKeys; key++) {
+            int64_t result;
+            bool found = opened.lookup(key, result);
+            assert(found == (key % 2 == 0));
+            assert(!found || result == key);
+        }
+        std::vector<int64_t> keys(numKeys);
+        std::vector<int64_t> values(numKeys);
+        assert(opened.scanEntries(0, numKeys, keys.data(), values.data()) == (uint64_t)numKeys / 2);
+        for(int64_t i = 0; i < numKeys / 2; i++) {
+            assert(keys[i] == i * 2 && values[i] == i * 2);
+        }
+    };
+    {
+        Index opened;
+        assert(opened.openImage(path));
+        expectSaved(opened);
+
+        std::vector<std::thread> threads;
+        for(int i = 0; i < numThreads; i++) {
+            threads.push_back(std::thread([&](int threadId){
+                for(int64_t key = threadId * 2; key < numKeys; key += numThreads * 2) {
+                    opened.insert(key + 1, -key);
+                    assert(opened.update(key, -key));
+                    opened.insert(numKeys + key, key);
+                }
+            }, i));
+        }
+        for(std::thread& t : threads) {
+            t.join();
+        }
+        assert(opened.verify().ok);
+        for(int64_t key = 0; key < numKeys * 2; key++) {
+            int64_t result;
+            bool found = opened.lookup(key, result);
+            assert(found == (key < numKeys || key % 2 == 0));
+            assert(!found || result == (key < numKeys ? -(key & ~1) : key - numKeys));
+        }
+        opened.clear();
+
+        // The writes went to private copies of the pages
+        assert(opened.openImage(path));
+        expectSaved(opened);
+    }
+    {
+        // Opening replaces what the tree held before
+        Index opened;
+        opened.insert(numKeys + 1, 1);
+        assert(opened.openImage(path));
+        expectSaved(opened);
+        int64_t result;
+        assert(!opened.lookup(numKeys + 1, result));
+        opened.clearAsync();
+    }
+
+    // A garbled first leaf page is only noticed when reached and then reads as empty
+    FILE* file = fopen(path, "r+b");
+    unsigned char garbled[16];
+    memset(garbled, 0xff, sizeof(garbled));
+    fseek(file, btreeolc::pageSize, SEEK_SET);
+    fwrite(garbled, sizeof(garbled), 1, file);
+    fclose(file);
+    {
+        Index opened;
+        assert(opened.openImage(path));
+        int64_t result;
+        assert(!opened.lookup(0, result));
+        assert(opened.lookup(numKeys - 2, result) && result == numKeys - 2);
+        opened.insert(0, 1);
+        assert(opened.lookup(0, result) && result == 1);
+        assert(opened.image->corruptLeaves == 1);
+        assert(!opened.verify().ok);
+    }
+
+    // A child of the root pointing into the leaf pages
+    btreeolc::ImageHeader header;
+    file = fopen(path, "r+b");
+    assert(fread(&header, sizeof(header), 1, file) == 1);
+    btreeolc::BTreeInner<int64_t> probe;
+    long childOffset = (const char*)&probe.children[0] - (const char*)&probe;
+    assert(header.height > 2);
+    uint64_t leafPage = btreeolc::pageSize;
+    fseek(file, header.rootOffset + childOffset, SEEK_SET);
+    fwrite(&leafPage, sizeof(leafPage), 1, file);
+    fclose(file);
+    {
+        Index opened;
+        assert(!opened.openImage(path));
+    }
+
+    // An empty tree still gets a leaf page
+    assert(idx.saveImage(path));
+    {
+        Index opened;
+        assert(opened.openImage(path));
+        int64_t result;
+        assert(!opened.lookup(0, result));
+        opened.insert(5, 5);
+        assert(opened.lookup(5, result) && result == 5);
+        assert(opened.verify().ok);
+    }
+
+    file = fopen(path, "wb");
+    int64_t garbage[2] = {1, 2};
+    fwrite(garbage, sizeof(garbage), 1, file);
+    fclose(file);
+    {
+        Index opened;
+        assert(!opened.openImage(path));
+        assert(!opened.openImage("missing_image.data"));
+    }
+    remove(path);
+}
+
+/**
+ * Benchmarks inserting multithreaded
+ * returns the elapsed time
+ */
+template <class Index>
+double multiInsertThreadedBenchmark(
+    Index &idx, 
+    int numThreads, 
+    int numRuns,
+    std::vector<int64_t>& keys,
+    std::vector<int64_t>& values,
+    std::function<void()> prepare = nullptr
+ ) {
+    std::vector<std::thread> threads; 
+    int numOperations = keys.size();
+
+    double currElapsed = DBL_MAX;
+    int numValuesPerThreads = numOperations/numThreads; 
+    int insertFallbackTimes;
+    treestats::TreeStats stats;
+    for(int run = 0; run < numRuns; run++) {
+        if(prepare) {
+            prepare();
+        }
+        Timer t;
+        int i;
+        for(i = 0; i < numThreads-1; i++) {
+            threads.push_back(std::thread([&](int threadId){
+                indexInsert<Index>(threadId, idx, threadId * numValuesPerThreads, (threadId+1) * numValuesPerThreads, keys, values);
+            }, i));
+        }
+        t.reset();
+        
+        int currThreadId = numThreads-1;
+        indexInsert<Index>(currThreadId, idx, currThreadId * numValuesPerThreads, keys.size(), keys, values);
+        for(std::thread& t : threads) {
+            t.join(); 
+        }
+
+        double elapsed = t.elapsed(); 
+        currElapsed = std::min(elapsed, currElapsed);
+        insertFallbackTimes += idx.insertFallbackTimes;
+        if(run == numRuns-1) {
+            stats = idx.stats();
+        }
+        idx.clear();
+        threads.clear();
+    }
+    printf("Execution Time: %.6fms \n", currElapsed);
+    stats.printSummary();
+
+    return currElapsed; 
+
+}
+
 /**
  * Benchmarks inserting multithreaded
  * returns the elapsed time
  */
-template <class Index>
-double multiInsertThreadedBenchmark(
-    Index &idx, 
-    int numThreads, 
-    int numRuns,
-    std::vector<int64_t>& keys,
-    std::vector<int64_t>& values 
- ) {
-    std::vector<std::thread> threads; 
-    int numOperations = keys.size();
+template <class Index>
+double multiLookupThreadedBenchmark(
+    Index &idx, 
+    int numThreads, 
+    int numRuns,
+    std::vector<int64_t>& keys,
+    std::vector<int64_t>& values 
+ ) {
+    std::vector<std::thread> threads; 
+    int numOperations = keys.size();
+
+    double currElapsed = DBL_MAX;
+    int numValuesPerThreads = numOperations/numThreads; 
+    indexInsert<Index>(0, idx, 0, numOperations, keys, values);
+    for(int run = 0; run < numRuns; run++) {
+        Timer t;
+        int i;
+        for(i = 0; i < numThreads-1; i++) {
+            threads.push_back(std::thread([&](int threadId){
+                indexLookup<Index>(threadId, idx, threadId * numValuesPerThreads, (threadId+1) * numValuesPerThreads, keys, values);
+            }, i));
+        }
+        t.reset();
+        
+        int currThreadId = numThreads-1;
+        indexLookup<Index>(currThreadId, idx, currThreadId * numValuesPerThreads, keys.size(), keys, values);
+        for(std::thread& t : threads) {
+            t.join(); 
+        }
+
+        double elapsed = t.elapsed(); 
+        currElapsed = std::min(elapsed, currElapsed);
+        threads.clear();
+    }
+
+    printf("Execution Time: %.6fms \n", currElapsed);
+    idx.stats().printSummary();
+
+    idx.clear();
+    return currElapsed; 
+
+}
+
+
+template <class Index>
+double multiThreadedMixedBenchmark(
+    Index &idx,
+    int numRuns,
+    std::vector<std::vector<workload::Operation>> workloads
+) {
+    std::vector<std::thread> threads;
+    double currElapsed = DBL_MAX;
+    double insertFallbackTimes = 0;
+    double lookupFallbackTimes = 0;
+    treestats::TreeStats stats;
+    for(int run = 0; run < numRuns; run++){
+        Timer t;
+        for(int i = 0; i < workloads.size(); i++) {
+            threads.push_back(std::thread([&](int threadId){
+                executeWorkload(idx, workloads[threadId]);
+            }, i));
+        }
+
+        t.reset();
+        for(std::thread& t : threads) {
+            t.join(); 
+        }
+        double elapsed = t.elapsed();
+        currElapsed = std::min(elapsed, currElapsed);
+        threads.clear();
+        lookupFallbackTimes += idx.lookupFallbackTimes;
+        insertFallbackTimes += idx.insertFallbackTimes;
+        if(run == numRuns-1) {
+            stats = idx.stats();
+        }
+        idx.clear(); 
+    }
+
+    printf("Execution Time: %.6fms \n", currElapsed);
+    stats.printSummary();
+    return currElapsed;
+}
+/**
+ * Benchmarks inserting multithreaded on the chunked executor, with or without
+ * work stealing. Returns the best run's report
+ */
+template <class Index>
+executor::RunReport workStealingInsertBenchmark(
+    Index &idx,
+    int numThreads,
+    int numRuns,
+    bool stealing,
+    std::vector<int64_t>& keys,
+    std::vector<int64_t>& values
+) {
+    std::vector<size_t> partitionSizes;
+    size_t numValuesPerThreads = keys.size()/numThreads;
+    for(int i = 0; i < numThreads-1; i++) {
+        partitionSizes.push_back(numValuesPerThreads);
+    }
+    partitionSizes.push_back(keys.size() - numValuesPerThreads * (numThreads-1));
+
+    executor::WorkStealingExecutor exec(numThreads, 1024, stealing);
+    executor::RunReport best;
+    best.makespan = DBL_MAX;
+    for(int run = 0; run < numRuns; run++) {
+        executor::RunReport report = exec.run(partitionSizes, [&](int threadId, int partition, size_t begin, size_t end) {
+            size_t offset = partition * numValuesPerThreads;
+            indexInsert<Index>(threadId, idx, offset + begin, offset + end, keys, values);
+        });
+        if(report.makespan < best.makespan) {
+            best = report;
+        }
+        idx.clear();
+    }
+    best.print();
+    return best;
+}
+
+/**
+ * Runs per-thread mixed workloads on the chunked executor, with or without
+ * work stealing. Returns the best run's report
+ */
+template <class Index>
+executor::RunReport workStealingMixedBenchmark(
+    Index &idx,
+    int numRuns,
+    bool stealing,
+    std::vector<std::vector<workload::Operation>>& workloads
+) {
+    std::vector<size_t> partitionSizes;
+    for(auto& ops : workloads) {
+        partitionSizes.push_back(ops.size());
+    }
+
+    executor::WorkStealingExecutor exec(workloads.size(), 1024, stealing);
+    executor::RunReport best;
+    best.makespan = DBL_MAX;
+    for(int run = 0; run < numRuns; run++) {
+        executor::RunReport report = exec.run(partitionSizes, [&](int threadId, int partition, size_t begin, size_t end) {
+            std::vector<workload::Operation>& ops = workloads[partition];
+            for(size_t i = begin; i < end; i++) {
+                if(ops[i].type == workload::OpType::Insert) {
+                    idx.insert(ops[i].key, ops[i].value);
+                } else {
+                    int64_t result;
+                    idx.lookup(ops[i].key, result);
+                }
+            }
+        });
+        if(report.makespan < best.makespan) {
+            best = report;
+        }
+        idx.clear();
+    }
+    best.print();
+    return best;
+}
+
+/**
+ * Mixed benchmark where each thread generates its workload chunk by chunk
+ * while running it, so the timing includes generation
+ */
+template <class Index>
+double streamingMixedBenchmark(
+    Index &idx,
+    int numRuns,
+    double percentInsert,
+    int64_t numOperations,
+    int numThreads
+) {
+    workload::WorkloadGenerator generator;
+    std::vector<std::thread> threads;
+    double currElapsed = DBL_MAX;
+    for(int run = 0; run < numRuns; run++) {
+        std::vector<workload::WorkloadStream> streams =
+            generator.generateParallelStreams(percentInsert, numOperations, numThreads, run);
+        Timer t;
+        for(int i = 0; i < numThreads; i++) {
+            threads.push_back(std::thread([&](int threadId){
+                std::vector<workload::Operation> chunk;
+                chunk.reserve(STREAM_CHUNK_SIZE);
+                while(streams[threadId].nextChunk(chunk, STREAM_CHUNK_SIZE)) {
+                    executeWorkload(idx, chunk);
+                }
+            }, i));
+        }
+
+        t.reset();
+        for(std::thread& t : threads) {
+            t.join();
+        }
+        double elapsed = t.elapsed();
+        currElapsed = std::min(elapsed, currElapsed);
+        threads.clear();
+        idx.clear();
+    }
+
+    printf("Execution Time: %.6fs \n", currElapsed);
+    return currElapsed;
+}
+
+/**
+ * Runs the per-thread workloads once while a sampler records ops, restarts,
+ * fallbacks and tree height every intervalMs, then writes the series to path
+ */
+template <class Index>
+double timelineMixedBenchmark(
+    Index &idx,
+    std::vector<std::vector<workload::Operation>>& workloads,
+    const char* path,
+    int intervalMs = 10
+) {
+    std::vector<std::thread> threads;
+    timeline::Sampler sampler(workloads.size(), intervalMs, [&]() { return idx.treeHeight.load(); });
+
+    Timer t;
+    sampler.start();
+    for(int i = 0; i < workloads.size(); i++) {
+        threads.push_back(std::thread([&](int threadId){
+            sampler.attach(threadId);
+            std::vector<workload::Operation>& ops = workloads[threadId];
+            for(size_t begin = 0; begin < ops.size(); begin += 256) {
+                size_t end = std::min(begin + 256, ops.size());
+                for(size_t j = begin; j < end; j++) {
+                    if(ops[j].type == workload::OpType::Insert) {
+                        idx.insert(ops[j].key, ops[j].value);
+                    } else {
+                        int64_t result;
+                        idx.lookup(ops[j].key, result);
+                    }
+                }
+                timeline::countOps(end - begin);
+            }
+            timeline::Sampler::detach();
+        }, i));
+    }
+    for(std::thread& t : threads) {
+        t.join();
+    }
+    double elapsed = t.elapsed();
+    sampler.stop();
+    idx.clear();
+
+    printf("Execution Time: %.6fs \n", elapsed);
+    sampler.printSummary();
+    if(!sampler.writeCSV(path)) {
+        fprintf(stderr, "Could not write timeline to %s \n", path);
+    }
+    return elapsed;
+}
+
+/**
+ * Interleaves inserts and lookups
+ */
+template <class Index>
+void sinleThreadedMixedBenchmark(Index& idx, std::vector<workload::Operation> ops) {
+    executeWorkloadAssert(idx, ops);
+    idx.clear();
+}
+
+
+template <class Index>
+double singleThreadedInsertBenchmark(
+    Index &idx, 
+    std::vector<int64_t>& keys,
+    std::vector<int64_t>& values,
+    int numRuns  
+ ) {
+    std::vector<std::thread> threads; 
+
+    int numOperations = keys.size();
+    double currElapsed = DBL_MAX;
+    Timer t; 
+    for(int i = 0; i < numRuns; i++) {
+        t.reset();
+        indexInsert<Index>(0, idx, 0, numOperations, keys, values);
+
+        double elapsed = t.elapsed(); 
+        currElapsed = std::min(elapsed, currElapsed);
+    }
+    printf("Execution Time: %.6fms \n", currElapsed);
+    idx.stats().printSummary();
+
+    idx.clear();
+    return currElapsed; 
+}
+
+template <class Index>
+double singleThreadedLookupBenchmark(
+    Index &idx, 
+    std::vector<int64_t>& keys,
+    std::vector<int64_t>& values,
+    int numRuns  
+ ) {
+    std::vector<std::thread> threads; 
+
+    int numOperations = keys.size();
+    double currElapsed = DBL_MAX;
+    indexInsert<Index>(0, idx, 0, numOperations, keys, values);
+    Timer t; 
+    for(int i = 0; i < numRuns; i++) {
+        t.reset();
+        indexLookup<Index>(0, idx, 0, keys.size(), keys, values);
+        double elapsed = t.elapsed(); 
+        currElapsed = std::min(elapsed, currElapsed);
+    }
+    printf("Execution Time: %.6fms \n", currElapsed);
+    idx.stats().printSummary();
+
+    idx.clear();
+    return currElapsed; 
+}
+
+void runInsertBenchmarks(int numThreads, int numOperations) {
+    btreertm::BTree<int64_t, int64_t> idx_rtm(false);
+    btreeolc::BTree<int64_t, int64_t> idx_olc;
+    btreelocked::BTree<int64_t, int64_t> idx_locked;
+    btreesinglethread::BTree<int64_t, int64_t> idx_single;
+    std::vector<int64_t> keys;
+    std::vector<int64_t> values;
+    keys.reserve(numOperations);
+    values.reserve(numOperations);
+
+    fprintf(stdout, "Running Insert Benchmarks: threads: %d, operations: %d \n", numThreads, numOperations);
+
+
+    generateRandomValues(numOperations, keys, values); 
+    fprintf(stdout, "Running in %d threads \n", numThreads);
+
+    fprintf(stdout, "Waming up cache: Benchmarking idx_olc \n");
+    multiInsertThreadedBenchmark(idx_olc, numThreads, 2, keys, values); 
+    fprintf(stdout, "Done Warming up the caches! \n");
+
+    fprintf(stdout, "Benchmarking Multithreaded idx_rtm \n");
+    multiInsertThreadedBenchmark(idx_rtm, numThreads, 5, keys, values);
+
+    fprintf(stdout, "Benchmarking idx_olc \n");
+    multiInsertThreadedBenchmark(idx_olc, numThreads, 5, keys, values); 
+
+    fprintf(stdout, "Benchmarking idx_locked \n");
+    multiInsertThreadedBenchmark(idx_olc, numThreads, 2, keys, values); 
+
+    fprintf(stdout, "Benchmarking idx_single single threaded \n");
+    singleThreadedInsertBenchmark(idx_single, keys, values, 5); 
+    fprintf(stdout, "------------------------------ \n"); 
+}
+
+void runLookupBenchmarks(int numThreads, int numOperations) {
+    btreertm::BTree<int64_t, int64_t> idx_rtm(false);
+    btreeolc::BTree<int64_t, int64_t> idx_olc;
+    btreelocked::BTree<int64_t, int64_t> idx_locked;
+    btreesinglethread::BTree<int64_t, int64_t> idx_single;
+    std::vector<int64_t> keys;
+    std::vector<int64_t> values;
+    keys.reserve(numOperations);
+    values.reserve(numOperations);
+
+    fprintf(stdout, "Running Lookup Benchmarks: threads: %d, operations: %d \n", numThreads, numOperations);
+
+
+    generateRandomValues(numOperations, keys, values); 
+    fprintf(stdout, "Running in %d threads \n", numThreads);
+
+    fprintf(stdout, "Waming up cache: Benchmarking idx_olc \n");
+    multiLookupThreadedBenchmark(idx_olc, numThreads, 2, keys, values); 
+    fprintf(stdout, "Done Warming up the caches! \n");
+
+    fprintf(stdout, "Benchmarking Multithreaded idx_rtm \n");
+    multiLookupThreadedBenchmark(idx_rtm, numThreads, 5, keys, values);
+
+    fprintf(stdout, "Benchmarking idx_olc \n");
+    multiLookupThreadedBenchmark(idx_olc, numThreads, 5, keys, values); 
+
+    fprintf(stdout, "Benchmarking idx_locked \n");
+    multiLookupThreadedBenchmark(idx_locked, numThreads, 2, keys, values); 
+
+    fprintf(stdout, "Benchmarking idx_single single threaded \n");
+    singleThreadedLookupBenchmark(idx_single, keys, values, 5); 
+    fprintf(stdout, "------------------------------ \n"); 
+}
+
+void runMixedBenchmarks(int numThreads, int numOperations, double percentInsert) {
+    btreertm::BTree<int64_t, int64_t> idx_rtm(false);
+    btreeolc::BTree<int64_t, int64_t> idx_olc;
+    btreelocked::BTree<int64_t, int64_t> idx_locked;
+    btreesinglethread::BTree<int64_t, int64_t> idx_single;
+
+    fprintf(stdout, "Multi threaded mixed benchmark, numThreads: %d, numOperations: %d, percentInsert: %f \n", 
+        numThreads, numOperations, percentInsert);
+
+    workload::WorkloadGenerator generator;
+    std::vector<std::vector<workload::Operation>> workloads = 
+        generator.generateParallelWorkload(percentInsert, numOperations, numThreads);
+
+    fprintf(stdout, "Waming up cache: Benchmarking idx_olc \n");
+    multiThreadedMixedBenchmark(idx_olc, 2, workloads);
+
+    fprintf(stdout, "Running multithreaded idx_rtm mixed benchmark \n");
+    multiThreadedMixedBenchmark(idx_rtm, 5, workloads);
+
+    fprintf(stdout, "Running multithreaded idx_olc mixed benchmark \n");
+    multiThreadedMixedBenchmark(idx_olc, 5, workloads);
+
+    fprintf(stdout, "Running multithreaded idx_locked mixed benchmark \n");
+    multiThreadedMixedBenchmark(idx_locked, 2, workloads);
+
+    fprintf(stdout, "Running singlethreaded benchmark \n");
+    Timer t;
+    for(int i = 0; i < workloads.size(); i++) {
+        executeWorkload(idx_single, workloads[i]);
+    }
+    double elapsed = t.elapsed(); 
+
+    fprintf(stdout, "Execution Time: %.6fms \n", elapsed);
+    fprintf(stdout, "------------------------------- \n");
+}
+
+void runWorkStealingBenchmarks(int numThreads, int numOperations, double percentInsert) {
+    btreertm::BTree<int64_t, int64_t> idx_rtm(false);
+    btreeolc::BTree<int64_t, int64_t> idx_olc;
+    btreelocked::BTree<int64_t, int64_t> idx_locked;
+    std::vector<int64_t> keys;
+    std::vector<int64_t> values;
+    keys.reserve(numOperations);
+    values.reserve(numOperations);
+
+    fprintf(stdout, "Running work stealing benchmarks: threads: %d, operations: %d, percentInsert: %f \n",
+        numThreads, numOperations, percentInsert);
+
+    generateRandomValues(numOperations, keys, values);
+    workload::WorkloadGenerator generator;
+    std::vector<std::vector<workload::Operation>> workloads =
+        generator.generateParallelWorkload(percentInsert, numOperations, numThreads);
+
+    for(bool stealing : {false, true}) {
+        const char* mode = stealing ? "work stealing" : "static partitions";
+
+        fprintf(stdout, "Benchmarking insert only idx_rtm, %s \n", mode);
+        workStealingInsertBenchmark(idx_rtm, numThreads, 5, stealing, keys, values);
+
+        fprintf(stdout, "Benchmarking insert only idx_olc, %s \n", mode);
+        workStealingInsertBenchmark(idx_olc, numThreads, 5, stealing, keys, values);
+
+        fprintf(stdout, "Benchmarking insert only idx_locked, %s \n", mode);
+        workStealingInsertBenchmark(idx_locked, numThreads, 2, stealing, keys, values);
+
+        fprintf(stdout, "Benchmarking mixed idx_rtm, %s \n", mode);
+        workStealingMixedBenchmark(idx_rtm, 5, stealing, workloads);
+
+        fprintf(stdout, "Benchmarking mixed idx_olc, %s \n", mode);
+        workStealingMixedBenchmark(idx_olc, 5, stealing, workloads);
+
+        fprintf(stdout, "Benchmarking mixed idx_locked, %s \n", mode);
+        workStealingMixedBenchmark(idx_locked, 2, stealing, workloads);
+    }
+    fprintf(stdout, "------------------------------- \n");
+}
+
+void runStreamingBenchmarks(int numThreads, int64_t numOperations, double percentInsert) {
+    btreertm::BTree<int64_t, int64_t> idx_rtm(false);
+    btreeolc::BTree<int64_t, int64_t> idx_olc;
+
+    fprintf(stdout, "Streaming mixed benchmark, numThreads: %d, numOperations: %ld, percentInsert: %f \n",
+        numThreads, numOperations, percentInsert);
+
+    fprintf(stdout, "Running streaming idx_rtm mixed benchmark \n");
+    streamingMixedBenchmark(idx_rtm, 3, percentInsert, numOperations, numThreads);
+
+    fprintf(stdout, "Running streaming idx_olc mixed benchmark \n");
+    streamingMixedBenchmark(idx_olc, 3, percentInsert, numOperations, numThreads);
+    fprintf(stdout, "------------------------------- \n");
+}
+
+void runTimelineBenchmarks(int numThreads, int numOperations, double percentInsert) {
+    btreertm::BTree<int64_t, int64_t> idx_rtm(false);
+    btreeolc::BTree<int64_t, int64_t> idx_olc;
+
+    fprintf(stdout, "Timeline benchmark, numThreads: %d, numOperations: %d, percentInsert: %f \n",
+        numThreads, numOperations, percentInsert);
+
+    workload::WorkloadGenerator generator;
+    std::vector<std::vector<workload::Operation>> workloads =
+        generator.generateParallelWorkload(percentInsert, numOperations, numThreads);
+
+    fprintf(stdout, "Sampling idx_rtm into timeline_rtm.csv \n");
+    timelineMixedBenchmark(idx_rtm, workloads, "timeline_rtm.csv");
+
+    fprintf(stdout, "Sampling idx_olc into timeline_olc.csv \n");
+    timelineMixedBenchmark(idx_olc, workloads, "timeline_olc.csv");
+    fprintf(stdout, "------------------------------- \n");
+}
+
+/**
+ * Runs an ascending insert workload (every thread appends to the right-most
+ * leaf) and a random mixed workload, printing the hottest nodes after each.
+ * Needs a -DBTREE_HEATMAP build to record anything
+ */
+void runHeatmapBenchmarks(int numThreads, int numOperations, double percentInsert) {
+    btreertm::BTree<int64_t, int64_t> idx_rtm(false);
+    btreeolc::BTree<int64_t, int64_t> idx_olc;
+    std::vector<int64_t> keys;
+    std::vector<int64_t> values;
 
-    double currElapsed = DBL_MAX;
-    int numValuesPerThreads = numOperations/numThreads; 
-    int insertFallbackTimes;
-    for(int run = 0; run < numRuns; run++) {
-        Timer t;
-        int i;
-        for(i = 0; i < numThreads-1; i++) {
+    fprintf(stdout, "Heatmap benchmark, numThreads: %d, numOperations: %d, percentInsert: %f \n",
+        numThreads, numOperations, percentInsert);
+
+    generateRandomValues(numOperations, keys, values);
+    std::sort(keys.begin(), keys.end());
+    workload::WorkloadGenerator generator;
+    std::vector<std::vector<workload::Operation>> workloads =
+        generator.generateParallelWorkload(percentInsert, numOperations, numThreads);
+
+    auto insertAscending = [&](auto& idx) {
+        std::vector<std::thread> threads;
+        for(int i = 0; i < numThreads; i++) {
             threads.push_back(std::thread([&](int threadId){
-                indexInsert<Index>(threadId, idx, threadId * numValuesPerThreads, (threadId+1) * numValuesPerThreads, keys, values);
+                for(int j = threadId; j < numOperations; j += numThreads) {
+                    idx.insert(keys[j], values[j]);
+                }
             }, i));
         }
-        t.reset();
-        
-        int currThreadId = numThreads-1;
-        indexInsert<Index>(currThreadId, idx, currThreadId * numValuesPerThreads, keys.size(), keys, values);
         for(std::thread& t : threads) {
-            t.join(); 
+            t.join();
+        }
+    };
+    auto runMixed = [&](auto& idx) {
+        std::vector<std::thread> threads;
+        for(int i = 0; i < numThreads; i++) {
+            threads.push_back(std::thread([&](int threadId){
+                executeWorkload(idx, workloads[threadId]);
+            }, i));
+        }
+        for(std::thread& t : threads) {
+            t.join();
         }
+    };
+
+    fprintf(stdout, "Ascending inserts idx_olc \n");
+    heatmap::reset();
+    insertAscending(idx_olc);
+    idx_olc.printHeatmap();
+    idx_olc.clear();
+
+    fprintf(stdout, "Ascending inserts idx_rtm \n");
+    heatmap::reset();
+    insertAscending(idx_rtm);
+    idx_rtm.printHeatmap();
+    idx_rtm.clear();
+
+    fprintf(stdout, "Mixed workload idx_olc \n");
+    heatmap::reset();
+    runMixed(idx_olc);
+    idx_olc.printHeatmap();
+    idx_olc.clear();
+
+    fprintf(stdout, "Mixed workload idx_rtm \n");
+    heatmap::reset();
+    runMixed(idx_rtm);
+    idx_rtm.printHeatmap();
+    idx_rtm.clear();
+    fprintf(stdout, "------------------------------- \n");
+}
 
-        double elapsed = t.elapsed(); 
-        currElapsed = std::min(elapsed, currElapsed);
-        insertFallbackTimes += idx.insertFallbackTimes;
-        idx.clear();
-        threads.clear();
+void runIngestBenchmarks(int numThreads, int numOperations) {
+    const char* path = "ingest.data";
+    btreeolc::BTree<int64_t, int64_t> idx_olc;
+    std::vector<int64_t> keys;
+    std::vector<int64_t> values;
+
+    fprintf(stdout, "Ingest benchmark, numThreads: %d, numOperations: %d \n", numThreads, numOperations);
+    ingest::writeRandomDump(path, numOperations);
+
+    fprintf(stdout, "Ingesting unsorted dump into idx_olc \n");
+    ingest::IngestTimings timings;
+    if(ingest::ingestFile(path, idx_olc, timings, 1.0, numThreads)) {
+        timings.print();
+        idx_olc.stats().printSummary();
+    } else {
+        fprintf(stderr, "Could not ingest %s \n", path);
     }
-    printf("Execution Time: %.6fms \n", currElapsed);
+    idx_olc.clear();
 
-    return currElapsed; 
+    fprintf(stdout, "Inserting the same keys one at a time into idx_olc \n");
+    generateRandomValues(numOperations, keys, values);
+    multiInsertThreadedBenchmark(idx_olc, numThreads, 1, keys, values);
+    remove(path);
+    fprintf(stdout, "------------------------------- \n");
+}
+
+/**
+ * Applies a sorted batch of updates over a loaded tree, with mergeSorted and
+ * with one insert per key
+ */
+void runMergeBenchmarks(int numThreads, int numOperations) {
+    btreeolc::BTree<int64_t, int64_t> idx_olc;
+    std::vector<std::pair<int64_t, int64_t>> batch;
+    for(int64_t key = 0; key < numOperations; key += 4) {
+        batch.push_back({key + 1, key});
+    }
 
+    fprintf(stdout, "Merge benchmark, numOperations: %d, batch: %zu \n", numOperations, batch.size());
+    for(int run = 0; run < 2; run++) {
+        for(int64_t key = 0; key < numOperations; key += 2) {
+            idx_olc.insert(key, key);
+        }
+        Timer t;
+        if(run == 0) {
+            fprintf(stdout, "Merging sorted batch into idx_olc \n");
+            idx_olc.mergeSorted(batch.begin(), batch.end());
+        } else {
+            fprintf(stdout, "Inserting sorted batch one key at a time into idx_olc \n");
+            for(auto& entry : batch) {
+                idx_olc.insert(entry.first, entry.second);
+            }
+        }
+        printf("Execution Time: %.6fms \n", t.elapsed());
+        idx_olc.stats(numThreads).printSummary();
+        idx_olc.clear();
+    }
+    fprintf(stdout, "------------------------------- \n");
 }
 
 /**
- * Benchmarks inserting multithreaded
+ * Multithreaded inserts of a known key range, into an empty tree and into a
+ * reserved skeleton
+ */
+void runReserveBenchmarks(int numThreads, int numOperations) {
+    btreeolc::BTree<int64_t, int64_t> idx_olc;
+    std::vector<int64_t> keys;
+    std::vector<int64_t> values;
+    generateRandomValues(numOperations, keys, values);
+
+    fprintf(stdout, "Reserve benchmark, numThreads: %d, numOperations: %d \n", numThreads, numOperations);
+    fprintf(stdout, "Inserting into empty idx_olc \n");
+    multiInsertThreadedBenchmark(idx_olc, numThreads, 3, keys, values);
+
+    fprintf(stdout, "Inserting into reserved idx_olc \n");
+    multiInsertThreadedBenchmark(idx_olc, numThreads, 3, keys, values, [&]() {
+        idx_olc.reserve(0, numOperations - 1, numOperations, numThreads);
+    });
+    fprintf(stdout, "------------------------------- \n");
+}
+
+/**
+ * B-link tree against btreeolc on inserts and insert-heavy mixes
+ */
+void runBLinkBenchmarks(int numThreads, int numOperations) {
+    btreeolc::BTree<int64_t, int64_t> idx_olc;
+    btreeblink::BTree<int64_t, int64_t> idx_blink;
+    std::vector<int64_t> keys;
+    std::vector<int64_t> values;
+    generateRandomValues(numOperations, keys, values);
+
+    fprintf(stdout, "B-link benchmark, numThreads: %d, numOperations: %d \n", numThreads, numOperations);
+    fprintf(stdout, "Running multithreaded idx_olc insert benchmark \n");
+    multiInsertThreadedBenchmark(idx_olc, numThreads, 3, keys, values);
+    fprintf(stdout, "Running multithreaded idx_blink insert benchmark \n");
+    multiInsertThreadedBenchmark(idx_blink, numThreads, 3, keys, values);
+
+    workload::WorkloadGenerator generator;
+    for(double percentInsert : {0.75, 0.9}) {
+        std::vector<std::vector<workload::Operation>> workloads =
+            generator.generateParallelWorkload(percentInsert, numOperations, numThreads);
+        fprintf(stdout, "Running multithreaded idx_olc mixed benchmark, percentInsert: %f \n", percentInsert);
+        multiThreadedMixedBenchmark(idx_olc, 3, workloads);
+        fprintf(stdout, "Running multithreaded idx_blink mixed benchmark, percentInsert: %f \n", percentInsert);
+        multiThreadedMixedBenchmark(idx_blink, 3, workloads);
+    }
+    fprintf(stdout, "------------------------------- \n");
+}
+
+/**
+ * One btreeolc against range partitioned btreeolc shards on inserts and
+ * insert-heavy mixes
+ */
+void runShardedBenchmarks(int numThreads, int numOperations) {
+    btreeolc::BTree<int64_t, int64_t> idx_olc;
+    sharded::ShardedBTree<btreeolc::BTree<int64_t, int64_t>> idx_sharded(numThreads * 4, 0, numOperations - 1);
+    std::vector<int64_t> keys;
+    std::vector<int64_t> values;
+    generateRandomValues(numOperations, keys, values);
+
+    fprintf(stdout, "Sharded benchmark, numThreads: %d, numOperations: %d, shards: %u \n", numThreads, numOperations, idx_sharded.numShards());
+    fprintf(stdout, "Running multithreaded idx_olc insert benchmark \n");
+    multiInsertThreadedBenchmark(idx_olc, numThreads, 3, keys, values);
+    fprintf(stdout, "Running multithreaded idx_sharded insert benchmark \n");
+    multiInsertThreadedBenchmark(idx_sharded, numThreads, 3, keys, values);
+
+    workload::WorkloadGenerator generator;
+    for(double percentInsert : {0.5, 0.9}) {
+        std::vector<std::vector<workload::Operation>> workloads =
+            generator.generateParallelWorkload(percentInsert, numOperations, numThreads);
+        fprintf(stdout, "Running multithreaded idx_olc mixed benchmark, percentInsert: %f \n", percentInsert);
+        multiThreadedMixedBenchmark(idx_olc, 3, workloads);
+        fprintf(stdout, "Running multithreaded idx_sharded mixed benchmark, percentInsert: %f \n", percentInsert);
+        multiThreadedMixedBenchmark(idx_sharded, 3, workloads);
+    }
+    fprintf(stdout, "------------------------------- \n");
+}
+
+/**
+ * Runs each workload through its own delegation client, lookups are sent
+ * without waiting and completions are dropped as they come in.
  * returns the elapsed time
  */
-template <class Index>
-double multiLookupThreadedBenchmark(
-    Index &idx, 
-    int numThreads, 
+double delegationMixedBenchmark(
+    delegation::Executor<int64_t, int64_t>& executor,
     int numRuns,
-    std::vector<int64_t>& keys,
-    std::vector<int64_t>& values 
- ) {
-    std::vector<std::thread> threads; 
-    int numOperations = keys.size();
-
+    std::vector<std::vector<workload::Operation>>& workloads
+) {
+    std::vector<std::thread> threads;
     double currElapsed = DBL_MAX;
-    int numValuesPerThreads = numOperations/numThreads; 
-    indexInsert<Index>(0, idx, 0, numOperations, keys, values);
+    treestats::TreeStats stats;
     for(int run = 0; run < numRuns; run++) {
         Timer t;
-        int i;
-        for(i = 0; i < numThreads-1; i++) {
+        for(int i = 0; i < workloads.size(); i++) {
             threads.push_back(std::thread([&](int threadId){
-                indexLookup<Index>(threadId, idx, threadId * numValuesPerThreads, (threadId+1) * numValuesPerThreads, keys, values);
+                auto& client = executor.client(threadId);
+                for(const workload::Operation& op : workloads[threadId]) {
+                    if(op.type == workload::OpType::Insert) {
+                        client.insert(op.key, op.value);
+                    } else {
+                        client.lookup(op.key);
+                    }
+                    if(client.completed.size() > 4096) {
+                        client.completed.clear();
+                    }
+                }
+                client.wait();
+                client.completed.clear();
             }, i));
         }
+
         t.reset();
-        
-        int currThreadId = numThreads-1;
-        indexLookup<Index>(currThreadId, idx, currThreadId * numValuesPerThreads, keys.size(), keys, values);
         for(std::thread& t : threads) {
-            t.join(); 
+            t.join();
         }
-
-        double elapsed = t.elapsed(); 
+        double elapsed = t.elapsed();
         currElapsed = std::min(elapsed, currElapsed);
         threads.clear();
+        if(run == numRuns-1) {
+            stats = executor.stats();
+        }
+        executor.clear();
     }
 
     printf("Execution Time: %.6fms \n", currElapsed);
+    stats.printSummary();
+    return currElapsed;
+}
 
-    idx.clear();
-    return currElapsed; 
+/**
+ * Delegation to key range owners against btreeolc and btreertm on write
+ * heavy mixes. The executor splits numThreads into workers and clients
+ */
+void runDelegationBenchmarks(int numThreads, int numOperations) {
+    btreertm::BTree<int64_t, int64_t> idx_rtm(false);
+    btreeolc::BTree<int64_t, int64_t> idx_olc;
+    int numWorkers = std::max(1, numThreads / 2);
+    int numClients = std::max(1, numThreads - numWorkers);
 
+    workload::WorkloadGenerator generator;
+    for(double percentInsert : {0.9, 0.5}) {
+        fprintf(stdout, "Delegation benchmark, numThreads: %d, numOperations: %d, percentInsert: %f \n",
+            numThreads, numOperations, percentInsert);
+        std::vector<std::vector<workload::Operation>> workloads =
+            generator.generateParallelWorkload(percentInsert, numOperations, numThreads);
+        fprintf(stdout, "Running multithreaded idx_rtm mixed benchmark \n");
+        multiThreadedMixedBenchmark(idx_rtm, 3, workloads);
+        fprintf(stdout, "Running multithreaded idx_olc mixed benchmark \n");
+        multiThreadedMixedBenchmark(idx_olc, 3, workloads);
+
+        std::vector<std::vector<workload::Operation>> clientWorkloads =
+            generator.generateParallelWorkload(percentInsert, numOperations, numClients);
+        fprintf(stdout, "Running delegation mixed benchmark, workers: %d, clients: %d \n", numWorkers, numClients);
+        // Started here, so idle workers do not take cores from the runs above
+        delegation::Executor<int64_t, int64_t> executor(numWorkers, numClients, 0, numOperations - 1);
+        delegationMixedBenchmark(executor, 3, clientWorkloads);
+    }
+    fprintf(stdout, "------------------------------- \n");
 }
 
-
+/**
+ * Benchmarks inserting multithreaded in micro-batches of batchSize keys
+ * returns the elapsed time
+ */
 template <class Index>
-double multiThreadedMixedBenchmark(
+double multiBatchInsertThreadedBenchmark(
     Index &idx,
+    int numThreads,
     int numRuns,
-    std::vector<std::vector<workload::Operation>> workloads
+    std::vector<int64_t>& keys,
+    std::vector<int64_t>& values,
+    int batchSize
 ) {
     std::vector<std::thread> threads;
     double currElapsed = DBL_MAX;
-    double insertFallbackTimes = 0;
-    double lookupFallbackTimes = 0;
-    for(int run = 0; run < numRuns; run++){
+    int perThread = keys.size() / numThreads;
+    treestats::TreeStats stats;
+    for(int run = 0; run < numRuns; run++) {
         Timer t;
-        for(int i = 0; i < workloads.size(); i++) {
+        for(int i = 0; i < numThreads; i++) {
             threads.push_back(std::thread([&](int threadId){
-                executeWorkload(idx, workloads[threadId]);
+                int end = threadId == numThreads - 1 ? keys.size() : (threadId + 1) * perThread;
+                for(int start = threadId * perThread; start < end; start += batchSize) {
+                    int n = std::min(batchSize, end - start);
+                    idx.insertBatch(keys.data() + start, values.data() + start, n);
+                }
             }, i));
         }
-
         t.reset();
         for(std::thread& t : threads) {
-            t.join(); 
+            t.join();
         }
         double elapsed = t.elapsed();
         currElapsed = std::min(elapsed, currElapsed);
+        if(run == numRuns-1) {
+            stats = idx.stats();
+        }
+        idx.clear();
         threads.clear();
-        lookupFallbackTimes += idx.lookupFallbackTimes;
-        insertFallbackTimes += idx.insertFallbackTimes;
-        idx.clear(); 
     }
-
     printf("Execution Time: %.6fms \n", currElapsed);
+    stats.printSummary();
     return currElapsed;
 }
+
 /**
- * Interleaves inserts and lookups
+ * Single key inserts against micro-batches for btreeolc and btreertm
  */
-template <class Index>
-void sinleThreadedMixedBenchmark(Index& idx, std::vector<workload::Operation> ops) {
-    executeWorkloadAssert(idx, ops);
-    idx.clear();
+void runBatchInsertBenchmarks(int numThreads, int numOperations) {
+    btreertm::BTree<int64_t, int64_t> idx_rtm(false);
+    btreeolc::BTree<int64_t, int64_t> idx_olc;
+    std::vector<int64_t> keys;
+    std::vector<int64_t> values;
+    generateRandomValues(numOperations, keys, values);
+
+    fprintf(stdout, "Batch insert benchmark, numThreads: %d, numOperations: %d \n", numThreads, numOperations);
+    fprintf(stdout, "Running multithreaded idx_olc insert benchmark \n");
+    multiInsertThreadedBenchmark(idx_olc, numThreads, 3, keys, values);
+    fprintf(stdout, "Running multithreaded idx_rtm insert benchmark \n");
+    multiInsertThreadedBenchmark(idx_rtm, numThreads, 3, keys, values);
+    for(int batchSize : {64, 256, 1024}) {
+        fprintf(stdout, "Running multithreaded idx_olc batch insert benchmark, batchSize: %d \n", batchSize);
+        multiBatchInsertThreadedBenchmark(idx_olc, numThreads, 3, keys, values, batchSize);
+        fprintf(stdout, "Running multithreaded idx_rtm batch insert benchmark, batchSize: %d \n", batchSize);
+        multiBatchInsertThreadedBenchmark(idx_rtm, numThreads, 3, keys, values, batchSize);
+    }
+    fprintf(stdout, "------------------------------- \n");
 }
 
+/**
+ * Reads all entries in chunks of range keys, the mvcc tree at one snapshot
+ * @return number of entries read
+ */
+uint64_t scanAll(btreeolc::BTree<int64_t, int64_t>& idx, std::vector<int64_t>& keys, std::vector<int64_t>& values) {
+    uint64_t total = 0;
+    int range = keys.size();
+    uint64_t got = idx.scanEntries(0, range, keys.data(), values.data());
+    while(got > 0) {
+        total += got;
+        got = got < (uint64_t)range ? 0 : idx.scanEntries(keys[got - 1] + 1, range, keys.data(), values.data());
+    }
+    return total;
+}
 
+uint64_t scanAll(btreemvcc::BTree<int64_t, int64_t>& idx, std::vector<int64_t>& keys, std::vector<int64_t>& values) {
+    auto snap = idx.snapshot();
+    uint64_t total = 0;
+    int range = keys.size();
+    uint64_t got = idx.scan(0, range, keys.data(), values.data(), snap);
+    while(got > 0) {
+        total += got;
+        got = got < (uint64_t)range ? 0 : idx.scan(keys[got - 1] + 1, range, keys.data(), values.data(), snap);
+    }
+    return total;
+}
+
+/**
+ * Benchmarks one full scan while numThreads - 1 threads keep updating
+ * existing keys
+ * returns the elapsed time of the scan
+ */
 template <class Index>
-double singleThreadedInsertBenchmark(
-    Index &idx, 
+double scanUnderUpdatesBenchmark(
+    Index &idx,
+    int numThreads,
+    int numRuns,
     std::vector<int64_t>& keys,
-    std::vector<int64_t>& values,
-    int numRuns  
- ) {
-    std::vector<std::thread> threads; 
-
-    int numOperations = keys.size();
+    std::vector<int64_t>& values
+) {
+    for(size_t i = 0; i < keys.size(); i++) {
+        idx.insert(keys[i], values[i]);
+    }
+    std::vector<int64_t> keysOut(1000);
+    std::vector<int64_t> valuesOut(1000);
     double currElapsed = DBL_MAX;
-    Timer t; 
-    for(int i = 0; i < numRuns; i++) {
-        t.reset();
-        indexInsert<Index>(0, idx, 0, numOperations, keys, values);
-
-        double elapsed = t.elapsed(); 
+    for(int run = 0; run < numRuns; run++) {
+        std::atomic<bool> scanning{true};
+        std::vector<std::thread> threads;
+        for(int i = 1; i < numThreads; i++) {
+            threads.push_back(std::thread([&](int threadId){
+                std::default_random_engine rng(threadId);
+                while(scanning) {
+                    idx.insert(keys[rng() % keys.size()], rng());
+                }
+            }, i));
+        }
+        Timer t;
+        uint64_t total = scanAll(idx, keysOut, valuesOut);
+        double elapsed = t.elapsed();
+        scanning = false;
+        for(std::thread& t : threads) {
+            t.join();
+        }
+        assert(total == keys.size());
         currElapsed = std::min(elapsed, currElapsed);
     }
+    idx.clear();
     printf("Execution Time: %.6fms \n", currElapsed);
+    return currElapsed;
+}
 
-    idx.clear();
-    return currElapsed; 
+/**
+ * Full scans of btreeolc against btreemvcc snapshots under concurrent updates
+ */
+void runMVCCBenchmarks(int numThreads, int numOperations) {
+    btreeolc::BTree<int64_t, int64_t> idx_olc;
+    btreemvcc::BTree<int64_t, int64_t> idx_mvcc;
+    idx_mvcc.startGarbageCollector();
+    std::vector<int64_t> keys;
+    std::vector<int64_t> values;
+    generateRandomValues(numOperations, keys, values);
+
+    fprintf(stdout, "MVCC scan benchmark, numThreads: %d, numOperations: %d \n", numThreads, numOperations);
+    fprintf(stdout, "Running idx_olc scan under updates benchmark \n");
+    scanUnderUpdatesBenchmark(idx_olc, numThreads, 3, keys, values);
+    fprintf(stdout, "Running idx_mvcc scan under updates benchmark \n");
+    scanUnderUpdatesBenchmark(idx_mvcc, numThreads, 3, keys, values);
+    fprintf(stdout, "------------------------------- \n");
 }
 
-template <class Index>
-double singleThreadedLookupBenchmark(
-    Index &idx, 
+/**
+ * Checkpoints a tree of numOperations keys to a local file, once on an
+ * idle tree and once while numThreads threads keep overwriting and adding
+ * keys, and reports the export time and bandwidth
+ */
+void runCheckpointBenchmarks(int numThreads, int numOperations) {
+    const char* path = "checkpoint_bench.data";
+    btreeolc::BTree<int64_t, int64_t> idx_olc;
+    std::vector<int64_t> keys(numOperations);
+    std::vector<int64_t> values(numOperations);
+    for(int i = 0; i < numOperations; i++) {
+        keys[i] = i * 2;
+        values[i] = i;
+    }
+    double bytes = (double)numOperations * sizeof(ingest::Record);
+
+    fprintf(stdout, "Checkpoint benchmark, numThreads: %d, numOperations: %d \n", numThreads, numOperations);
+    for(bool writing : {false, true}) {
+        idx_olc.bulkLoad(keys.data(), values.data(), numOperations);
+        std::atomic<bool> running{writing};
+        std::vector<std::thread> threads;
+        for(int i = 0; writing && i < numThreads; i++) {
+            threads.push_back(std::thread([&](int threadId){
+                std::default_random_engine rng(threadId);
+                while(running) {
+                    int64_t key = rng() % ((int64_t)numOperations * 2);
+                    idx_olc.insert(key, key);
+                }
+            }, i));
+        }
+        fprintf(stdout, "Running idx_olc checkpoint benchmark, writers: %d \n", writing ? numThreads : 0);
+        Timer t;
+        assert(idx_olc.checkpoint(path));
+        bool ok = idx_olc.waitCheckpoint();
+        double elapsed = t.elapsed();
+        running = false;
+        for(std::thread& t : threads) {
+            t.join();
+        }
+        assert(ok);
+        printf("Execution Time: %.6fms \n", elapsed);
+        printf("Bandwidth: %.1fMB/s \n", bytes / elapsed / (1 << 20));
+        idx_olc.clear();
+    }
+    remove(path);
+    fprintf(stdout, "------------------------------- \n");
+}
+
+/**
+ * Benchmarks logged inserts multithreaded, every thread commits after each
+ * commitEvery of its inserts. The log is a local file, removed after each run
+ * returns the elapsed time
+ */
+double walInsertThreadedBenchmark(
+    int numThreads,
+    int numRuns,
     std::vector<int64_t>& keys,
     std::vector<int64_t>& values,
-    int numRuns  
- ) {
-    std::vector<std::thread> threads; 
-
-    int numOperations = keys.size();
+    wal::Options options,
+    int commitEvery
+) {
+    const char* path = "wal_bench.log";
     double currElapsed = DBL_MAX;
-    indexInsert<Index>(0, idx, 0, numOperations, keys, values);
-    Timer t; 
-    for(int i = 0; i < numRuns; i++) {
+    int perThread = keys.size() / numThreads;
+    for(int run = 0; run < numRuns; run++) {
+        remove(path);
+        wal::LoggedBTree<int64_t, int64_t> idx;
+        assert(idx.open(path, options));
+        std::vector<std::thread> threads;
+        Timer t;
+        for(int i = 0; i < numThreads; i++) {
+            threads.push_back(std::thread([&](int threadId){
+                int end = threadId == numThreads - 1 ? keys.size() : (threadId + 1) * perThread;
+                for(int j = threadId * perThread; j < end; j++) {
+                    idx.insert(keys[j], values[j]);
+                    if((j + 1) % commitEvery == 0) {
+                        idx.commit();
+                    }
+                }
+                idx.commit();
+            }, i));
+        }
         t.reset();
-        indexLookup<Index>(0, idx, 0, keys.size(), keys, values);
-        double elapsed = t.elapsed(); 
+        for(std::thread& t : threads) {
+            t.join();
+        }
+        double elapsed = t.elapsed();
         currElapsed = std::min(elapsed, currElapsed);
     }
+    remove(path);
     printf("Execution Time: %.6fms \n", currElapsed);
-
-    idx.clear();
-    return currElapsed; 
+    return currElapsed;
 }
 
-void runInsertBenchmarks(int numThreads, int numOperations) {
-    btreertm::BTree<int64_t, int64_t> idx_rtm(false);
+/**
+ * Throughput of btreeolc inserts without a log against the redo log at
+ * different commit intervals and fsync batching
+ */
+void runWalBenchmarks(int numThreads, int numOperations) {
     btreeolc::BTree<int64_t, int64_t> idx_olc;
-    btreelocked::BTree<int64_t, int64_t> idx_locked;
-    btreesinglethread::BTree<int64_t, int64_t> idx_single;
     std::vector<int64_t> keys;
     std::vector<int64_t> values;
-    keys.reserve(numOperations);
-    values.reserve(numOperations);
-
-    fprintf(stdout, "Running Insert Benchmarks: threads: %d, operations: %d \n", numThreads, numOperations);
-
+    generateRandomValues(numOperations, keys, values);
+    const int commitEvery = 1024;
+
+    fprintf(stdout, "Write-ahead log benchmark, numThreads: %d, numOperations: %d \n", numThreads, numOperations);
+    fprintf(stdout, "Running multithreaded idx_olc insert benchmark \n");
+    multiInsertThreadedBenchmark(idx_olc, numThreads, 3, keys, values);
+    for(int micros : {100, 1000, 10000}) {
+        for(unsigned syncEvery : {1u, 10u, 0u}) {
+            wal::Options options;
+            options.commitInterval = std::chrono::microseconds(micros);
+            options.syncEvery = syncEvery;
+            fprintf(stdout, "Running multithreaded logged insert benchmark, commitInterval: %dus, syncEvery: %u \n",
+                micros, syncEvery);
+            walInsertThreadedBenchmark(numThreads, 3, keys, values, options, commitEvery);
+        }
+    }
+    fprintf(stdout, "------------------------------- \n");
+}
 
-    generateRandomValues(numOperations, keys, values); 
-    fprintf(stdout, "Running in %d threads \n", numThreads);
+/**
+ * Startup from a page image against rebuilding the tree with bulkLoad. The
+ * image serves a small working set of lookups long before every page has
+ * been read
+ */
+void runImageBenchmarks(int numThreads, int numOperations) {
+    const char* path = "image_bench.data";
+    const int numLookups = 10000;
+    btreeolc::BTree<int64_t, int64_t> idx_olc;
+    std::vector<int64_t> keys(numOperations);
+    std::vector<int64_t> values(numOperations);
+    for(int i = 0; i < numOperations; i++) {
+        keys[i] = i * 2;
+        values[i] = i;
+    }
+    std::vector<int64_t> lookups(numLookups);
+    std::default_random_engine rng(42);
+    for(int64_t& key : lookups) {
+        key = (rng() % numOperations) * 2;
+    }
+    auto lookupAll = [&]() {
+        for(int64_t key : lookups) {
+            int64_t result;
+            bool found = idx_olc.lookup(key, result);
+            assert(found && result == key / 2);
+        }
+    };
 
-    fprintf(stdout, "Waming up cache: Benchmarking idx_olc \n");
-    multiInsertThreadedBenchmark(idx_olc, numThreads, 2, keys, values); 
-    fprintf(stdout, "Done Warming up the caches! \n");
+    fprintf(stdout, "Image benchmark, numThreads: %d, numOperations: %d \n", numThreads, numOperations);
+    fprintf(stdout, "Running idx_olc bulkLoad and %d lookups \n", numLookups);
+    Timer t;
+    idx_olc.bulkLoad(keys.data(), values.data(), numOperations, 1.0, numThreads);
+    lookupAll();
+    printf("Execution Time: %.6fms \n", t.elapsed());
+
+    fprintf(stdout, "Running idx_olc saveImage \n");
+    t.reset();
+    assert(idx_olc.saveImage(path));
+    printf("Execution Time: %.6fms \n", t.elapsed());
+    idx_olc.clear();
+
+    fprintf(stdout, "Running idx_olc openImage \n");
+    t.reset();
+    assert(idx_olc.openImage(path));
+    printf("Execution Time: %.6fms \n", t.elapsed());
+    idx_olc.clear();
+
+    fprintf(stdout, "Running idx_olc openImage and %d lookups \n", numLookups);
+    t.reset();
+    assert(idx_olc.openImage(path));
+    lookupAll();
+    printf("Execution Time: %.6fms \n", t.elapsed());
+    idx_olc.clear();
+    remove(path);
+    fprintf(stdout, "------------------------------- \n");
+}
 
-    fprintf(stdout, "Benchmarking Multithreaded idx_rtm \n");
-    multiInsertThreadedBenchmark(idx_rtm, numThreads, 5, keys, values);
+void runOLCTests(int numThreads) {
+    btreeolc::BTree<int64_t, int64_t> idx_olc;
 
-    fprintf(stdout, "Benchmarking idx_olc \n");
-    multiInsertThreadedBenchmark(idx_olc, numThreads, 5, keys, values); 
+    fprintf(stderr,"Testing Single Threaded idx_olc");
+    testTreeSingleThreaded(idx_olc); 
 
-    fprintf(stdout, "Benchmarking idx_locked \n");
-    multiInsertThreadedBenchmark(idx_olc, numThreads, 2, keys, values); 
+    fprintf(stderr,"Testing Single Threaded Mixed idx_olc \n");
+    testMixedTreeSingleThreaded(idx_olc);
 
-    fprintf(stdout, "Benchmarking idx_single single threaded \n");
-    singleThreadedInsertBenchmark(idx_single, keys, values, 5); 
-    fprintf(stdout, "------------------------------ \n"); 
-}
+    fprintf(stderr, "Testing Inserts following by Looksups idx_olc \n");
+    testMultiThreaded<btreeolc::BTree<int64_t, int64_t>>(idx_olc, numThreads);
 
-void runLookupBenchmarks(int numThreads, int numOperations) {
-    btreertm::BTree<int64_t, int64_t> idx_rtm(false);
-    btreeolc::BTree<int64_t, int64_t> idx_olc;
-    btreelocked::BTree<int64_t, int64_t> idx_locked;
-    btreesinglethread::BTree<int64_t, int64_t> idx_single;
-    std::vector<int64_t> keys;
-    std::vector<int64_t> values;
-    keys.reserve(numOperations);
-    values.reserve(numOperations);
+    fprintf(stderr,"Testing MultiThreaded Mixed idx_olc \n");
+    testMixedTreeMultiThreaded<btreeolc::BTree<int64_t, int64_t>>(idx_olc, numThreads); 
 
-    fprintf(stdout, "Running Lookup Benchmarks: threads: %d, operations: %d \n", numThreads, numOperations);
+    fprintf(stderr,"Testing MultiThreaded Streaming Mixed idx_olc \n");
+    testStreamingMixedMultiThreaded(idx_olc, numThreads);
 
+    fprintf(stderr,"Testing sorted merge into idx_olc \n");
+    testMergeSorted(idx_olc, numThreads);
 
-    generateRandomValues(numOperations, keys, values); 
-    fprintf(stdout, "Running in %d threads \n", numThreads);
+    fprintf(stderr,"Testing reserved skeleton in idx_olc \n");
+    testReserve(numThreads);
 
-    fprintf(stdout, "Waming up cache: Benchmarking idx_olc \n");
-    multiLookupThreadedBenchmark(idx_olc, numThreads, 2, keys, values); 
-    fprintf(stdout, "Done Warming up the caches! \n");
+    fprintf(stderr,"Testing MultiThreaded appends idx_olc \n");
+    testAppendMultiThreaded(idx_olc, numThreads);
 
-    fprintf(stdout, "Benchmarking Multithreaded idx_rtm \n");
-    multiLookupThreadedBenchmark(idx_rtm, numThreads, 5, keys, values);
+    fprintf(stderr,"Testing hot leaf inserts idx_olc \n");
+    testHotLeafInserts(idx_olc, numThreads);
 
-    fprintf(stdout, "Benchmarking idx_olc \n");
-    multiLookupThreadedBenchmark(idx_olc, numThreads, 5, keys, values); 
+    fprintf(stderr,"Testing ingestion into idx_olc \n");
+    testIngestion(numThreads);
 
-    fprintf(stdout, "Benchmarking idx_locked \n");
-    multiLookupThreadedBenchmark(idx_locked, numThreads, 2, keys, values); 
+    fprintf(stderr,"Testing conditional updates idx_olc \n");
+    testConditionalOps(idx_olc, numThreads);
 
-    fprintf(stdout, "Benchmarking idx_single single threaded \n");
-    singleThreadedLookupBenchmark(idx_single, keys, values, 5); 
-    fprintf(stdout, "------------------------------ \n"); 
-}
+    fprintf(stderr,"Testing scan node set validation idx_olc \n");
+    testNodeSetValidation(idx_olc, numThreads);
 
-void runMixedBenchmarks(int numThreads, int numOperations, double percentInsert) {
-    btreertm::BTree<int64_t, int64_t> idx_rtm(false);
-    btreeolc::BTree<int64_t, int64_t> idx_olc;
-    btreelocked::BTree<int64_t, int64_t> idx_locked;
-    btreesinglethread::BTree<int64_t, int64_t> idx_single;
+    fprintf(stderr,"Testing snapshot export idx_olc \n");
+    testSnapshotExport(idx_olc, numThreads);
 
-    fprintf(stdout, "Multi threaded mixed benchmark, numThreads: %d, numOperations: %d, percentInsert: %f \n", 
-        numThreads, numOperations, percentInsert);
+    fprintf(stderr,"Testing write-ahead log recovery idx_olc \n");
+    testWriteAheadLog(numThreads);
 
-    workload::WorkloadGenerator generator;
-    std::vector<std::vector<workload::Operation>> workloads = 
-        generator.generateParallelWorkload(percentInsert, numOperations, numThreads);
+    fprintf(stderr,"Testing page image idx_olc \n");
+    testImage(idx_olc, numThreads);
 
-    fprintf(stdout, "Waming up cache: Benchmarking idx_olc \n");
-    multiThreadedMixedBenchmark(idx_olc, 2, workloads);
+    fprintf(stderr,"Testing batch inserts idx_olc \n");
+    testInsertBatch(idx_olc, numThreads);
 
-    fprintf(stdout, "Running multithreaded idx_rtm mixed benchmark \n");
-    multiThreadedMixedBenchmark(idx_rtm, 5, workloads);
+    fprintf(stderr,"Testing sharded idx_olc \n");
+    testShardedBTree(numThreads);
 
-    fprintf(stdout, "Running multithreaded idx_olc mixed benchmark \n");
-    multiThreadedMixedBenchmark(idx_olc, 5, workloads);
+    fprintf(stderr,"Testing multi-version snapshots idx_mvcc \n");
+    testMVCC(numThreads);
 
-    fprintf(stdout, "Running multithreaded idx_locked mixed benchmark \n");
-    multiThreadedMixedBenchmark(idx_locked, 2, workloads);
+    fprintf(stderr, "---------------------------------\n");
+}
 
-    fprintf(stdout, "Running singlethreaded benchmark \n");
-    Timer t;
-    for(int i = 0; i < workloads.size(); i++) {
-        executeWorkload(idx_single, workloads[i]);
-    }
-    double elapsed = t.elapsed(); 
+void runBLinkTests(int numThreads) {
+    btreeblink::BTree<int64_t, int64_t> idx_blink;
 
-    fprintf(stdout, "Execution Time: %.6fms \n", elapsed);
-    fprintf(stdout, "------------------------------- \n");
-}
+    fprintf(stderr,"Testing Single Threaded idx_blink \n");
+    testTreeSingleThreaded(idx_blink);
 
-void runOLCTests(int numThreads) {
-    btreeolc::BTree<int64_t, int64_t> idx_olc;
+    fprintf(stderr,"Testing Single Threaded Mixed idx_blink \n");
+    testMixedTreeSingleThreaded(idx_blink);
 
-    fprintf(stderr,"Testing Single Threaded idx_olc");
-    testTreeSingleThreaded(idx_olc); 
+    fprintf(stderr, "Testing Inserts following by Looksups idx_blink \n");
+    testMultiThreaded(idx_blink, numThreads);
 
-    fprintf(stderr,"Testing Single Threaded Mixed idx_olc \n");
-    testMixedTreeSingleThreaded(idx_olc);
+    fprintf(stderr,"Testing MultiThreaded Mixed idx_blink \n");
+    testMixedTreeMultiThreaded(idx_blink, numThreads);
 
-    fprintf(stderr, "Testing Inserts following by Looksups idx_olc \n");
-    testMultiThreaded<btreeolc::BTree<int64_t, int64_t>>(idx_olc, numThreads);
+    fprintf(stderr, "---------------------------------\n");
+}
 
-    fprintf(stderr,"Testing MultiThreaded Mixed idx_olc \n");
-    testMixedTreeMultiThreaded<btreeolc::BTree<int64_t, int64_t>>(idx_olc, numThreads); 
+void runDelegationTests(int numThreads) {
+    fprintf(stderr,"Testing delegation executor \n");
+    testDelegation(numThreads);
 
     fprintf(stderr, "---------------------------------\n");
 }
@@ -561,6 +2518,15 @@ void runRTMTests(int numThreads) {
     fprintf(stderr,"Testing MultiThreaded Mixed idx_rtm \n");
     testMixedTreeMultiThreaded<btreertm::BTree<int64_t, int64_t>>(idx_rtm, numThreads);
 
+    fprintf(stderr,"Testing batch inserts idx_rtm \n");
+    testInsertBatch(idx_rtm, numThreads);
+
+    fprintf(stderr,"Testing multi-key transactions idx_rtm \n");
+    testTransact(idx_rtm, numThreads);
+
+    fprintf(stderr,"Testing conditional updates idx_rtm \n");
+    testConditionalOps(idx_rtm, numThreads);
+
     fprintf(stderr, "---------------------------------\n");
 }
 
@@ -578,6 +2544,15 @@ void runRTMWeavedTests(int numThreads) {
     fprintf(stderr,"Testing MultiThreaded Mixed idx_rtm \n");
     testMixedTreeMultiThreaded<btreertm::BTree<int64_t, int64_t>>(idx_weaved, numThreads);
 
+    fprintf(stderr,"Testing batch inserts idx_weaved \n");
+    testInsertBatch(idx_weaved, numThreads);
+
+    fprintf(stderr,"Testing multi-key transactions idx_weaved \n");
+    testTransact(idx_weaved, numThreads);
+
+    fprintf(stderr,"Testing conditional updates idx_weaved \n");
+    testConditionalOps(idx_weaved, numThreads);
+
     fprintf(stderr, "---------------------------------\n"); 
 }
 
@@ -669,9 +2644,33 @@ int main(int argc, char *argv[]) {
 
     runRTMTests(10);
     runRTMWeavedTests(10);
+    runOLCTests(10);
+    runBLinkTests(10);
+    runDelegationTests(10);
     runMixedBenchmarks(numThreads, NUM_ELEMENTS_MULTI, 0.25);
     runMixedBenchmarks(numThreads, NUM_ELEMENTS_MULTI, 0.5);
     runMixedBenchmarks(numThreads, NUM_ELEMENTS_MULTI, 0.75);
     runInsertBenchmarks(numThreads, NUM_ELEMENTS_MULTI);
     runLookupBenchmarks(numThreads, NUM_ELEMENTS_MULTI);
+    runWorkStealingBenchmarks(numThreads, NUM_ELEMENTS_MULTI, percentInsert);
+    runStreamingBenchmarks(numThreads, NUM_ELEMENTS_MULTI, percentInsert);
+    runTimelineBenchmarks(numThreads, NUM_ELEMENTS_MULTI, percentInsert);
+    runIngestBenchmarks(numThreads, NUM_ELEMENTS_MULTI);
+    runMergeBenchmarks(numThreads, NUM_ELEMENTS_MULTI);
+    runReserveBenchmarks(numThreads, NUM_ELEMENTS_MULTI);
+    runBLinkBenchmarks(numThreads, NUM_ELEMENTS_MULTI);
+    runShardedBenchmarks(numThreads, NUM_ELEMENTS_MULTI);
+    runDelegationBenchmarks(numThreads, NUM_ELEMENTS_MULTI);
+    runBatchInsertBenchmarks(numThreads, NUM_ELEMENTS_MULTI);
+    runMVCCBenchmarks(numThreads, NUM_ELEMENTS_MULTI);
+    runCheckpointBenchmarks(numThreads, NUM_ELEMENTS_MULTI);
+    runWalBenchmarks(numThreads, NUM_ELEMENTS_MULTI);
+    runImageBenchmarks(numThreads, NUM_ELEMENTS_MULTI);
+
+#ifdef BTREE_TRACE
+    trace::dumpChromeTrace("trace.json");
+#endif
+#ifdef BTREE_HEATMAP
+    runHeatmapBenchmarks(numThreads, NUM_ELEMENTS_MULTI, percentInsert);
+#endif
 }
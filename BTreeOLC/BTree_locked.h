@@ -13,6 +13,10 @@
 #include <iostream>
 #include <mutex>
 
+#include "TreeStats.h"
+#include "TreeVerifier.h"
+#include "Teardown.h"
+
 namespace btreelocked {
 
     enum class PageType : uint8_t { BTreeInner=1, BTreeLeaf=2 };
@@ -179,13 +183,39 @@ namespace btreelocked {
             std::atomic<NodeBase*> root;
             int insertFallbackTimes;
             int lookupFallbackTimes;
+            teardown::Reclaimer reclaimer;
 
             BTree() {
                 root = new BTreeLeaf<Key,Value>();
             }
 
+            ~BTree() {
+                reclaimer.wait();
+                freeNodes(root);
+            }
+
+            void freeNodes(NodeBase* node, int numThreads = parallel::defaultThreads()) {
+                teardown::freeTree<BTreeInner<Key>, BTreeLeaf<Key,Value>>(node, numThreads);
+            }
+
+            /**
+             * Frees the old tree on all cores. No operation may be running
+             */
             void clear() {
+                NodeBase* old = root;
+                root = new BTreeLeaf<Key,Value>();
+                freeNodes(old);
+            }
+
+            /**
+             * Swaps in an empty tree right away and frees the old one on a
+             * background thread. Operations started before the swap must have
+             * finished
+             */
+            void clearAsync() {
+                NodeBase* old = root;
                 root = new BTreeLeaf<Key,Value>();
+                reclaimer.run([this, old]() { freeNodes(old, 1); });
             }
 
             bool checkTree() {
@@ -216,6 +246,22 @@ namespace btreelocked {
                     return 1;
                 }
             }
+            /**
+             * Checks ordering, separator and fanout invariants in parallel,
+             * see TreeVerifier.h. Needs a tree without concurrent writers
+             */
+            treeverify::VerifyResult verify(int numThreads = parallel::defaultThreads()) {
+                return treeverify::verify<Key, BTreeInner<Key>, BTreeLeaf<Key,Value>>(root.load(), numThreads);
+            }
+
+            /**
+             * Node counts per level, fill histograms and memory use, see
+             * TreeStats.h. Only exact while no writer is running
+             */
+            treestats::TreeStats stats(int numThreads = parallel::defaultThreads()) {
+                return treestats::collect<BTreeInner<Key>, BTreeLeaf<Key,Value>>(root.load(), numThreads);
+            }
+
             void makeRoot(Key k,NodeBase* leftChild,NodeBase* rightChild) {
                 auto inner = new BTreeInner<Key>();
                 inner->count = 1;
@@ -4,10 +4,21 @@
 #include <cstring>
 #include <atomic>
 #include <immintrin.h>
+#include <cpuid.h>
 #include <sched.h>
 #include <mutex>
 #include <functional>
 #include <shared_mutex>
+#include <vector>
+#include <algorithm>
+
+#include "Timeline.h"
+#include "Trace.h"
+#include "Heatmap.h"
+#include "TreeStats.h"
+#include "TreeVerifier.h"
+#include "Teardown.h"
+#include "AncestorStack.h"
 
 #define MAX_TRANSACTION_RESTART 6 
 namespace btreertm{
@@ -16,6 +27,36 @@ namespace btreertm{
 
     static const uint64_t pageSize = 3968 + 72; 
 
+    /**
+     * Whether the CPU has RTM (CPUID leaf 7, EBX bit 11)
+     */
+    inline bool rtmSupported() {
+        unsigned eax, ebx, ecx, edx;
+        if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+            return false;
+        }
+        return (ebx & (1u << 11)) != 0;
+    }
+
+    enum class TxOpType : uint8_t { Insert, Lookup };
+
+    /**
+     * One operation of a transact call. Lookups fill in value and found
+     */
+    template<class Key,class Value>
+    struct TxOp {
+        TxOpType type;
+        Key key;
+        Value value;
+        bool found;
+    };
+
+    // Most operations one transact call may hold
+    static const int maxTransactOps = 8;
+
+    // Abort code of a transact transaction that met a leaf without room
+    static const unsigned abortNeedsSplit = 6;
+
     struct OptLock {
         std::atomic<uint64_t> typeVersionLockObsolete{0b100};
 
@@ -33,6 +74,8 @@ namespace btreertm{
             if (isLocked(version) || isObsolete(version)) {
                 _mm_pause();
                 needRestart = true;
+                TRACE_EVENT(RestartReadLock, this, 0);
+                HEATMAP_RESTART(this);
             }
             return version;
         }
@@ -52,6 +95,8 @@ namespace btreertm{
             } else {
                 _mm_pause();
                 needRestart = true;
+                TRACE_EVENT(RestartUpgrade, this, 0);
+                HEATMAP_RESTART(this);
             }
         }
 
@@ -64,11 +109,19 @@ namespace btreertm{
         }
 
         void checkOrRestart(uint64_t startRead, bool &needRestart) const {
-            readUnlockOrRestart(startRead, needRestart);
+            needRestart = (startRead != typeVersionLockObsolete.load());
+            if (needRestart) {
+                TRACE_EVENT(RestartCheck, this, 0);
+                HEATMAP_RESTART(this);
+            }
         }
 
         void readUnlockOrRestart(uint64_t startRead, bool &needRestart) const {
             needRestart = (startRead != typeVersionLockObsolete.load());
+            if (needRestart) {
+                TRACE_EVENT(RestartReadUnlock, this, 0);
+                HEATMAP_RESTART(this);
+            }
         }
 
         void writeUnlockObsolete() {
@@ -149,22 +202,62 @@ namespace btreertm{
                 return true;
             }
 
+            /**
+             * Sorts the appended entries. Of several entries with the same
+             * key only the last appended one is kept, so a repeated insert
+             * acts as an update
+             */
             void restructure() {
                if(!isSorted) {
+                    TRACE_EVENT(LeafRestructure, this, count);
                     Entry temp[count];
                     for(int i = 0; i < count; i++) {
                         temp[i].k = keys[i];
                         temp[i].p = payloads[i];
                     }
-                    std::sort(temp, temp + count, compareEntries);
+                    std::stable_sort(temp, temp + count, compareEntries);
+                    unsigned unique = 0;
                     for(int i = 0; i < count; i++) {
-                        keys[i] = temp[i].k;
-                        payloads[i] = temp[i].p;
+                        if(unique > 0 && keys[unique-1] == temp[i].k) {
+                            payloads[unique-1] = temp[i].p;
+                        } else {
+                            keys[unique] = temp[i].k;
+                            payloads[unique] = temp[i].p;
+                            unique++;
+                        }
                     }
+                    count = unique;
                     isSorted = true;
                 } 
             }
 
+            /**
+             * Overwrites the payload of k if the leaf has it, appends otherwise
+             */
+            bool upsert(Key k,Payload p) {
+                for(unsigned i = 0; i < count; i++) {
+                    if(keys[i] == k) {
+                        payloads[i] = p;
+                        return true;
+                    }
+                }
+                return insert(k, p);
+            }
+
+            bool find(Key k,Payload& p) {
+                Payload* current = payloadFor(k);
+                if (current) {
+                    p = *current;
+                }
+                return current != nullptr;
+            }
+
+            Payload* payloadFor(Key k) {
+                restructure();
+                unsigned pos = lowerBound(k);
+                return ((pos<count) && (keys[pos]==k)) ? &payloads[pos] : nullptr;
+            }
+
             BTreeLeaf* split(Key& sep) {
                 restructure();   
                 BTreeLeaf* newLeaf = new BTreeLeaf();
@@ -192,12 +285,6 @@ namespace btreertm{
                 type=typeMarker;
             }
 
-            ~BTreeInner() {
-                for(int i = 0; i < count; i++) {
-                    delete children[i];
-                }
-            }
-
             bool isFull() { return count==(maxEntries-1); };
 
             unsigned lowerBoundBF(Key k) {
@@ -254,9 +341,13 @@ namespace btreertm{
     template<class Key,class Value>
         struct BTree {
            NodeBase* root;
+           std::atomic<int> treeHeight{1};
            int insertFallbackTimes;
            int lookupFallbackTimes;
            bool weaved;
+           teardown::Reclaimer reclaimer;
+           // transact and writeLeaf only start transactions if set, otherwise they take leaf latches
+           bool useRtm = rtmSupported();
 
             BTree(bool weaved_) {
                 root = new BTreeLeaf<Key,Value>();
@@ -265,11 +356,39 @@ namespace btreertm{
                 weaved = weaved_;
             }
 
+            ~BTree() {
+                reclaimer.wait();
+                freeNodes(root);
+            }
+
+            void freeNodes(NodeBase* node, int numThreads = parallel::defaultThreads()) {
+                teardown::freeTree<BTreeInner<Key>, BTreeLeaf<Key,Value>>(node, numThreads);
+            }
+
+            /**
+             * Frees the old tree on all cores. No operation may be running
+             */
             void clear() {
-                delete root;
+                NodeBase* old = root;
+                root = new BTreeLeaf<Key,Value>();
                 insertFallbackTimes = 0;
                 lookupFallbackTimes = 0;
-                root = new BTreeLeaf<Key, Value>();
+                treeHeight = 1;
+                freeNodes(old);
+            }
+
+            /**
+             * Swaps in an empty tree right away and frees the old one on a
+             * background thread. Operations started before the swap must have
+             * finished
+             */
+            void clearAsync() {
+                NodeBase* old = root;
+                root = new BTreeLeaf<Key,Value>();
+                insertFallbackTimes = 0;
+                lookupFallbackTimes = 0;
+                treeHeight = 1;
+                reclaimer.run([this, old]() { freeNodes(old, 1); });
             }
 
             bool checkTree() {
@@ -301,6 +420,51 @@ namespace btreertm{
                 }
             }
 
+            /**
+             * Checks ordering, separator and fanout invariants in parallel,
+             * see TreeVerifier.h. Needs a tree without concurrent writers
+             */
+            treeverify::VerifyResult verify(int numThreads = parallel::defaultThreads()) {
+                return treeverify::verify<Key, BTreeInner<Key>, BTreeLeaf<Key,Value>>(root, numThreads);
+            }
+
+            /**
+             * Node counts per level, fill histograms and memory use, see
+             * TreeStats.h. Only exact while no writer is running
+             */
+            treestats::TreeStats stats(int numThreads = parallel::defaultThreads()) {
+                return treestats::collect<BTreeInner<Key>, BTreeLeaf<Key,Value>>(root, numThreads);
+            }
+
+            /**
+             * Prints contention per level and the topN hottest nodes, see
+             * Heatmap.h. Call while no operation is running
+             */
+            void printHeatmap(int topN = 10) {
+                heatmap::report<Key, BTreeInner<Key>, BTreeLeaf<Key,Value>>(root, topN);
+            }
+
+            /**
+             * Leaf currently covering k, found with version checks but no
+             * locks. Used to attribute aborts, whose transaction state is lost
+             */
+            NodeBase* leafFor(Key k) {
+restart:
+                NodeBase* node = root;
+                uint64_t versionNode = node->typeVersionLockObsolete.load();
+                if (node->isLocked(versionNode) || (node != root)) goto restart;
+
+                while (node->type==PageType::BTreeInner) {
+                    auto inner = static_cast<BTreeInner<Key>*>(node);
+                    NodeBase* child = inner->children[inner->lowerBound(k)];
+                    if (versionNode != inner->typeVersionLockObsolete.load()) goto restart;
+                    node = child;
+                    versionNode = node->typeVersionLockObsolete.load();
+                    if (node->isLocked(versionNode)) goto restart;
+                }
+                return node;
+            }
+
             void makeRoot(Key k,NodeBase* leftChild,NodeBase* rightChild) {
                 auto inner = new BTreeInner<Key>();
                 inner->count = 1;
@@ -308,6 +472,8 @@ namespace btreertm{
                 inner->children[0] = leftChild;
                 inner->children[1] = rightChild;
                 root = inner;
+                treeHeight++;
+                TRACE_EVENT(MakeRoot, inner, treeHeight);
             }
 
             void insert(Key k, Value v) {
@@ -315,11 +481,17 @@ namespace btreertm{
                 int restartReason = 156;
         restart:
                 if(restartCount++ > MAX_TRANSACTION_RESTART) { 
+                    timeline::countFallback();
+                    TRACE_EVENT(RtmFallback, root, restartReason);
                     insertLatched(k, v);
                     return; 
                 }
+                if(restartCount > 1)
+                    timeline::countRestart();
 
                 if((restartReason = _xbegin()) != _XBEGIN_STARTED) {
+                    TRACE_EVENT(RtmAbort, root, restartReason);
+                    HEATMAP_ABORT(leafFor(k));
                     goto restart;
                 }
 
@@ -347,6 +519,7 @@ namespace btreertm{
                     if (inner->isFull()) {
                         // Split
                         Key sep; BTreeInner<Key>* newInner = inner->split(sep);
+                        TRACE_EVENT(SplitInner, inner, inner->count);
                         if (parent)
                             parent->insert(sep,newInner);
                         else
@@ -388,6 +561,7 @@ namespace btreertm{
                 // Split leaf if full
                 if (leaf->count>=leaf->maxEntries) {
                     Key sep; BTreeLeaf<Key,Value>* newLeaf = leaf->split(sep);
+                    TRACE_EVENT(SplitLeaf, leaf, leaf->count);
                     if (parent)
                         parent->insert(sep, newLeaf);
                     else
@@ -407,18 +581,190 @@ namespace btreertm{
                 _xend();
             }
 
-            void insertLatched(Key k, Value v) {
-restart:
-                bool needRestart = false;
+            /**
+             * Inserts a micro-batch of n pairs. The batch is sorted and
+             * duplicate keys are reduced to their last pair, then each
+             * transaction descends once and appends every key of the batch
+             * that belongs to the leaf it reached
+             */
+            void insertBatch(const Key* keys, const Value* values, size_t n) {
+                std::vector<std::pair<Key,Value>> batch(n);
+                for (size_t i = 0; i < n; i++) {
+                    batch[i] = {keys[i], values[i]};
+                }
+                std::stable_sort(batch.begin(), batch.end(),
+                    [](const std::pair<Key,Value>& a, const std::pair<Key,Value>& b) { return a.first < b.first; });
+                size_t unique = 0;
+                for (size_t i = 0; i < batch.size(); i++) {
+                    if (unique > 0 && batch[unique - 1].first == batch[i].first) {
+                        batch[unique - 1] = batch[i];
+                    } else {
+                        batch[unique++] = batch[i];
+                    }
+                }
+                size_t done = 0;
+                while (done < unique) {
+                    done += insertSegment(batch.data() + done, unique - done);
+                }
+            }
+
+            /**
+             * Appends the longest prefix of the n sorted pairs that belongs
+             * to the leaf of the first key and fits into it, in one
+             * transaction. Splits a full leaf first, like insert
+             * @return number of pairs inserted
+             */
+            size_t insertSegment(const std::pair<Key,Value>* pairs, size_t n) {
+                const Key k = pairs[0].first;
+                int restartCount = 0;
+                int restartReason = 156;
+        restart:
+                if(restartCount++ > MAX_TRANSACTION_RESTART) {
+                    timeline::countFallback();
+                    TRACE_EVENT(RtmFallback, root, restartReason);
+                    insertLatched(k, pairs[0].second);
+                    return 1;
+                }
+                if(restartCount > 1)
+                    timeline::countRestart();
+
+                if((restartReason = _xbegin()) != _XBEGIN_STARTED) {
+                    TRACE_EVENT(RtmAbort, root, restartReason);
+                    HEATMAP_ABORT(leafFor(k));
+                    goto restart;
+                }
 
                 // Current node
                 NodeBase* node = root;
-                uint64_t versionNode = node->readLockOrRestart(needRestart);
-                if (needRestart || (node!=root)) goto restart;
 
                 // Parent of current node
                 BTreeInner<Key>* parent = nullptr;
-                uint64_t versionParent;
+
+                // The leaf holds keys up to upper
+                bool hasUpper = false;
+                Key upper = Key();
+
+                while (node->type==PageType::BTreeInner) {
+                    auto inner = static_cast<BTreeInner<Key>*>(node);
+                    if(node->isLocked(node->typeVersionLockObsolete.load()) ) {
+                        _xabort(1);
+                    }
+
+                    //Touch parent lock data to ensure atomicity
+                    if(parent) {
+                        if(parent->isLocked(parent->typeVersionLockObsolete.load()) ) {
+                            _xabort(1);
+                        }
+                    }
+
+                    // Split eagerly if full
+                    if (inner->isFull()) {
+                        Key sep; BTreeInner<Key>* newInner = inner->split(sep);
+                        TRACE_EVENT(SplitInner, inner, inner->count);
+                        if (parent) {
+                            parent->insert(sep,newInner);
+                            parent->updateVersionTSX();
+                        } else {
+                            makeRoot(sep,inner,newInner);
+                        }
+                        inner->updateVersionTSX();
+                        _xend();
+                        goto restart;
+                    }
+
+                    parent = inner;
+
+                    unsigned pos = inner->lowerBound(k);
+                    if (pos < inner->count) {
+                        hasUpper = true;
+                        upper = inner->keys[pos];
+                    }
+                    node = inner->children[pos];
+                    if(weaved) {
+                        _xend();
+                        if(_xbegin() != _XBEGIN_STARTED)
+                            goto restart;
+
+                        if(node != inner->children[inner->lowerBound(k)])
+                            goto restart;
+                    }
+                }
+
+                //Touch parent lock data to ensure atomicity
+                if(parent) {
+                    if(parent->isLocked(parent->typeVersionLockObsolete.load())) {
+                        _xabort(4);
+                    }
+                }
+
+                auto leaf = static_cast<BTreeLeaf<Key,Value>*>(node);
+                if(leaf->isLocked(leaf->typeVersionLockObsolete.load()))  {
+                    _xabort(3);
+                }
+
+                // Split leaf if full
+                if (leaf->count>=leaf->maxEntries) {
+                    Key sep; BTreeLeaf<Key,Value>* newLeaf = leaf->split(sep);
+                    TRACE_EVENT(SplitLeaf, leaf, leaf->count);
+                    if (parent) {
+                        parent->insert(sep, newLeaf);
+                        parent->updateVersionTSX();
+                    } else {
+                        makeRoot(sep, leaf, newLeaf);
+                    }
+                    leaf->updateVersionTSX();
+                    _xend();
+                    goto restart;
+                }
+
+                size_t inserted = 0;
+                while (inserted < n && leaf->count < leaf->maxEntries &&
+                       (!hasUpper || !(upper < pairs[inserted].first))) {
+                    leaf->insert(pairs[inserted].first, pairs[inserted].second);
+                    inserted++;
+                }
+                leaf->updateVersionTSX();
+                _xend();
+                return inserted;
+            }
+
+            void insertLatched(Key k, Value v) {
+                descendLatched(k, &v, 1);
+            }
+
+            /**
+             * Splits nodes on the way to the leaf of k until that leaf has
+             * room for needed more entries
+             */
+            void makeRoom(Key k, unsigned needed) {
+                descendLatched(k, nullptr, needed);
+            }
+
+            /**
+             * Latched descent that splits full inner nodes and a leaf without
+             * room for needed entries, then inserts v if it is given
+             */
+            void descendLatched(Key k, const Value* v, unsigned needed) {
+                descent::AncestorStack<NodeBase> path;
+restart:
+                bool needRestart = false;
+
+                // Current node, the deepest ancestor that is still valid or the root
+                NodeBase* node;
+                uint64_t versionNode;
+                if (path.trim(root)) {
+                    auto resume = path.pop();
+                    node = resume.node;
+                    versionNode = resume.version;
+                } else {
+                    node = root;
+                    versionNode = node->readLockOrRestart(needRestart);
+                    if (needRestart || (node!=root)) goto restart;
+                }
+
+                // Parent of current node, always the top of path
+                BTreeInner<Key>* parent = path.empty() ? nullptr : static_cast<BTreeInner<Key>*>(path.top().node);
+                uint64_t versionParent = path.empty() ? 0 : path.top().version;
 
                 while (node->type==PageType::BTreeInner) {
                     auto inner = static_cast<BTreeInner<Key>*>(node);
@@ -442,14 +788,17 @@ restart:
                         }
                         // Split
                         Key sep; BTreeInner<Key>* newInner = inner->split(sep);
+                        TRACE_EVENT(SplitInner, inner, inner->count);
                         if (parent)
                             parent->insert(sep,newInner);
                         else
                             makeRoot(sep,inner,newInner);
-                        // Unlock and restart
+                        // Unlock and continue from the parent, at the version the unlock leaves
                         node->writeUnlock();
-                        if (parent)
+                        if (parent) {
                             parent->writeUnlock();
+                            path.top().version = versionParent + 0b10;
+                        }
                         goto restart;
                     }
 
@@ -460,6 +809,7 @@ restart:
 
                     parent = inner;
                     versionParent = versionNode;
+                    path.push(inner, versionNode);
 
                     node = inner->children[inner->lowerBound(k)];
                     inner->checkOrRestart(versionNode, needRestart);
@@ -471,7 +821,7 @@ restart:
                 auto leaf = static_cast<BTreeLeaf<Key,Value>*>(node);
 
                 // Split leaf if full
-                if (leaf->count>=leaf->maxEntries) {
+                if (leaf->count+needed>leaf->maxEntries) {
                     // Lock
                     if (parent) {
                         parent->upgradeToWriteLockOrRestart(versionParent, needRestart);
@@ -488,16 +838,19 @@ restart:
                     }
                     // Split
                     Key sep; BTreeLeaf<Key,Value>* newLeaf = leaf->split(sep);
+                    TRACE_EVENT(SplitLeaf, leaf, leaf->count);
                     if (parent)
                         parent->insert(sep, newLeaf);
                     else
                         makeRoot(sep, leaf, newLeaf);
-                    // Unlock and restart
+                    // Unlock and continue from the parent, at the version the unlock leaves
                     node->writeUnlock();
-                    if (parent)
+                    if (parent) {
                         parent->writeUnlock();
+                        path.top().version = versionParent + 0b10;
+                    }
                     goto restart;
-                } else {
+                } else if (v) {
                     // only lock leaf node
                     node->upgradeToWriteLockOrRestart(versionNode, needRestart);
                     if (needRestart) goto restart;
@@ -508,7 +861,7 @@ restart:
                             goto restart;
                         }
                     }
-                    leaf->insert(k, v);
+                    leaf->insert(k, *v);
                     node->writeUnlock();
                     return; // success
                 }
@@ -518,10 +871,17 @@ restart:
                 int restartCount = 0;
 restart:
                 if(restartCount++ > MAX_TRANSACTION_RESTART) {
+                    timeline::countFallback();
+                    TRACE_EVENT(RtmFallback, root, 0);
                     return lookupLatched(k, result);
                 }
+                if(restartCount > 1)
+                    timeline::countRestart();
 
-                if(_xbegin() != _XBEGIN_STARTED) {
+                unsigned status;
+                if((status = _xbegin()) != _XBEGIN_STARTED) {
+                    TRACE_EVENT(RtmAbort, root, status);
+                    HEATMAP_ABORT(leafFor(k));
                     goto restart;
                 }
                 NodeBase* node = root;
@@ -567,15 +927,26 @@ restart:
 
 
             bool lookupLatched(Key k, Value& result) {
+                descent::AncestorStack<NodeBase> path;
 restart:
-                NodeBase* node = root;
                 bool needRestart = false;
-                uint64_t versionNode = node->readLockOrRestart(needRestart);
-                if (needRestart || (node!=root)) goto restart;
 
-                // Parent of current node
-                BTreeInner<Key>* parent = nullptr;
-                uint64_t versionParent;
+                // Current node, the deepest ancestor that is still valid or the root
+                NodeBase* node;
+                uint64_t versionNode;
+                if (path.trim(root)) {
+                    auto resume = path.pop();
+                    node = resume.node;
+                    versionNode = resume.version;
+                } else {
+                    node = root;
+                    versionNode = node->readLockOrRestart(needRestart);
+                    if (needRestart || (node!=root)) goto restart;
+                }
+
+                // Parent of current node, always the top of path
+                BTreeInner<Key>* parent = path.empty() ? nullptr : static_cast<BTreeInner<Key>*>(path.top().node);
+                uint64_t versionParent = path.empty() ? 0 : path.top().version;
 
                 while (node->type==PageType::BTreeInner) {
                     auto inner = static_cast<BTreeInner<Key>*>(node);
@@ -587,6 +958,7 @@ restart:
 
                     parent = inner;
                     versionParent = versionNode;
+                    path.push(inner, versionNode);
 
                     node = inner->children[inner->lowerBound(k)];
                     inner->checkOrRestart(versionNode, needRestart);
@@ -629,6 +1001,307 @@ restart:
                 return success;
             }
 
+            void yield(int count) {
+                if (count>3)
+                    sched_yield();
+                else
+                    _mm_pause();
+            }
+
+            /**
+             * Runs up to maxTransactOps inserts and lookups atomically, in
+             * one RTM transaction if possible. Inserts overwrite the value of
+             * a key the leaf already has. After MAX_TRANSACTION_RESTART
+             * aborts, or when useRtm is off, it locks the leaves of all keys
+             * in key order instead
+             */
+            void transact(TxOp<Key,Value>* ops, int n) {
+                assert(n <= maxTransactOps);
+                unsigned inserts = 0;
+                for (int i = 0; i < n; i++) {
+                    inserts += ops[i].type == TxOpType::Insert;
+                }
+                if (useRtm) {
+                    for (int attempt = 0; attempt <= MAX_TRANSACTION_RESTART; attempt++) {
+                        if (attempt > 0)
+                            timeline::countRestart();
+                        unsigned status = _xbegin();
+                        if (status == _XBEGIN_STARTED) {
+                            for (int i = 0; i < n; i++) {
+                                auto leaf = leafInTransaction(ops[i].key);
+                                if (ops[i].type == TxOpType::Insert) {
+                                    if (!leaf->upsert(ops[i].key, ops[i].value)) {
+                                        _xabort(abortNeedsSplit);
+                                    }
+                                    leaf->updateVersionTSX();
+                                } else {
+                                    bool sorted = leaf->isSorted;
+                                    ops[i].found = leaf->find(ops[i].key, ops[i].value);
+                                    if (!sorted) {
+                                        leaf->updateVersionTSX();
+                                    }
+                                }
+                            }
+                            _xend();
+                            return;
+                        }
+                        TRACE_EVENT(RtmAbort, root, status);
+                        if ((status & _XABORT_EXPLICIT) && _XABORT_CODE(status) == abortNeedsSplit) {
+                            for (int i = 0; i < n; i++) {
+                                if (ops[i].type == TxOpType::Insert) {
+                                    makeRoom(ops[i].key, inserts);
+                                }
+                            }
+                        }
+                    }
+                    timeline::countFallback();
+                    TRACE_EVENT(RtmFallback, root, 0);
+                }
+                transactLatched(ops, n, inserts);
+            }
+
+            /**
+             * Inserts k unless it is already present
+             * @return false if k was present, its value is then in existing
+             */
+            bool insertIfAbsent(Key k, Value v, Value& existing) {
+                return writeLeaf(k, true, [&](BTreeLeaf<Key,Value>* leaf) {
+                    if (Value* current = leaf->payloadFor(k)) {
+                        existing = *current;
+                        return false;
+                    }
+                    leaf->insert(k, v);
+                    return true;
+                });
+            }
+
+            /**
+             * Overwrites the value of k
+             * @return false if k is absent
+             */
+            bool update(Key k, Value v) {
+                return writeLeaf(k, false, [&](BTreeLeaf<Key,Value>* leaf) {
+                    Value* current = leaf->payloadFor(k);
+                    if (current) {
+                        *current = v;
+                    }
+                    return current != nullptr;
+                });
+            }
+
+            /**
+             * Sets the value of k to desired if it is expected
+             * @return false if k is absent or holds another value
+             */
+            bool compareAndSwap(Key k, Value expected, Value desired) {
+                return writeLeaf(k, false, [&](BTreeLeaf<Key,Value>* leaf) {
+                    Value* current = leaf->payloadFor(k);
+                    if (!current || !(*current == expected)) {
+                        return false;
+                    }
+                    *current = desired;
+                    return true;
+                });
+            }
+
+            /**
+             * Replaces the value of k with fn(value). fn runs inside the
+             * transaction, so it must not make system calls
+             * @return false if k is absent, otherwise the old value is in previous
+             */
+            template<class Fn>
+            bool fetchAndApply(Key k, Fn fn, Value& previous) {
+                return writeLeaf(k, false, [&](BTreeLeaf<Key,Value>* leaf) {
+                    Value* current = leaf->payloadFor(k);
+                    if (!current) {
+                        return false;
+                    }
+                    previous = *current;
+                    *current = fn(previous);
+                    return true;
+                });
+            }
+
+            /**
+             * Runs apply on the leaf of k in one transaction, or under the
+             * leaf's write lock after MAX_TRANSACTION_RESTART aborts or with
+             * useRtm off. If mayGrow, the leaf has room for one more entry
+             * @return what apply returned
+             */
+            template<class Apply>
+            bool writeLeaf(Key k, bool mayGrow, Apply apply) {
+                if (useRtm) {
+                    for (int attempt = 0; attempt <= MAX_TRANSACTION_RESTART; attempt++) {
+                        if (attempt > 0)
+                            timeline::countRestart();
+                        unsigned status = _xbegin();
+                        if (status == _XBEGIN_STARTED) {
+                            auto leaf = leafInTransaction(k);
+                            if (mayGrow && leaf->count >= leaf->maxEntries) {
+                                _xabort(abortNeedsSplit);
+                            }
+                            bool result = apply(leaf);
+                            leaf->updateVersionTSX();
+                            _xend();
+                            return result;
+                        }
+                        TRACE_EVENT(RtmAbort, root, status);
+                        if ((status & _XABORT_EXPLICIT) && _XABORT_CODE(status) == abortNeedsSplit) {
+                            makeRoom(k, 1);
+                        }
+                    }
+                    timeline::countFallback();
+                    TRACE_EVENT(RtmFallback, root, 0);
+                }
+                while (true) {
+                    if (mayGrow) {
+                        makeRoom(k, 1);
+                    }
+                    bool hasUpper;
+                    Key upper;
+                    auto leaf = lockLeaf(k, hasUpper, upper);
+                    if (mayGrow && leaf->count >= leaf->maxEntries) {
+                        // Filled up since makeRoom
+                        leaf->writeUnlock();
+                        continue;
+                    }
+                    bool result = apply(leaf);
+                    leaf->writeUnlock();
+                    return result;
+                }
+            }
+
+            /**
+             * Descends to the leaf of k inside a transaction, aborting on
+             * any lock held on the way
+             */
+            BTreeLeaf<Key,Value>* leafInTransaction(Key k) {
+                NodeBase* node = root;
+                while (node->type==PageType::BTreeInner) {
+                    if (node->isLocked(node->typeVersionLockObsolete.load())) {
+                        _xabort(1);
+                    }
+                    auto inner = static_cast<BTreeInner<Key>*>(node);
+                    node = inner->children[inner->lowerBound(k)];
+                }
+                if (node->isLocked(node->typeVersionLockObsolete.load())) {
+                    _xabort(3);
+                }
+                return static_cast<BTreeLeaf<Key,Value>*>(node);
+            }
+
+            /**
+             * Fallback of transact. Leaves are write locked in key order, so
+             * two fallbacks never wait for each other in a cycle, and every
+             * other writer only ever tries locks without waiting
+             */
+            void transactLatched(TxOp<Key,Value>* ops, int n, unsigned inserts) {
+                int order[maxTransactOps];
+                for (int i = 0; i < n; i++) {
+                    order[i] = i;
+                }
+                std::stable_sort(order, order + n, [&](int a, int b) { return ops[a].key < ops[b].key; });
+
+                BTreeLeaf<Key,Value>* leafOf[maxTransactOps];
+                BTreeLeaf<Key,Value>* locked[maxTransactOps];
+                while (true) {
+                    for (int i = 0; i < n; i++) {
+                        if (ops[i].type == TxOpType::Insert) {
+                            makeRoom(ops[i].key, inserts);
+                        }
+                    }
+                    int numLocked = 0;
+                    bool hasUpper = false;
+                    Key upper = Key();
+                    bool full = false;
+                    for (int j = 0; j < n && !full; j++) {
+                        Key k = ops[order[j]].key;
+                        // Keys come in order, so only the last locked leaf can hold k as well
+                        if (numLocked > 0 && (!hasUpper || !(upper < k))) {
+                            leafOf[order[j]] = locked[numLocked - 1];
+                            continue;
+                        }
+                        auto leaf = lockLeaf(k, hasUpper, upper);
+                        locked[numLocked++] = leaf;
+                        leafOf[order[j]] = leaf;
+                        full = leaf->count + inserts > leaf->maxEntries;
+                    }
+                    if (full) {
+                        // Filled up since makeRoom, unlock and split again
+                        for (int i = 0; i < numLocked; i++) {
+                            locked[i]->writeUnlock();
+                        }
+                        continue;
+                    }
+                    for (int i = 0; i < n; i++) {
+                        if (ops[i].type == TxOpType::Insert) {
+                            leafOf[i]->upsert(ops[i].key, ops[i].value);
+                        } else {
+                            ops[i].found = leafOf[i]->find(ops[i].key, ops[i].value);
+                        }
+                    }
+                    for (int i = 0; i < numLocked; i++) {
+                        locked[i]->writeUnlock();
+                    }
+                    return;
+                }
+            }
+
+            /**
+             * Write locks the leaf of k, waiting while another thread holds
+             * it. Sets upper to the leaf's upper separator if it has one
+             */
+            BTreeLeaf<Key,Value>* lockLeaf(Key k, bool& hasUpper, Key& upper) {
+                int restartCount = 0;
+restart:
+                if (restartCount++)
+                    yield(restartCount);
+                bool needRestart = false;
+                hasUpper = false;
+
+                NodeBase* node = root;
+                uint64_t versionNode = node->readLockOrRestart(needRestart);
+                if (needRestart || (node!=root)) goto restart;
+
+                // Parent of current node
+                BTreeInner<Key>* parent = nullptr;
+                uint64_t versionParent;
+
+                while (node->type==PageType::BTreeInner) {
+                    auto inner = static_cast<BTreeInner<Key>*>(node);
+
+                    if (parent) {
+                        parent->readUnlockOrRestart(versionParent, needRestart);
+                        if (needRestart) goto restart;
+                    }
+
+                    parent = inner;
+                    versionParent = versionNode;
+
+                    unsigned pos = inner->lowerBound(k);
+                    if (pos < inner->count) {
+                        hasUpper = true;
+                        upper = inner->keys[pos];
+                    }
+                    node = inner->children[pos];
+                    inner->checkOrRestart(versionNode, needRestart);
+                    if (needRestart) goto restart;
+                    versionNode = node->readLockOrRestart(needRestart);
+                    if (needRestart) goto restart;
+                }
+
+                node->upgradeToWriteLockOrRestart(versionNode, needRestart);
+                if (needRestart) goto restart;
+                if (parent) {
+                    parent->readUnlockOrRestart(versionParent, needRestart);
+                    if (needRestart) {
+                        node->writeUnlock();
+                        goto restart;
+                    }
+                }
+                return static_cast<BTreeLeaf<Key,Value>*>(node);
+            }
+
         };
 
 }
@@ -12,6 +12,10 @@
 #include <sched.h>
 #include <iostream>
 
+#include "TreeStats.h"
+#include "TreeVerifier.h"
+#include "Teardown.h"
+
 namespace btreesinglethread {
 
     enum class PageType : uint8_t { BTreeInner=1, BTreeLeaf=2 };
@@ -175,13 +179,39 @@ namespace btreesinglethread {
     template<class Key,class Value>
         struct BTree {
            NodeBase* root;
+           teardown::Reclaimer reclaimer;
 
             BTree() {
                 root = new BTreeLeaf<Key,Value>();
             }
 
+            ~BTree() {
+                reclaimer.wait();
+                freeNodes(root);
+            }
+
+            void freeNodes(NodeBase* node, int numThreads = parallel::defaultThreads()) {
+                teardown::freeTree<BTreeInner<Key>, BTreeLeaf<Key,Value>>(node, numThreads);
+            }
+
+            /**
+             * Frees the old tree on all cores. No operation may be running
+             */
             void clear() {
+                NodeBase* old = root;
+                root = new BTreeLeaf<Key,Value>();
+                freeNodes(old);
+            }
+
+            /**
+             * Swaps in an empty tree right away and frees the old one on a
+             * background thread. Operations started before the swap must have
+             * finished
+             */
+            void clearAsync() {
+                NodeBase* old = root;
                 root = new BTreeLeaf<Key,Value>();
+                reclaimer.run([this, old]() { freeNodes(old, 1); });
             }
 
             bool checkTree() {
@@ -213,6 +243,22 @@ namespace btreesinglethread {
                 }
             }
 
+            /**
+             * Checks ordering, separator and fanout invariants in parallel,
+             * see TreeVerifier.h. Needs a tree without concurrent writers
+             */
+            treeverify::VerifyResult verify(int numThreads = parallel::defaultThreads()) {
+                return treeverify::verify<Key, BTreeInner<Key>, BTreeLeaf<Key,Value>>(root, numThreads);
+            }
+
+            /**
+             * Node counts per level, fill histograms and memory use, see
+             * TreeStats.h. Only exact while no writer is running
+             */
+            treestats::TreeStats stats(int numThreads = parallel::defaultThreads()) {
+                return treestats::collect<BTreeInner<Key>, BTreeLeaf<Key,Value>>(root, numThreads);
+            }
+
             void makeRoot(Key k,NodeBase* leftChild,NodeBase* rightChild) {
                 auto inner = new BTreeInner<Key>();
                 inner->count = 1;
@@ -284,7 +330,7 @@ restart:
 
                 BTreeLeaf<Key,Value>* leaf = static_cast<BTreeLeaf<Key,Value>*>(node);
                 unsigned pos = leaf->lowerBound(k);
-                bool success;
+                bool success = false;
                 if ((pos<leaf->count) && (leaf->keys[pos]==k)) {
                     success = true;
                     result = leaf->payloads[pos];
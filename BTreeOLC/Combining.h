@@ -0,0 +1,125 @@
+#pragma once
+
+/*
+ * Flat combining for hot leaves. A thread that finds a hot leaf write locked
+ * publishes its insert in a slot of the leaf's bucket instead of restarting;
+ * the thread holding the lock applies all requests for its lock session
+ * before it unlocks. Buckets are found by hashing the leaf address, so
+ * leaves need no extra fields.
+ */
+
+#include <atomic>
+#include <cstdint>
+#include <immintrin.h>
+
+namespace combining {
+
+    enum class RequestState : int { Pending, Done, Retry };
+
+    /**
+     * An insert waiting for the holder of leaf's lock. version is the
+     * locked version the requester saw, a request is only valid for the lock
+     * session with exactly that version. Lives on the requester's stack
+     */
+    template<class Key, class Value>
+    struct Request {
+        Key key;
+        Value value;
+        const void* leaf;
+        uint64_t version;
+        std::atomic<RequestState> state{RequestState::Pending};
+    };
+
+    static const int slotsPerBucket = 8;
+
+    template<class Key, class Value>
+    struct alignas(64) Bucket {
+        std::atomic<uint32_t> heat{0}; // lock conflicts seen, halved when the combiner finds nothing
+        std::atomic<Request<Key, Value>*> slots[slotsPerBucket] = {};
+    };
+
+    template<class Key, class Value>
+    struct Table {
+        typedef Request<Key, Value> Req;
+
+        static const size_t numBuckets = 256;
+        static const uint32_t hotThreshold = 16;
+
+        Bucket<Key, Value> buckets[numBuckets];
+
+        Bucket<Key, Value>& bucketFor(const void* leaf) {
+            uint64_t h = reinterpret_cast<uintptr_t>(leaf) * 0x9E3779B97F4A7C15ULL;
+            return buckets[h >> 56];
+        }
+
+        bool isHot(const void* leaf) {
+            return bucketFor(leaf).heat.load(std::memory_order_relaxed) >= hotThreshold;
+        }
+
+        /**
+         * Counts a lock conflict on leaf and, if the leaf is hot, publishes
+         * req and waits for the lock holder. versionNow reads the leaf's
+         * version; once it moves on from req.version without the request
+         * being claimed, the request is withdrawn
+         * @return true if the holder applied the insert
+         */
+        template<class VersionFn>
+        bool publishAndWait(Req& req, VersionFn versionNow) {
+            Bucket<Key, Value>& bucket = bucketFor(req.leaf);
+            if (bucket.heat.fetch_add(1, std::memory_order_relaxed) + 1 < hotThreshold) {
+                return false;
+            }
+            int slot = -1;
+            for (int i = 0; i < slotsPerBucket && slot < 0; i++) {
+                Req* expected = nullptr;
+                if (bucket.slots[i].compare_exchange_strong(expected, &req)) {
+                    slot = i;
+                }
+            }
+            if (slot < 0) {
+                return false;
+            }
+            while (req.state.load(std::memory_order_acquire) == RequestState::Pending) {
+                if (versionNow() != req.version) {
+                    Req* expected = &req;
+                    if (bucket.slots[slot].compare_exchange_strong(expected, nullptr)) {
+                        return false; // withdrawn before anyone claimed it
+                    }
+                }
+                _mm_pause();
+            }
+            return req.state.load(std::memory_order_acquire) == RequestState::Done;
+        }
+
+        /**
+         * Claims the requests for leaf's current lock session, called by the
+         * lock holder. A request is only read once it is taken out of its
+         * slot: before that its requester may withdraw it and reuse the
+         * stack slot. Requests from older sessions or for other leaves of
+         * the bucket are sent back to retry
+         * @return number of requests written to claimed
+         */
+        unsigned claim(const void* leaf, uint64_t version, Req** claimed) {
+            Bucket<Key, Value>& bucket = bucketFor(leaf);
+            if (bucket.heat.load(std::memory_order_relaxed) < hotThreshold) {
+                return 0;
+            }
+            unsigned count = 0;
+            for (int i = 0; i < slotsPerBucket; i++) {
+                Req* req = bucket.slots[i].load();
+                if (!req || !bucket.slots[i].compare_exchange_strong(req, nullptr)) {
+                    continue;
+                }
+                if (req->leaf == leaf && req->version == version) {
+                    claimed[count++] = req;
+                } else {
+                    req->state.store(RequestState::Retry, std::memory_order_release);
+                }
+            }
+            if (count == 0) {
+                bucket.heat.store(bucket.heat.load(std::memory_order_relaxed) / 2, std::memory_order_relaxed);
+            }
+            return count;
+        }
+    };
+}
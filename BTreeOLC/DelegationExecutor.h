@@ -0,0 +1,345 @@
+#pragma once
+
+/*
+ * Delegation mode for write-heavy, contended workloads. Each worker thread
+ * owns a key range and a private btreesinglethread tree, so no leaf is ever
+ * shared between cores. Clients do not touch the trees: they stage requests
+ * per worker, send them in batches over a single-producer single-consumer
+ * ring per (client, worker) pair and collect completions over a ring going
+ * the other way.
+ *
+ * A worker only takes as many requests from a client as fit into that
+ * client's completion ring, and a client waiting for room in a request ring
+ * keeps collecting completions, so neither side can block the other.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "BTree_single_threaded.h"
+#include "Parallel.h"
+#include "ShardedBTree.h"
+#include "TreeStats.h"
+
+namespace delegation {
+
+    /**
+     * Bounded ring for exactly one producer and one consumer thread. Each
+     * side caches the other's index and only reloads it when the ring looks
+     * full or empty
+     */
+    template<class T, size_t capacity>
+    struct SpscRing {
+        static_assert((capacity & (capacity - 1)) == 0, "capacity must be a power of two");
+
+        alignas(64) std::atomic<uint64_t> head{0}; // next slot to pop
+        uint64_t cachedTail = 0;                    // consumer's view of tail
+        alignas(64) std::atomic<uint64_t> tail{0}; // next slot to push
+        uint64_t cachedHead = 0;                    // producer's view of head
+        alignas(64) T items[capacity];
+
+        /**
+         * Producer side
+         */
+        size_t freeSlots() {
+            uint64_t t = tail.load(std::memory_order_relaxed);
+            if (t - cachedHead == capacity) {
+                cachedHead = head.load(std::memory_order_acquire);
+            }
+            return capacity - (t - cachedHead);
+        }
+
+        /**
+         * Producer side, pushes as many of the n items as fit
+         * @return number of items pushed
+         */
+        size_t push(const T* in, size_t n) {
+            uint64_t t = tail.load(std::memory_order_relaxed);
+            if (capacity - (t - cachedHead) < n) {
+                cachedHead = head.load(std::memory_order_acquire);
+            }
+            size_t count = std::min(n, (size_t)(capacity - (t - cachedHead)));
+            for (size_t i = 0; i < count; i++) {
+                items[(t + i) & (capacity - 1)] = in[i];
+            }
+            tail.store(t + count, std::memory_order_release);
+            return count;
+        }
+
+        /**
+         * Consumer side, pops up to n items
+         * @return number of items popped
+         */
+        size_t pop(T* out, size_t n) {
+            uint64_t h = head.load(std::memory_order_relaxed);
+            if (cachedTail - h < n) {
+                cachedTail = tail.load(std::memory_order_acquire);
+            }
+            size_t count = std::min(n, (size_t)(cachedTail - h));
+            for (size_t i = 0; i < count; i++) {
+                out[i] = items[(h + i) & (capacity - 1)];
+            }
+            head.store(h + count, std::memory_order_release);
+            return count;
+        }
+    };
+
+    enum class OpType : uint8_t { Insert, Lookup };
+
+    template<class Key, class Value>
+    struct Request {
+        Key key;
+        Value value;
+        uint64_t tag; // chosen by the client, returned with the completion
+        OpType type;
+    };
+
+    template<class Key, class Value>
+    struct Completion {
+        uint64_t tag;
+        Value value; // the value found by a lookup
+        bool found;  // always true for inserts
+    };
+
+    static const size_t ringCapacity = 256;
+    static const size_t batchSize = 32;
+
+    template<class Key, class Value>
+    struct Executor;
+
+    /**
+     * One client's end of the rings. Must only be used by one thread at a
+     * time. Completions pile up in completed until the caller takes them
+     */
+    template<class Key, class Value>
+    struct Client {
+        typedef Request<Key, Value> Req;
+        typedef Completion<Key, Value> Done;
+
+        Executor<Key, Value>* executor;
+        unsigned id;
+        std::vector<std::vector<Req>> staged; // per worker
+        std::vector<Done> completed;
+        uint64_t outstanding = 0;
+
+        Client(Executor<Key, Value>* executor_, unsigned id_)
+            : executor(executor_), id(id_), staged(executor_->numWorkers()) {
+            for (auto& batch : staged) {
+                batch.reserve(batchSize);
+            }
+        }
+
+        void insert(Key k, Value v, uint64_t tag = 0) {
+            submit(Req{k, v, tag, OpType::Insert});
+        }
+
+        void lookup(Key k, uint64_t tag = 0) {
+            submit(Req{k, Value(), tag, OpType::Lookup});
+        }
+
+        /**
+         * Looks up k and waits for the answer, along with everything
+         * submitted before
+         */
+        bool lookupNow(Key k, Value& result) {
+            size_t mark = completed.size();
+            lookup(k, ~0ULL);
+            wait();
+            for (size_t i = completed.size(); i > mark; i--) {
+                if (completed[i - 1].tag == ~0ULL) {
+                    result = completed[i - 1].value;
+                    bool found = completed[i - 1].found;
+                    completed.erase(completed.begin() + (i - 1));
+                    return found;
+                }
+            }
+            return false;
+        }
+
+        void submit(const Req& req) {
+            unsigned worker = executor->ownerOf(req.key);
+            staged[worker].push_back(req);
+            if (staged[worker].size() == batchSize) {
+                send(worker);
+            }
+        }
+
+        /**
+         * Sends all staged requests
+         */
+        void flush() {
+            for (unsigned worker = 0; worker < staged.size(); worker++) {
+                send(worker);
+            }
+        }
+
+        /**
+         * Moves available completions to completed
+         * @return number of completions collected
+         */
+        size_t collect() {
+            size_t count = 0;
+            for (unsigned worker = 0; worker < staged.size(); worker++) {
+                auto& ring = executor->channel(worker, id).completions;
+                Done done[batchSize];
+                size_t got;
+                while ((got = ring.pop(done, batchSize)) > 0) {
+                    completed.insert(completed.end(), done, done + got);
+                    count += got;
+                }
+            }
+            outstanding -= count;
+            return count;
+        }
+
+        /**
+         * Sends all staged requests and waits until every request has
+         * completed
+         */
+        void wait() {
+            flush();
+            int idleRounds = 0;
+            while (outstanding > 0) {
+                if (collect() == 0) {
+                    parallel::backoff(idleRounds);
+                }
+            }
+        }
+
+    private:
+        void send(unsigned worker) {
+            std::vector<Req>& batch = staged[worker];
+            auto& ring = executor->channel(worker, id).requests;
+            size_t sent = 0;
+            int idleRounds = 0;
+            while (sent < batch.size()) {
+                size_t pushed = ring.push(batch.data() + sent, batch.size() - sent);
+                sent += pushed;
+                outstanding += pushed;
+                if (pushed == 0 && collect() == 0) {
+                    parallel::backoff(idleRounds);
+                }
+            }
+            batch.clear();
+        }
+    };
+
+    /**
+     * Starts numWorkers workers owning even slices of [minKey, maxKey] and
+     * the rings for numClients clients. Keys outside the range go to the
+     * first and last worker
+     */
+    template<class Key, class Value>
+    struct Executor {
+        typedef btreesinglethread::BTree<Key, Value> Tree;
+
+        struct Channel {
+            SpscRing<Request<Key, Value>, ringCapacity> requests;
+            SpscRing<Completion<Key, Value>, ringCapacity> completions;
+        };
+
+        sharded::Directory<Key> ranges;
+        std::vector<std::unique_ptr<Tree>> trees;
+        std::unique_ptr<Channel[]> channels; // worker-major
+        std::vector<std::unique_ptr<Client<Key, Value>>> clients;
+        std::vector<std::thread> workers;
+        std::atomic<bool> stopping{false};
+        int insertFallbackTimes = 0;
+        int lookupFallbackTimes = 0;
+
+        Executor(unsigned numWorkers, unsigned numClients, Key minKey, Key maxKey)
+            : channels(new Channel[numWorkers * numClients]) {
+            std::vector<Key> bounds;
+            for (unsigned i = 1; i < numWorkers; i++) {
+                bounds.push_back(parallel::evenBound(minKey, maxKey, i, numWorkers));
+            }
+            ranges.setBounds(bounds);
+            for (unsigned i = 0; i < numWorkers; i++) {
+                trees.emplace_back(new Tree());
+            }
+            for (unsigned i = 0; i < numClients; i++) {
+                clients.emplace_back(new Client<Key, Value>(this, i));
+            }
+            for (unsigned i = 0; i < numWorkers; i++) {
+                workers.push_back(std::thread([this, i]() { work(i); }));
+            }
+        }
+
+        ~Executor() {
+            stopping = true;
+            for (std::thread& worker : workers) {
+                worker.join();
+            }
+        }
+
+        unsigned numWorkers() const { return trees.size(); }
+
+        unsigned numClients() const { return clients.size(); }
+
+        unsigned ownerOf(Key k) const { return ranges.find(k); }
+
+        Channel& channel(unsigned worker, unsigned client) {
+            return channels[worker * clients.size() + client];
+        }
+
+        Client<Key, Value>& client(unsigned id) { return *clients[id]; }
+
+        /**
+         * Empties all trees. Every client must have waited for its requests
+         */
+        void clear() {
+            for (auto& tree : trees) {
+                tree->clear();
+            }
+        }
+
+        /**
+         * Merged stats of all workers' trees. Same conditions as clear
+         */
+        treestats::TreeStats stats(int numThreads = parallel::defaultThreads()) {
+            treestats::TreeStats result;
+            for (auto& tree : trees) {
+                result.merge(tree->stats(numThreads));
+            }
+            return result;
+        }
+
+    private:
+        void work(unsigned worker) {
+            Tree& tree = *trees[worker];
+            Request<Key, Value> batch[batchSize];
+            Completion<Key, Value> done[batchSize];
+            int idleRounds = 0;
+            while (!stopping.load(std::memory_order_relaxed)) {
+                bool busy = false;
+                for (unsigned c = 0; c < clients.size(); c++) {
+                    Channel& ch = channel(worker, c);
+                    size_t room = std::min(batchSize, ch.completions.freeSlots());
+                    size_t got = room ? ch.requests.pop(batch, room) : 0;
+                    for (size_t i = 0; i < got; i++) {
+                        done[i].tag = batch[i].tag;
+                        if (batch[i].type == OpType::Insert) {
+                            tree.insert(batch[i].key, batch[i].value);
+                            done[i].found = true;
+                        } else {
+                            done[i].found = tree.lookup(batch[i].key, done[i].value);
+                        }
+                    }
+                    if (got) {
+                        ch.completions.push(done, got);
+                        busy = true;
+                    }
+                }
+                if (busy) {
+                    idleRounds = 0;
+                } else {
+                    parallel::backoff(idleRounds);
+                }
+            }
+        }
+    };
+}
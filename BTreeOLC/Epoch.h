@@ -0,0 +1,121 @@
+#pragma once
+
+/*
+ * Grace periods for readers of shared, immutable objects. An operation runs
+ * inside a Guard, which announces the global epoch it started in. A writer
+ * that swaps out an object calls synchronize() afterwards; once it returns,
+ * no operation that could still see the old object is running.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace epoch {
+
+    struct alignas(64) Slot {
+        std::atomic<uint64_t> active{0}; // epoch the thread entered in, 0 while outside
+        unsigned depth = 0;              // nesting of guards, only used by the owner
+    };
+
+    /**
+     * slots holds the slots of live threads, the only ones synchronize()
+     * scans. A slot whose thread exited moves to freeSlots and is handed to
+     * the next thread that registers; slots are never deleted, so a
+     * synchronize() still scanning a released one reads it safely
+     */
+    struct Registry {
+        std::mutex lock;
+        std::vector<Slot*> slots;
+        std::vector<Slot*> freeSlots;
+        std::atomic<uint64_t> global{1};
+
+        Slot* registerThread() {
+            std::lock_guard<std::mutex> guard(lock);
+            Slot* slot;
+            if (!freeSlots.empty()) {
+                slot = freeSlots.back();
+                freeSlots.pop_back();
+            } else {
+                slot = new Slot();
+            }
+            slots.push_back(slot);
+            return slot;
+        }
+
+        void releaseThread(Slot* slot) {
+            std::lock_guard<std::mutex> guard(lock);
+            slots.erase(std::find(slots.begin(), slots.end(), slot));
+            freeSlots.push_back(slot);
+        }
+    };
+
+    /**
+     * Never destroyed, so threads exiting after static destruction can still
+     * release their slots
+     */
+    inline Registry& registry() {
+        static Registry* instance = new Registry();
+        return *instance;
+    }
+
+    /**
+     * Owns the calling thread's slot and releases it on thread exit, when the
+     * thread can no longer be inside a guard
+     */
+    struct ThreadSlot {
+        Slot* slot;
+
+        ThreadSlot() : slot(registry().registerThread()) {}
+        ~ThreadSlot() { registry().releaseThread(slot); }
+    };
+
+    inline Slot& localSlot() {
+        static thread_local ThreadSlot local;
+        return *local.slot;
+    }
+
+    inline void enter() {
+        Slot& slot = localSlot();
+        if (slot.depth++ == 0) {
+            slot.active.store(registry().global.load());
+        }
+    }
+
+    inline void exit() {
+        Slot& slot = localSlot();
+        if (--slot.depth == 0) {
+            slot.active.store(0);
+        }
+    }
+
+    struct Guard {
+        Guard() { enter(); }
+        ~Guard() { exit(); }
+        Guard(const Guard&) = delete;
+        Guard& operator=(const Guard&) = delete;
+    };
+
+    /**
+     * Waits until every thread that was inside a guard when this was called
+     * has left it. Must not be called from inside a guard
+     */
+    inline void synchronize() {
+        Registry& reg = registry();
+        uint64_t target = reg.global.fetch_add(1) + 1;
+        std::vector<Slot*> slots;
+        {
+            std::lock_guard<std::mutex> guard(reg.lock);
+            slots = reg.slots;
+        }
+        for (Slot* slot : slots) {
+            uint64_t seen;
+            while ((seen = slot->active.load()) != 0 && seen < target) {
+                std::this_thread::yield();
+            }
+        }
+    }
+}
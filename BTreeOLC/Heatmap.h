@@ -0,0 +1,164 @@
+#pragma once
+
+/*
+ * Per-node contention counts, recorded when compiling with -DBTREE_HEATMAP
+ * (make heatmap). Without it HEATMAP_RESTART and HEATMAP_ABORT expand to
+ * nothing and report() prints empty tables.
+ */
+
+#include <algorithm>
+#include <iostream>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace heatmap {
+
+    struct Counts {
+        uint64_t restarts = 0;
+        uint64_t aborts = 0;
+
+        uint64_t total() const { return restarts + aborts; }
+    };
+
+    typedef std::unordered_map<const void*, Counts> CountMap;
+
+    struct Registry {
+        std::mutex lock;
+        std::vector<CountMap*> maps;
+
+        CountMap* registerThread() {
+            std::lock_guard<std::mutex> guard(lock);
+            CountMap* map = new CountMap();
+            maps.push_back(map);
+            return map;
+        }
+    };
+
+    inline Registry& registry() {
+        static Registry instance;
+        return instance;
+    }
+
+    inline CountMap& localCounts() {
+        static thread_local CountMap* map = registry().registerThread();
+        return *map;
+    }
+
+    inline void recordRestart(const void* node) {
+        localCounts()[node].restarts++;
+    }
+
+    inline void recordAbort(const void* node) {
+        localCounts()[node].aborts++;
+    }
+
+    /**
+     * Sum of all threads' counts. Only call while no thread is recording
+     */
+    inline CountMap merged() {
+        Registry& reg = registry();
+        std::lock_guard<std::mutex> guard(reg.lock);
+        CountMap result;
+        for(CountMap* map : reg.maps) {
+            for(auto& entry : *map) {
+                result[entry.first].restarts += entry.second.restarts;
+                result[entry.first].aborts += entry.second.aborts;
+            }
+        }
+        return result;
+    }
+
+    inline void reset() {
+        Registry& reg = registry();
+        std::lock_guard<std::mutex> guard(reg.lock);
+        for(CountMap* map : reg.maps) {
+            map->clear();
+        }
+    }
+
+    template<class Key>
+    struct NodeHeat {
+        const void* node;
+        int level;   // 0 is the root
+        bool isLeaf;
+        uint16_t count;
+        bool hasLower, hasUpper;
+        Key lower, upper; // the node holds keys in (lower, upper]
+        Counts counts;
+    };
+
+    template<class Key, class Inner, class Leaf, class Node>
+    void collect(Node* node, int level, bool hasLower, Key lower, bool hasUpper, Key upper,
+                 const CountMap& counts, std::vector<NodeHeat<Key>>& out) {
+        auto found = counts.find(node);
+        bool isLeaf = node->type == Leaf::typeMarker;
+        if(found != counts.end()) {
+            out.push_back(NodeHeat<Key>{node, level, isLeaf, node->count, hasLower, hasUpper, lower, upper, found->second});
+        }
+        if(isLeaf) {
+            return;
+        }
+        auto inner = static_cast<Inner*>(node);
+        for(unsigned i = 0; i <= inner->count; i++) {
+            bool childHasLower = (i > 0) || hasLower;
+            Key childLower = (i > 0) ? inner->keys[i-1] : lower;
+            bool childHasUpper = (i < inner->count) || hasUpper;
+            Key childUpper = (i < inner->count) ? inner->keys[i] : upper;
+            collect<Key, Inner, Leaf>(inner->children[i], level + 1, childHasLower, childLower,
+                                 childHasUpper, childUpper, counts, out);
+        }
+    }
+
+    /**
+     * Prints restart and abort totals per tree level and the topN hottest
+     * nodes with their key ranges. Walks the tree without locks, so it has to
+     * run while no operation is in flight
+     */
+    template<class Key, class Inner, class Leaf, class Node>
+    void report(Node* root, int topN) {
+        CountMap counts = merged();
+        std::vector<NodeHeat<Key>> nodes;
+        collect<Key, Inner, Leaf>(root, 0, false, Key(), false, Key(), counts, nodes);
+
+        std::vector<Counts> levels;
+        for(const NodeHeat<Key>& n : nodes) {
+            if(levels.size() <= (size_t)n.level) {
+                levels.resize(n.level + 1);
+            }
+            levels[n.level].restarts += n.counts.restarts;
+            levels[n.level].aborts += n.counts.aborts;
+        }
+        std::cout << "Contention per level (0 is the root)" << std::endl;
+        for(size_t i = 0; i < levels.size(); i++) {
+            std::cout << "  level " << i << ": restarts " << levels[i].restarts
+                      << ", aborts " << levels[i].aborts << std::endl;
+        }
+
+        std::sort(nodes.begin(), nodes.end(), [](const NodeHeat<Key>& a, const NodeHeat<Key>& b) {
+            return a.counts.total() > b.counts.total();
+        });
+        std::cout << "Hottest nodes" << std::endl;
+        for(int i = 0; i < topN && i < (int)nodes.size(); i++) {
+            const NodeHeat<Key>& n = nodes[i];
+            std::cout << "  " << n.node << " level " << n.level << (n.isLeaf ? " leaf" : " inner")
+                      << " count " << n.count << " keys (";
+            if(n.hasLower) std::cout << n.lower; else std::cout << "-inf";
+            std::cout << ", ";
+            if(n.hasUpper) std::cout << n.upper; else std::cout << "+inf";
+            std::cout << "] restarts " << n.counts.restarts << ", aborts " << n.counts.aborts << std::endl;
+        }
+    }
+}
+
+#ifdef BTREE_HEATMAP
+
+#define HEATMAP_RESTART(node) heatmap::recordRestart(node)
+#define HEATMAP_ABORT(node) heatmap::recordAbort(node)
+
+#else
+
+#define HEATMAP_RESTART(node) ((void)0)
+#define HEATMAP_ABORT(node) ((void)0)
+
+#endif
@@ -0,0 +1,232 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <memory>
+#include <vector>
+#include <stdio.h>
+
+#include "Parallel.h"
+#include "WorkloadGenerator.h"
+#include "timing.h"
+
+namespace ingest {
+
+    /**
+     * On-disk format of an index dump: packed (key, value) pairs in
+     * arbitrary order
+     */
+    struct Record {
+        int64_t key;
+        int64_t value;
+    };
+
+    /**
+     * Read-only mapping of a whole file
+     */
+    struct MappedFile {
+        void* data = nullptr;
+        size_t size = 0;
+
+        bool open(const char* path) {
+            int fd = ::open(path, O_RDONLY);
+            if(fd < 0) {
+                return false;
+            }
+            struct stat st;
+            if(fstat(fd, &st) != 0) {
+                ::close(fd);
+                return false;
+            }
+            size = st.st_size;
+            if(size > 0) {
+                data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+            }
+            ::close(fd);
+            if(data == MAP_FAILED) {
+                data = nullptr;
+                return false;
+            }
+            if(data) {
+                madvise(data, size, MADV_SEQUENTIAL);
+            }
+            return true;
+        }
+
+        ~MappedFile() {
+            if(data) {
+                munmap(data, size);
+            }
+        }
+    };
+
+    struct IngestTimings {
+        double map = 0;
+        double sort = 0;
+        double dedupe = 0;
+        double build = 0;
+        size_t records = 0;
+        size_t keys = 0;
+
+        double total() const { return map + sort + dedupe + build; }
+
+        void print() const {
+            printf("Ingested %zu records, %zu unique keys in %.6fs: map %.6fs, sort %.6fs, dedupe %.6fs, build %.6fs \n",
+                records, keys, total(), map, sort, dedupe, build);
+        }
+    };
+
+    /**
+     * Stable parallel LSD radix sort on the key, 8 bits per pass. Passes
+     * where every key has the same digit are skipped. Reads from input, which
+     * may be read-only, and ping-pongs between buffers a and b
+     * @return the buffer holding the sorted records
+     */
+    inline Record* radixSort(const Record* input, Record* a, Record* b, size_t n, int numThreads) {
+        const int digits = 256;
+        numThreads = std::max(1, std::min<int>(numThreads, n / 4096 + 1));
+        std::vector<std::vector<size_t>> histograms(numThreads, std::vector<size_t>(digits));
+        const Record* from = input;
+        Record* to = a;
+        Record* spare = b;
+
+        for(int shift = 0; shift < 64; shift += 8) {
+            auto digitOf = [shift](const Record& r) {
+                return ((uint64_t)r.key ^ (1ULL << 63)) >> shift & 0xff;
+            };
+            parallel::parallelFor(numThreads, numThreads, [&](int threadId, size_t t) {
+                std::vector<size_t>& hist = histograms[t];
+                std::fill(hist.begin(), hist.end(), 0);
+                for(size_t i = t * n / numThreads; i < (t + 1) * n / numThreads; i++) {
+                    hist[digitOf(from[i])]++;
+                }
+            });
+
+            size_t offset = 0;
+            bool skip = false;
+            for(int d = 0; d < digits; d++) {
+                size_t inDigit = 0;
+                for(int t = 0; t < numThreads; t++) {
+                    size_t count = histograms[t][d];
+                    histograms[t][d] = offset;
+                    offset += count;
+                    inDigit += count;
+                }
+                skip = skip || inDigit == n;
+            }
+            if(skip) {
+                continue;
+            }
+
+            parallel::parallelFor(numThreads, numThreads, [&](int threadId, size_t t) {
+                std::vector<size_t>& positions = histograms[t];
+                for(size_t i = t * n / numThreads; i < (t + 1) * n / numThreads; i++) {
+                    to[positions[digitOf(from[i])]++] = from[i];
+                }
+            });
+            from = to;
+            std::swap(to, spare);
+        }
+
+        if(from == input) {
+            memcpy(a, input, sizeof(Record) * n);
+            return a;
+        }
+        return const_cast<Record*>(from);
+    }
+
+    /**
+     * Splits sorted records into key and value arrays, keeping only the last
+     * record of each key, in parallel
+     * @return number of unique keys
+     */
+    inline size_t dedupe(const Record* sorted, size_t n, int64_t* keys, int64_t* values, int numThreads) {
+        numThreads = std::max(1, std::min<int>(numThreads, n / 4096 + 1));
+        std::vector<size_t> kept(numThreads + 1, 0);
+        auto isLast = [&](size_t i) {
+            return i == n - 1 || sorted[i].key != sorted[i + 1].key;
+        };
+        parallel::parallelFor(numThreads, numThreads, [&](int threadId, size_t t) {
+            size_t count = 0;
+            for(size_t i = t * n / numThreads; i < (t + 1) * n / numThreads; i++) {
+                count += isLast(i);
+            }
+            kept[t + 1] = count;
+        });
+        for(int t = 0; t < numThreads; t++) {
+            kept[t + 1] += kept[t];
+        }
+        parallel::parallelFor(numThreads, numThreads, [&](int threadId, size_t t) {
+            size_t out = kept[t];
+            for(size_t i = t * n / numThreads; i < (t + 1) * n / numThreads; i++) {
+                if(isLast(i)) {
+                    keys[out] = sorted[i].key;
+                    values[out] = sorted[i].value;
+                    out++;
+                }
+            }
+        });
+        return kept[numThreads];
+    }
+
+    /**
+     * Rebuilds tree from an unsorted dump of Records: mmap, parallel radix
+     * sort, dedupe (later records win) and a parallel bottom-up bulkLoad.
+     * Replaces whatever the tree held. No other operation may be running
+     */
+    template<class Tree>
+    bool ingestFile(const char* path, Tree& tree, IngestTimings& timings,
+                    double leafFill = 1.0, int numThreads = parallel::defaultThreads()) {
+        Timer t;
+        MappedFile file;
+        if(!file.open(path) || file.size % sizeof(Record) != 0) {
+            return false;
+        }
+        size_t n = file.size / sizeof(Record);
+        timings.records = n;
+        timings.map = t.elapsed();
+
+        t.reset();
+        std::unique_ptr<Record[]> a(new Record[n]), b(new Record[n]);
+        Record* sorted = radixSort(static_cast<const Record*>(file.data), a.get(), b.get(), n, numThreads);
+        timings.sort = t.elapsed();
+
+        t.reset();
+        std::unique_ptr<int64_t[]> keys(new int64_t[n]), values(new int64_t[n]);
+        size_t unique = n ? dedupe(sorted, n, keys.get(), values.get(), numThreads) : 0;
+        timings.keys = unique;
+        timings.dedupe = t.elapsed();
+
+        t.reset();
+        tree.bulkLoad(keys.get(), values.get(), unique, leafFill, numThreads);
+        timings.build = t.elapsed();
+        return true;
+    }
+
+    /**
+     * Writes n records with the keys 0..n-1 in random order and random
+     * values, in the same format ingestFile reads
+     */
+    inline bool writeRandomDump(const char* path, size_t n, uint64_t seed = 418) {
+        FILE* file = fopen(path, "wb");
+        if(!file) {
+            return false;
+        }
+        workload::KeyPermutation permutation(n, workload::mix64(seed));
+        std::vector<Record> buffer;
+        buffer.reserve(1 << 16);
+        for(size_t i = 0; i < n; i++) {
+            int64_t key = permutation(i);
+            buffer.push_back(Record{key, (int64_t)(workload::mix64(key ^ seed) % (n * 100 + 1))});
+            if(buffer.size() == buffer.capacity() || i == n - 1) {
+                fwrite(buffer.data(), sizeof(Record), buffer.size(), file);
+                buffer.clear();
+            }
+        }
+        fclose(file);
+        return true;
+    }
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <immintrin.h>
+#include <thread>
+#include <vector>
+
+namespace parallel {
+
+    inline int defaultThreads() {
+        return std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    /**
+     * Spins for a while, then gives the core away. rounds counts the
+     * caller's unsuccessful attempts
+     */
+    inline void backoff(int& rounds) {
+        if (++rounds > 64) {
+            std::this_thread::yield();
+        } else {
+            _mm_pause();
+        }
+    }
+
+    /**
+     * Upper bound of slice i when [minKey, maxKey] is cut into n even
+     * slices of an arithmetic key type. Slice i holds the keys in
+     * (evenBound(i-1), evenBound(i)]
+     */
+    template<class Key>
+    Key evenBound(Key minKey, Key maxKey, size_t i, size_t n) {
+        long double span = (long double)maxKey - (long double)minKey + 1;
+        return (Key)((long double)minKey + std::floor(span * i / n) - 1);
+    }
+
+    /**
+     * Calls fn(threadId, i) for every i in [0, n) on up to numThreads
+     * threads. Indices are handed out one at a time from a shared counter,
+     * so uneven tasks balance themselves
+     */
+    template<class Fn>
+    void parallelFor(size_t n, int numThreads, Fn&& fn) {
+        numThreads = std::max(1, std::min<int>(numThreads, n));
+        std::atomic<size_t> next{0};
+        auto worker = [&](int threadId) {
+            for(size_t i = next++; i < n; i = next++) {
+                fn(threadId, i);
+            }
+        };
+        std::vector<std::thread> threads;
+        for(int i = 1; i < numThreads; i++) {
+            threads.push_back(std::thread(worker, i));
+        }
+        worker(0);
+        for(std::thread& t : threads) {
+            t.join();
+        }
+    }
+}
@@ -0,0 +1,423 @@
+#pragma once
+
+/*
+ * Range partitioned index over several independent trees, so that threads
+ * working on different key ranges never touch the same root. Keys are routed
+ * by an immutable directory of shard boundaries, which is replaced as a whole
+ * when boundaries move. Readers only load the directory pointer; Epoch.h
+ * tells when an old directory can be freed.
+ *
+ * Boundaries move online between neighbouring shards: writers of the keys
+ * being moved wait while they are copied, everyone else keeps going. The
+ * source shard drops its copies once the keys are routed to their new
+ * shard; until then results from a shard are clipped to its current range.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <immintrin.h>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "Epoch.h"
+#include "Parallel.h"
+#include "Teardown.h"
+#include "TreeStats.h"
+
+namespace sharded {
+
+    /**
+     * Number of the n bounds that are smaller than k. n is a multiple of 4,
+     * unused bounds hold the largest key
+     */
+    __attribute__((target("avx2")))
+    inline unsigned countLessAvx2(const int64_t* bounds, size_t n, int64_t k) {
+        __m256i key = _mm256_set1_epi64x(k);
+        unsigned count = 0;
+        for (size_t i = 0; i < n; i += 4) {
+            __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(bounds + i));
+            count += __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(key, b))));
+        }
+        return count;
+    }
+
+    inline bool hasAvx2() {
+        static const bool supported = __builtin_cpu_supports("avx2");
+        return supported;
+    }
+
+    /**
+     * Shard boundaries, never changed once published. Shard i holds the keys
+     * in (bounds[i-1], bounds[i]], the last shard everything above. Writers
+     * of keys in (frozenLow, frozenHigh] wait for the next directory
+     */
+    template<class Key>
+    struct Directory {
+        std::vector<Key> bounds; // numShards-1 used, padded to a multiple of 4
+        unsigned numBounds = 0;
+        bool hasFrozen = false;
+        Key frozenLow = Key();
+        Key frozenHigh = Key();
+
+        void setBounds(const std::vector<Key>& used) {
+            numBounds = used.size();
+            bounds = used;
+            bounds.resize((numBounds + 3) / 4 * 4, std::numeric_limits<Key>::max());
+        }
+
+        unsigned find(Key k) const {
+            if constexpr (std::is_same<Key, int64_t>::value) {
+                if (hasAvx2()) {
+                    return countLessAvx2(bounds.data(), bounds.size(), k);
+                }
+            }
+            return std::lower_bound(bounds.begin(), bounds.begin() + numBounds, k) - bounds.begin();
+        }
+
+        bool frozen(Key k) const {
+            return hasFrozen && frozenLow < k && !(frozenHigh < k);
+        }
+    };
+
+    template<class Index>
+    struct ShardedBTree {
+        typedef typename Index::KeyType Key;
+        typedef typename Index::ValueType Value;
+        typedef Directory<Key> Dir;
+
+        struct alignas(64) ShardCount {
+            std::atomic<int64_t> keys{0}; // sampled inserts, exact after a rebalance
+        };
+
+        std::vector<std::unique_ptr<Index>> shards;
+        std::unique_ptr<ShardCount[]> counts;
+        std::atomic<Dir*> directory;
+        int insertFallbackTimes = 0;
+        int lookupFallbackTimes = 0;
+
+        // Rebalance when a shard has skewFactor times the average and at least minRebalanceKeys
+        bool autoRebalance = true;
+        static constexpr double skewFactor = 2.0;
+        static const int64_t minRebalanceKeys = 1 << 16;
+        // Every countSample-th insert of a thread adds countSample to its shard
+        static const uint64_t countSample = 1024;
+
+        std::mutex rebalanceLock;
+        std::atomic<bool> rebalancing{false};
+        teardown::Reclaimer rebalancer;
+
+        /**
+         * numShards shards splitting [minKey, maxKey] evenly, keys outside
+         * go to the first and last shard
+         */
+        ShardedBTree(unsigned numShards = 16,
+                     Key minKey = std::numeric_limits<Key>::lowest(),
+                     Key maxKey = std::numeric_limits<Key>::max())
+            : counts(new ShardCount[numShards]) {
+            for (unsigned i = 0; i < numShards; i++) {
+                shards.emplace_back(new Index());
+            }
+            std::vector<Key> bounds;
+            for (unsigned i = 1; i < numShards; i++) {
+                bounds.push_back(parallel::evenBound(minKey, maxKey, i, numShards));
+            }
+            Dir* dir = new Dir();
+            dir->setBounds(bounds);
+            directory = dir;
+        }
+
+        ~ShardedBTree() {
+            rebalancer.wait();
+            delete directory.load();
+        }
+
+        unsigned numShards() const { return shards.size(); }
+
+        void insert(Key k, Value v) {
+            int restartCount = 0;
+            while (true) {
+                unsigned shard = 0;
+                {
+                    epoch::Guard guard;
+                    Dir* dir = directory.load();
+                    if (!dir->frozen(k)) {
+                        shard = dir->find(k);
+                        shards[shard]->insert(k, v);
+                        restartCount = -1;
+                    }
+                }
+                if (restartCount < 0) {
+                    countInsert(shard);
+                    return;
+                }
+                // Keys are being moved to another shard, wait outside the guard
+                if (restartCount++ > 16) {
+                    std::this_thread::yield();
+                } else {
+                    _mm_pause();
+                }
+            }
+        }
+
+        bool lookup(Key k, Value& result) {
+            epoch::Guard guard;
+            Dir* dir = directory.load();
+            return shards[dir->find(k)]->lookup(k, result);
+        }
+
+        /**
+         * Copies up to range entries with keys >= k in key order, crossing
+         * into the following shards as needed. Needs Index::scanEntries
+         * @return number of entries written
+         */
+        uint64_t scanEntries(Key k, int range, Key* keysOut, Value* valuesOut) {
+            epoch::Guard guard;
+            Dir* dir = directory.load();
+            int count = 0;
+            bool exclusive = false;
+            for (unsigned shard = dir->find(k); shard < shards.size() && count < range; shard++) {
+                int wanted = range - count;
+                int got = shards[shard]->scanEntries(k, wanted, keysOut + count, valuesOut + count, exclusive);
+                int kept = got;
+                if (shard < dir->numBounds) {
+                    // Keys still being moved to the next shard end this one
+                    kept = std::upper_bound(keysOut + count, keysOut + count + got, dir->bounds[shard]) - (keysOut + count);
+                    k = dir->bounds[shard];
+                    exclusive = true;
+                }
+                count += kept;
+            }
+            return count;
+        }
+
+        uint64_t scan(Key k, int range, Value* output) {
+            std::vector<Key> keys(range);
+            return scanEntries(k, range, keys.data(), output);
+        }
+
+        /**
+         * Moves the boundary between shard and shard+1 so that both hold
+         * about the same number of keys. Runs alongside other operations,
+         * only writers of the moved keys wait. Must not be called from
+         * inside an epoch guard. Needs Index::removeRange
+         * @return number of keys moved
+         */
+        size_t rebalance(unsigned shard) {
+            std::lock_guard<std::mutex> lock(rebalanceLock);
+            Dir* dir = directory.load();
+            if (shard + 1 >= shards.size()) {
+                return 0;
+            }
+            bool hasLow = shard > 0;
+            Key low = hasLow ? dir->bounds[shard - 1] : Key();
+            Key mid = dir->bounds[shard];
+            bool hasHigh = shard + 1 < dir->numBounds;
+            Key high = hasHigh ? dir->bounds[shard + 1] : Key();
+
+            size_t leftCount = countRange(shard, hasLow, low, true, mid);
+            size_t rightCount = countRange(shard + 1, true, mid, hasHigh, high);
+            size_t half = (leftCount + rightCount) / 2;
+
+            // Keys in (moveLow, moveHigh] go from shard from to shard to
+            unsigned from, to;
+            Key newMid, moveLow, moveHigh;
+            if (leftCount > half + 1) {
+                from = shard;
+                to = shard + 1;
+                newMid = keyAt(shard, hasLow, low, half - 1);
+                moveLow = newMid;
+                moveHigh = mid;
+            } else if (rightCount > half + 1) {
+                from = shard + 1;
+                to = shard;
+                newMid = keyAt(shard + 1, true, mid, half - leftCount - 1);
+                moveLow = mid;
+                moveHigh = newMid;
+            } else {
+                return 0;
+            }
+
+            Dir* frozen = new Dir(*dir);
+            frozen->hasFrozen = true;
+            frozen->frozenLow = moveLow;
+            frozen->frozenHigh = moveHigh;
+            publish(frozen);
+
+            // No writer of the range is left, copy it while readers still use the source
+            size_t moved = 0;
+            forEachInRange(from, true, moveLow, true, moveHigh, [&](Key k, Value v) {
+                shards[to]->insert(k, v);
+                moved++;
+                return true;
+            });
+
+            // Route the range to its new shard, then let writers back in
+            Dir* routed = new Dir(*frozen);
+            routed->bounds[shard] = newMid;
+            publish(routed);
+            Dir* open = new Dir(*routed);
+            open->hasFrozen = false;
+            publish(open);
+
+            // No reader is routed to the source for the range anymore
+            shards[from]->removeRange(moveLow, moveHigh);
+
+            counts[from].keys = (from == shard ? leftCount : rightCount) - moved;
+            counts[to].keys = (to == shard ? leftCount : rightCount) + moved;
+            return moved;
+        }
+
+        /**
+         * Frees all shards. No operation or rebalance may be running
+         */
+        void clear() {
+            rebalancer.wait();
+            for (unsigned i = 0; i < shards.size(); i++) {
+                shards[i]->clear();
+                counts[i].keys = 0;
+            }
+        }
+
+        /**
+         * Merged stats of all shards
+         */
+        treestats::TreeStats stats(int numThreads = parallel::defaultThreads()) {
+            treestats::TreeStats result;
+            for (auto& shard : shards) {
+                result.merge(shard->stats(numThreads));
+            }
+            return result;
+        }
+
+        /**
+         * Verifies every shard, see TreeVerifier.h. Needs a tree without
+         * concurrent writers
+         */
+        bool verify(int numThreads = parallel::defaultThreads()) {
+            bool ok = true;
+            for (auto& shard : shards) {
+                ok = shard->verify(numThreads).ok && ok;
+            }
+            return ok;
+        }
+
+        /**
+         * Sampled number of keys per shard
+         */
+        std::vector<int64_t> shardSizes() const {
+            std::vector<int64_t> sizes;
+            for (unsigned i = 0; i < shards.size(); i++) {
+                sizes.push_back(counts[i].keys.load());
+            }
+            return sizes;
+        }
+
+    private:
+        void publish(Dir* next) {
+            Dir* old = directory.exchange(next);
+            epoch::synchronize();
+            delete old;
+        }
+
+        void countInsert(unsigned shard) {
+            static thread_local uint64_t inserts = 0;
+            if (++inserts % countSample != 0) {
+                return;
+            }
+            int64_t keys = counts[shard].keys.fetch_add(countSample) + countSample;
+            if (!autoRebalance || keys < minRebalanceKeys) {
+                return;
+            }
+            int64_t total = 0;
+            for (unsigned i = 0; i < shards.size(); i++) {
+                total += counts[i].keys.load(std::memory_order_relaxed);
+            }
+            if (keys > skewFactor * total / shards.size() && !rebalancing.exchange(true)) {
+                rebalancer.run([this, shard]() {
+                    spread(shard);
+                    rebalancing = false;
+                });
+            }
+        }
+
+        /**
+         * Evens out shard with its smaller neighbour, and keeps going in that
+         * direction while the neighbour is still oversized
+         */
+        void spread(unsigned shard) {
+            if (shards.size() < 2) {
+                return;
+            }
+            bool left = shard == shards.size() - 1 ||
+                (shard > 0 && counts[shard - 1].keys.load() < counts[shard + 1].keys.load());
+            while (true) {
+                unsigned next = left ? shard - 1 : shard + 1;
+                if (rebalance(left ? next : shard) == 0) {
+                    return;
+                }
+                int64_t total = 0;
+                for (unsigned i = 0; i < shards.size(); i++) {
+                    total += counts[i].keys.load();
+                }
+                bool oversized = counts[next].keys.load() > skewFactor * total / shards.size();
+                if (!oversized || (left ? next == 0 : next == shards.size() - 1)) {
+                    return;
+                }
+                shard = next;
+            }
+        }
+
+        /**
+         * Calls fn for the entries of shard in (low, high] until it returns
+         * false, a missing bound is open
+         */
+        template<class Fn>
+        void forEachInRange(unsigned shard, bool hasLow, Key low, bool hasHigh, Key high, Fn fn) {
+            static const int chunk = 1024;
+            Key keys[chunk];
+            Value values[chunk];
+            Key from = hasLow ? low : std::numeric_limits<Key>::lowest();
+            bool exclusive = hasLow;
+            while (true) {
+                int got = shards[shard]->scanEntries(from, chunk, keys, values, exclusive);
+                for (int i = 0; i < got; i++) {
+                    if (hasHigh && high < keys[i]) {
+                        return;
+                    }
+                    if (!fn(keys[i], values[i])) {
+                        return;
+                    }
+                }
+                if (got < chunk) {
+                    return;
+                }
+                from = keys[got - 1];
+                exclusive = true;
+            }
+        }
+
+        size_t countRange(unsigned shard, bool hasLow, Key low, bool hasHigh, Key high) {
+            size_t count = 0;
+            forEachInRange(shard, hasLow, low, hasHigh, high, [&](Key, Value) { count++; return true; });
+            return count;
+        }
+
+        /**
+         * Key at position index among the keys of shard above low
+         */
+        Key keyAt(unsigned shard, bool hasLow, Key low, size_t index) {
+            size_t i = 0;
+            Key result = low;
+            forEachInRange(shard, hasLow, low, false, Key(), [&](Key k, Value) {
+                result = k;
+                return i++ < index;
+            });
+            return result;
+        }
+    };
+}
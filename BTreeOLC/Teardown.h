@@ -0,0 +1,104 @@
+#pragma once
+
+#include <functional>
+#include <thread>
+#include <vector>
+
+#include "Parallel.h"
+
+namespace teardown {
+
+    /**
+     * Who frees a node. Borrowed nodes, e.g. pages of a mapped file, are
+     * not deleted but their children are visited. Nothing below a borrowed
+     * subtree is deleted or even read
+     */
+    enum class Ownership { Owned, Borrowed, BorrowedSubtree };
+
+    struct AllOwned {
+        template<class Node>
+        Ownership operator()(const Node*) const { return Ownership::Owned; }
+    };
+
+    /**
+     * Deletes every owned node of a subtree, without recursion
+     */
+    template<class Inner, class Leaf, class Node, class OwnershipOf = AllOwned>
+    void freeSubtree(Node* node, OwnershipOf ownershipOf = OwnershipOf()) {
+        std::vector<Node*> stack{node};
+        while(!stack.empty()) {
+            Node* current = stack.back();
+            stack.pop_back();
+            Ownership ownership = ownershipOf(current);
+            if(ownership == Ownership::BorrowedSubtree) {
+                continue;
+            }
+            if(current->type == Leaf::typeMarker) {
+                if(ownership == Ownership::Owned) {
+                    delete static_cast<Leaf*>(current);
+                }
+            } else {
+                auto inner = static_cast<Inner*>(current);
+                for(unsigned i = 0; i <= inner->count; i++) {
+                    stack.push_back(inner->children[i]);
+                }
+                if(ownership == Ownership::Owned) {
+                    delete inner;
+                }
+            }
+        }
+    }
+
+    /**
+     * Deletes a whole tree. The upper levels are freed on the calling thread
+     * until there are enough subtrees, which are then freed on numThreads
+     * threads. No other thread may still be using the tree
+     */
+    template<class Inner, class Leaf, class Node, class OwnershipOf = AllOwned>
+    void freeTree(Node* root, int numThreads = parallel::defaultThreads(), OwnershipOf ownershipOf = OwnershipOf()) {
+        std::vector<Node*> frontier{root};
+        while(!frontier.empty() && frontier.size() < (size_t)numThreads * 8 && frontier[0]->type != Leaf::typeMarker) {
+            std::vector<Node*> next;
+            for(Node* node : frontier) {
+                Ownership ownership = ownershipOf(node);
+                if(ownership == Ownership::BorrowedSubtree) {
+                    continue;
+                }
+                auto inner = static_cast<Inner*>(node);
+                for(unsigned i = 0; i <= inner->count; i++) {
+                    next.push_back(inner->children[i]);
+                }
+                if(ownership == Ownership::Owned) {
+                    delete inner;
+                }
+            }
+            frontier.swap(next);
+        }
+        parallel::parallelFor(frontier.size(), numThreads, [&](int threadId, size_t i) {
+            freeSubtree<Inner, Leaf>(frontier[i], ownershipOf);
+        });
+    }
+
+    /**
+     * Runs reclamation work on a background thread, one job at a time. A new
+     * job waits for the previous one, the destructor waits for the last
+     */
+    struct Reclaimer {
+        std::thread thread;
+
+        void run(std::function<void()> job) {
+            wait();
+            thread = std::thread(job);
+        }
+
+        void wait() {
+            if(thread.joinable()) {
+                thread.join();
+            }
+        }
+
+        ~Reclaimer() {
+            wait();
+        }
+    };
+}
@@ -0,0 +1,171 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <thread>
+#include <vector>
+#include <stdio.h>
+
+namespace timeline {
+
+    /**
+     * Counters of one worker thread. Only the owning thread writes them, the
+     * sampler thread reads them, so relaxed loads and stores are enough
+     */
+    struct alignas(64) ThreadCounters {
+        std::atomic<uint64_t> ops{0};
+        std::atomic<uint64_t> restarts{0};
+        std::atomic<uint64_t> fallbacks{0};
+
+        static void bump(std::atomic<uint64_t>& counter, uint64_t n) {
+            counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+        }
+    };
+
+    // Counters of the calling thread, null when the thread is not sampled
+    inline thread_local ThreadCounters* localCounters = nullptr;
+
+    inline void countOps(uint64_t n) {
+        if(localCounters) ThreadCounters::bump(localCounters->ops, n);
+    }
+
+    inline void countRestart() {
+        if(localCounters) ThreadCounters::bump(localCounters->restarts, 1);
+    }
+
+    inline void countFallback() {
+        if(localCounters) ThreadCounters::bump(localCounters->fallbacks, 1);
+    }
+
+    /**
+     * What one thread did during one interval
+     */
+    struct Sample {
+        double time;
+        int threadId;
+        uint64_t ops;
+        uint64_t restarts;
+        uint64_t fallbacks;
+        int height;
+    };
+
+    /**
+     * Background thread that every interval records, for each attached
+     * thread, the ops, restarts and fallbacks since the previous tick,
+     * together with the tree height reported by heightProbe
+     */
+    struct Sampler {
+        std::vector<ThreadCounters> counters;
+        std::chrono::microseconds interval;
+        std::function<int()> heightProbe;
+        std::vector<Sample> samples;
+        std::atomic<bool> running{false};
+        std::thread thread;
+
+        Sampler(int numThreads, int intervalMs = 10, std::function<int()> heightProbe_ = nullptr) :
+            counters(numThreads), interval(intervalMs * 1000), heightProbe(heightProbe_) {}
+
+        ~Sampler() {
+            stop();
+        }
+
+        /**
+         * Called by worker threadId before it starts its operations
+         */
+        void attach(int threadId) {
+            localCounters = &counters[threadId];
+        }
+
+        static void detach() {
+            localCounters = nullptr;
+        }
+
+        void start() {
+            samples.clear();
+            running = true;
+            thread = std::thread([this]() { run(); });
+        }
+
+        void stop() {
+            if(thread.joinable()) {
+                running = false;
+                thread.join();
+            }
+        }
+
+        void run() {
+            typedef std::chrono::steady_clock clock;
+            std::vector<Sample> last(counters.size(), Sample{0, 0, 0, 0, 0, 0});
+            auto begin = clock::now();
+            auto next = begin;
+            bool lastTick = false;
+            while(!lastTick) {
+                next += interval;
+                std::this_thread::sleep_until(next);
+                lastTick = !running;
+                double now = std::chrono::duration<double>(clock::now() - begin).count();
+                int height = heightProbe ? heightProbe() : 0;
+                for(size_t i = 0; i < counters.size(); i++) {
+                    Sample current{now, (int)i,
+                        counters[i].ops.load(std::memory_order_relaxed),
+                        counters[i].restarts.load(std::memory_order_relaxed),
+                        counters[i].fallbacks.load(std::memory_order_relaxed),
+                        height};
+                    samples.push_back(Sample{now, (int)i,
+                        current.ops - last[i].ops,
+                        current.restarts - last[i].restarts,
+                        current.fallbacks - last[i].fallbacks,
+                        height});
+                    last[i] = current;
+                }
+            }
+        }
+
+        /**
+         * Writes one line per thread and interval:
+         * time_ms,thread,ops,restarts,fallbacks,height
+         */
+        bool writeCSV(const char* path) const {
+            FILE* file = fopen(path, "w");
+            if(!file) {
+                return false;
+            }
+            fprintf(file, "time_ms,thread,ops,restarts,fallbacks,height\n");
+            for(const Sample& s : samples) {
+                fprintf(file, "%.3f,%d,%lu,%lu,%lu,%d\n",
+                    s.time * 1000, s.threadId, s.ops, s.restarts, s.fallbacks, s.height);
+            }
+            fclose(file);
+            return true;
+        }
+
+        /**
+         * Prints the slowest and fastest interval over all threads, and the
+         * height at each
+         */
+        void printSummary() const {
+            size_t numThreads = counters.size();
+            if(samples.size() < numThreads) {
+                return;
+            }
+            uint64_t minOps = UINT64_MAX, maxOps = 0;
+            double minTime = 0, maxTime = 0;
+            int minHeight = 0, maxHeight = 0;
+            for(size_t i = 0; i + numThreads <= samples.size(); i += numThreads) {
+                uint64_t ops = 0;
+                for(size_t j = i; j < i + numThreads; j++) {
+                    ops += samples[j].ops;
+                }
+                if(ops < minOps) {
+                    minOps = ops; minTime = samples[i].time; minHeight = samples[i].height;
+                }
+                if(ops > maxOps) {
+                    maxOps = ops; maxTime = samples[i].time; maxHeight = samples[i].height;
+                }
+            }
+            printf("Intervals: %zu, slowest: %lu ops at %.3fs (height %d), fastest: %lu ops at %.3fs (height %d) \n",
+                samples.size() / numThreads, minOps, minTime, minHeight, maxOps, maxTime, maxHeight);
+        }
+    };
+}
@@ -0,0 +1,173 @@
+#pragma once
+
+/*
+ * Per-thread structural event tracing, enabled by compiling with
+ * -DBTREE_TRACE (make trace). Without it TRACE_EVENT expands to nothing.
+ * Events raised inside an RTM transaction are only kept if it commits.
+ */
+
+#ifdef BTREE_TRACE
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <vector>
+#include <stdio.h>
+#include <x86intrin.h>
+
+namespace trace {
+
+    enum class EventType : uint32_t {
+        SplitInner=0,
+        SplitLeaf=1,
+        MakeRoot=2,
+        RestartReadLock=3,   // readLockOrRestart found the node locked or obsolete
+        RestartCheck=4,      // checkOrRestart saw a newer version
+        RestartReadUnlock=5, // readUnlockOrRestart saw a newer version
+        RestartUpgrade=6,    // upgradeToWriteLockOrRestart lost the CAS
+        RtmAbort=7,          // arg is the _xbegin status
+        RtmFallback=8,
+        LeafRestructure=9
+    };
+
+    inline const char* eventName(EventType type) {
+        static const char* names[] = {
+            "split_inner", "split_leaf", "make_root", "restart_read_lock", "restart_check",
+            "restart_read_unlock", "restart_upgrade", "rtm_abort", "rtm_fallback", "leaf_restructure"
+        };
+        return names[(uint32_t)type];
+    }
+
+    struct Event {
+        uint64_t tsc;
+        const void* node;
+        EventType type;
+        uint32_t arg;
+    };
+
+    /**
+     * Single writer ring, the owning thread overwrites the oldest events once
+     * it wraps. Readers only look at it after the traced run
+     */
+    struct Ring {
+        static const uint64_t capacity = 1 << 16;
+        int threadId;
+        std::atomic<uint64_t> head{0};
+        Event events[capacity];
+
+        void push(EventType type, const void* node, uint32_t arg) {
+            uint64_t h = head.load(std::memory_order_relaxed);
+            events[h & (capacity - 1)] = Event{__rdtsc(), node, type, arg};
+            head.store(h + 1, std::memory_order_release);
+        }
+    };
+
+    /**
+     * Rings of exited threads go on a free list and are handed to the next
+     * thread that starts tracing, so memory is bounded by the peak number of
+     * concurrently tracing threads. A reused ring keeps its earlier events,
+     * they share its tid in the dump
+     */
+    struct Registry {
+        std::mutex lock;
+        std::vector<Ring*> rings;
+        std::vector<Ring*> freeRings;
+        uint64_t startTsc;
+        std::chrono::steady_clock::time_point startTime;
+
+        Registry() : startTsc(__rdtsc()), startTime(std::chrono::steady_clock::now()) {}
+
+        Ring* registerThread() {
+            std::lock_guard<std::mutex> guard(lock);
+            if(!freeRings.empty()) {
+                Ring* ring = freeRings.back();
+                freeRings.pop_back();
+                return ring;
+            }
+            Ring* ring = new Ring();
+            ring->threadId = rings.size();
+            rings.push_back(ring);
+            return ring;
+        }
+
+        void releaseThread(Ring* ring) {
+            std::lock_guard<std::mutex> guard(lock);
+            freeRings.push_back(ring);
+        }
+    };
+
+    inline Registry& registry() {
+        static Registry instance;
+        return instance;
+    }
+
+    /**
+     * Holds the calling thread's ring and returns it to the registry on exit
+     */
+    struct ThreadRing {
+        Ring* ring;
+
+        ThreadRing() : ring(registry().registerThread()) {}
+        ~ThreadRing() { registry().releaseThread(ring); }
+    };
+
+    inline void record(EventType type, const void* node, uint32_t arg) {
+        static thread_local ThreadRing local;
+        local.ring->push(type, node, arg);
+    }
+
+    /**
+     * Forgets all recorded events. Only call while no thread is tracing
+     */
+    inline void reset() {
+        Registry& reg = registry();
+        std::lock_guard<std::mutex> guard(reg.lock);
+        for(Ring* ring : reg.rings) {
+            ring->head = 0;
+        }
+    }
+
+    /**
+     * Writes the retained events of all threads as Chrome trace JSON
+     * (chrome://tracing, Perfetto). Timestamps are rdtsc converted to
+     * microseconds with the tsc rate measured since the first event
+     */
+    inline bool dumpChromeTrace(const char* path) {
+        Registry& reg = registry();
+        std::lock_guard<std::mutex> guard(reg.lock);
+        FILE* file = fopen(path, "w");
+        if(!file) {
+            return false;
+        }
+
+        double elapsedUs = std::chrono::duration<double, std::micro>(
+            std::chrono::steady_clock::now() - reg.startTime).count();
+        double ticksPerUs = elapsedUs > 0 ? (__rdtsc() - reg.startTsc) / elapsedUs : 1;
+
+        fprintf(file, "{\"traceEvents\":[\n");
+        bool first = true;
+        for(Ring* ring : reg.rings) {
+            uint64_t head = ring->head.load(std::memory_order_acquire);
+            uint64_t begin = head > Ring::capacity ? head - Ring::capacity : 0;
+            for(uint64_t i = begin; i < head; i++) {
+                const Event& e = ring->events[i & (Ring::capacity - 1)];
+                fprintf(file, "%s{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":0,\"tid\":%d,\"ts\":%.3f,"
+                    "\"args\":{\"node\":\"%p\",\"arg\":%u}}",
+                    first ? "" : ",\n", eventName(e.type), ring->threadId,
+                    (e.tsc - reg.startTsc) / ticksPerUs, e.node, e.arg);
+                first = false;
+            }
+        }
+        fprintf(file, "\n],\"displayTimeUnit\":\"ns\"}\n");
+        fclose(file);
+        return true;
+    }
+}
+
+#define TRACE_EVENT(type, node, arg) trace::record(trace::EventType::type, (node), (arg))
+
+#else
+
+#define TRACE_EVENT(type, node, arg) ((void)0)
+
+#endif
@@ -0,0 +1,169 @@
+#pragma once
+
+#include <vector>
+#include <stdio.h>
+
+#include "Parallel.h"
+
+namespace treestats {
+
+    static const int fillBuckets = 10;
+
+    struct LevelStats {
+        uint64_t innerNodes = 0;
+        uint64_t leafNodes = 0;
+        uint64_t entries = 0;
+    };
+
+    /**
+     * Shape and memory use of a tree. Level 0 is the root, fill histograms
+     * bucket nodes by count/capacity in steps of 10%
+     */
+    struct TreeStats {
+        std::vector<LevelStats> levels;
+        uint64_t leafFill[fillBuckets] = {0};
+        uint64_t innerFill[fillBuckets] = {0};
+        uint64_t leafNodes = 0;
+        uint64_t innerNodes = 0;
+        uint64_t keys = 0;
+        uint64_t leafSlots = 0;
+        uint64_t innerSlots = 0;
+        uint64_t innerChildren = 0;
+        uint64_t allocatedBytes = 0;
+        uint64_t unusedLeafBytes = 0;
+
+        LevelStats& level(int depth) {
+            if(levels.size() <= (size_t)depth) {
+                levels.resize(depth + 1);
+            }
+            return levels[depth];
+        }
+
+        void merge(const TreeStats& other) {
+            for(size_t i = 0; i < other.levels.size(); i++) {
+                LevelStats& mine = level(i);
+                mine.innerNodes += other.levels[i].innerNodes;
+                mine.leafNodes += other.levels[i].leafNodes;
+                mine.entries += other.levels[i].entries;
+            }
+            for(int i = 0; i < fillBuckets; i++) {
+                leafFill[i] += other.leafFill[i];
+                innerFill[i] += other.innerFill[i];
+            }
+            leafNodes += other.leafNodes;
+            innerNodes += other.innerNodes;
+            keys += other.keys;
+            leafSlots += other.leafSlots;
+            innerSlots += other.innerSlots;
+            innerChildren += other.innerChildren;
+            allocatedBytes += other.allocatedBytes;
+            unusedLeafBytes += other.unusedLeafBytes;
+        }
+
+        int height() const { return levels.size(); }
+
+        double bytesPerKey() const { return keys ? (double)allocatedBytes / keys : 0; }
+
+        double averageLeafFill() const { return leafSlots ? (double)keys / leafSlots : 0; }
+
+        double averageInnerFill() const { return innerSlots ? (double)innerChildren / innerSlots : 0; }
+
+        static int bucket(uint64_t used, uint64_t capacity) {
+            int b = used * fillBuckets / capacity;
+            return b < fillBuckets ? b : fillBuckets - 1;
+        }
+
+        /**
+         * One line summary for benchmark output
+         */
+        void printSummary() const {
+            printf("Keys: %lu, height: %d, leaves: %lu, inner: %lu, leaf fill: %.1f%%, inner fill: %.1f%%, "
+                   "allocated: %.2fMB, bytes/key: %.2f, unused leaf bytes: %.2fMB \n",
+                keys, height(), leafNodes, innerNodes, averageLeafFill() * 100, averageInnerFill() * 100,
+                allocatedBytes / (1024.0 * 1024.0), bytesPerKey(), unusedLeafBytes / (1024.0 * 1024.0));
+        }
+
+        void print() const {
+            printSummary();
+            for(size_t i = 0; i < levels.size(); i++) {
+                printf("  level %zu: inner %lu, leaves %lu, entries %lu \n",
+                    i, levels[i].innerNodes, levels[i].leafNodes, levels[i].entries);
+            }
+            printf("  leaf fill histogram: ");
+            for(int i = 0; i < fillBuckets; i++) printf("%lu ", leafFill[i]);
+            printf("\n  inner fill histogram: ");
+            for(int i = 0; i < fillBuckets; i++) printf("%lu ", innerFill[i]);
+            printf("\n");
+        }
+    };
+
+    template<class Inner, class Leaf, class Node>
+    void addNode(Node* node, int depth, TreeStats& stats) {
+        LevelStats& level = stats.level(depth);
+        level.entries += node->count;
+        if(node->type == Leaf::typeMarker) {
+            auto leaf = static_cast<Leaf*>(node);
+            const uint64_t entryBytes = sizeof(leaf->keys[0]) + sizeof(leaf->payloads[0]);
+            level.leafNodes++;
+            stats.leafNodes++;
+            stats.keys += leaf->count;
+            stats.leafSlots += Leaf::maxEntries;
+            stats.allocatedBytes += sizeof(Leaf);
+            stats.unusedLeafBytes += (Leaf::maxEntries - leaf->count) * entryBytes;
+            stats.leafFill[TreeStats::bucket(leaf->count, Leaf::maxEntries)]++;
+        } else {
+            auto inner = static_cast<Inner*>(node);
+            level.innerNodes++;
+            stats.innerNodes++;
+            stats.innerSlots += Inner::maxEntries;
+            stats.innerChildren += inner->count + 1;
+            stats.allocatedBytes += sizeof(Inner);
+            stats.innerFill[TreeStats::bucket(inner->count + 1, Inner::maxEntries)]++;
+        }
+    }
+
+    template<class Inner, class Leaf, class Node>
+    void collectRecursive(Node* node, int depth, TreeStats& stats) {
+        addNode<Inner, Leaf>(node, depth, stats);
+        if(node->type != Leaf::typeMarker) {
+            auto inner = static_cast<Inner*>(node);
+            for(unsigned i = 0; i <= inner->count; i++) {
+                collectRecursive<Inner, Leaf>(inner->children[i], depth + 1, stats);
+            }
+        }
+    }
+
+    /**
+     * Walks the whole tree. The upper levels are expanded on the calling
+     * thread until there are enough subtrees to hand out, the subtrees are
+     * then walked on numThreads threads. Counts are only exact while no
+     * writer is running
+     */
+    template<class Inner, class Leaf, class Node>
+    TreeStats collect(Node* root, int numThreads = parallel::defaultThreads()) {
+        TreeStats stats;
+        std::vector<Node*> frontier{root};
+        int depth = 0;
+        while(frontier.size() < (size_t)numThreads * 8 && frontier[0]->type != Leaf::typeMarker) {
+            std::vector<Node*> next;
+            for(Node* node : frontier) {
+                addNode<Inner, Leaf>(node, depth, stats);
+                auto inner = static_cast<Inner*>(node);
+                for(unsigned i = 0; i <= inner->count; i++) {
+                    next.push_back(inner->children[i]);
+                }
+            }
+            frontier.swap(next);
+            depth++;
+        }
+
+        std::vector<TreeStats> partial(frontier.size());
+        parallel::parallelFor(frontier.size(), numThreads, [&](int threadId, size_t i) {
+            collectRecursive<Inner, Leaf>(frontier[i], depth, partial[i]);
+        });
+        for(const TreeStats& p : partial) {
+            stats.merge(p);
+        }
+        return stats;
+    }
+}
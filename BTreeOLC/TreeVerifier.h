@@ -0,0 +1,182 @@
+#pragma once
+
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "Parallel.h"
+
+namespace treeverify {
+
+    static const size_t maxErrors = 16;
+
+    struct VerifyResult {
+        bool ok = true;
+        uint64_t nodes = 0;
+        uint64_t keys = 0;
+        int leafDepth = -1;
+        std::vector<std::string> errors;
+
+        void fail(const std::string& error) {
+            ok = false;
+            if(errors.size() < maxErrors) {
+                errors.push_back(error);
+            }
+        }
+
+        void merge(const VerifyResult& other) {
+            nodes += other.nodes;
+            keys += other.keys;
+            for(const std::string& error : other.errors) {
+                fail(error);
+            }
+            if(!other.ok) {
+                ok = false;
+            }
+            if(other.leafDepth != -1) {
+                if(leafDepth != -1 && leafDepth != other.leafDepth) {
+                    fail("leaves at depth " + std::to_string(leafDepth) + " and " + std::to_string(other.leafDepth));
+                }
+                leafDepth = other.leafDepth;
+            }
+        }
+
+        void print() const {
+            printf("Verify %s: nodes %lu, keys %lu, height %d \n", ok ? "passed" : "FAILED", nodes, keys, leafDepth + 1);
+            for(const std::string& error : errors) {
+                printf("  %s \n", error.c_str());
+            }
+        }
+    };
+
+    // Leaves with an isSorted flag (btreertm) only promise order while it is set
+    template<class Leaf>
+    auto claimsSorted(Leaf* leaf, int) -> decltype(leaf->isSorted, bool()) { return leaf->isSorted; }
+
+    template<class Leaf>
+    bool claimsSorted(Leaf*, long) { return true; }
+
+    /**
+     * A subtree to check: node must only hold keys in (lower, upper]
+     */
+    template<class Key, class Node>
+    struct Task {
+        Node* node;
+        int depth;
+        bool hasLower, hasUpper;
+        Key lower, upper;
+    };
+
+    template<class Key, class Node>
+    std::string describe(const Task<Key, Node>& task) {
+        std::ostringstream out;
+        out << task.node << " at depth " << task.depth << " (";
+        if(task.hasLower) out << task.lower; else out << "-inf";
+        out << ", ";
+        if(task.hasUpper) out << task.upper; else out << "+inf";
+        out << "]";
+        return out.str();
+    }
+
+    template<class Key, class Node>
+    bool inRange(const Task<Key, Node>& task, const Key& k) {
+        return (!task.hasLower || task.lower < k) && (!task.hasUpper || !(task.upper < k));
+    }
+
+    /**
+     * Checks one node and appends its children as tasks
+     */
+    template<class Key, class Inner, class Leaf, class Node>
+    void checkNode(const Task<Key, Node>& task, VerifyResult& result, std::vector<Task<Key, Node>>& children) {
+        Node* node = task.node;
+        result.nodes++;
+        if(node->type == Leaf::typeMarker) {
+            auto leaf = static_cast<Leaf*>(node);
+            result.keys += leaf->count;
+            if(result.leafDepth == -1) {
+                result.leafDepth = task.depth;
+            } else if(result.leafDepth != task.depth) {
+                result.fail("leaf " + describe(task) + " but other leaves at depth " + std::to_string(result.leafDepth));
+            }
+            if(leaf->count > Leaf::maxEntries) {
+                result.fail("leaf " + describe(task) + " has count " + std::to_string(leaf->count));
+                return;
+            }
+            bool sorted = claimsSorted(leaf, 0);
+            for(unsigned i = 0; i < leaf->count; i++) {
+                if(!inRange(task, leaf->keys[i])) {
+                    result.fail("leaf " + describe(task) + " holds a key outside its separators at " + std::to_string(i));
+                    break;
+                }
+                if(sorted && i > 0 && !(leaf->keys[i-1] < leaf->keys[i])) {
+                    result.fail("leaf " + describe(task) + " is not sorted at " + std::to_string(i));
+                    break;
+                }
+            }
+            return;
+        }
+
+        auto inner = static_cast<Inner*>(node);
+        if(inner->count == 0 || inner->count > Inner::maxEntries - 1) {
+            result.fail("inner " + describe(task) + " has count " + std::to_string(inner->count));
+            return;
+        }
+        for(unsigned i = 0; i < inner->count; i++) {
+            if(!inRange(task, inner->keys[i])) {
+                result.fail("inner " + describe(task) + " has a separator outside its range at " + std::to_string(i));
+                return;
+            }
+            if(i > 0 && !(inner->keys[i-1] < inner->keys[i])) {
+                result.fail("inner " + describe(task) + " has unsorted separators at " + std::to_string(i));
+                return;
+            }
+        }
+        for(unsigned i = 0; i <= inner->count; i++) {
+            Task<Key, Node> child{inner->children[i], task.depth + 1,
+                i > 0 || task.hasLower, i < inner->count || task.hasUpper,
+                i > 0 ? inner->keys[i-1] : task.lower, i < inner->count ? inner->keys[i] : task.upper};
+            children.push_back(child);
+        }
+    }
+
+    template<class Key, class Inner, class Leaf, class Node>
+    void checkSubtree(const Task<Key, Node>& task, VerifyResult& result) {
+        std::vector<Task<Key, Node>> stack{task};
+        while(!stack.empty()) {
+            Task<Key, Node> current = stack.back();
+            stack.pop_back();
+            checkNode<Key, Inner, Leaf>(current, result, stack);
+        }
+    }
+
+    /**
+     * Checks that all leaves are at the same depth, that every node respects
+     * its fanout bounds, that separators are sorted and bound their subtrees
+     * and that leaf keys are sorted (for btreertm: whenever isSorted is set).
+     * The upper levels are checked on the calling thread, the subtrees below
+     * are then checked as independent tasks on numThreads threads. Needs a
+     * tree without concurrent writers
+     */
+    template<class Key, class Inner, class Leaf, class Node>
+    VerifyResult verify(Node* root, int numThreads = parallel::defaultThreads()) {
+        VerifyResult result;
+        std::vector<Task<Key, Node>> frontier{Task<Key, Node>{root, 0, false, false, Key(), Key()}};
+        while(!frontier.empty() && frontier.size() < (size_t)numThreads * 8
+              && frontier[0].node->type != Leaf::typeMarker) {
+            std::vector<Task<Key, Node>> next;
+            for(const Task<Key, Node>& task : frontier) {
+                checkNode<Key, Inner, Leaf>(task, result, next);
+            }
+            frontier.swap(next);
+        }
+
+        std::vector<VerifyResult> partial(frontier.size());
+        parallel::parallelFor(frontier.size(), numThreads, [&](int threadId, size_t i) {
+            checkSubtree<Key, Inner, Leaf>(frontier[i], partial[i]);
+        });
+        for(const VerifyResult& p : partial) {
+            result.merge(p);
+        }
+        return result;
+    }
+}
@@ -0,0 +1,175 @@
+#pragma once
+
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <stdio.h>
+#include <immintrin.h>
+
+#include "timing.h"
+
+namespace executor {
+
+    /**
+     * A contiguous range [begin, end) of operations taken from one partition
+     * (e.g. one per-thread workload vector)
+     */
+    struct Chunk {
+        int partition;
+        size_t begin;
+        size_t end;
+    };
+
+    /**
+     * Per-thread deque of chunks. The owner pops from the front, thieves take
+     * from the back so they grab the work the owner would reach last.
+     */
+    struct alignas(64) WorkQueue {
+        std::mutex lock;
+        std::deque<Chunk> chunks;
+
+        bool popFront(Chunk& chunk) {
+            std::lock_guard<std::mutex> guard(lock);
+            if(chunks.empty()) {
+                return false;
+            }
+            chunk = chunks.front();
+            chunks.pop_front();
+            return true;
+        }
+
+        bool stealBack(Chunk& chunk) {
+            std::lock_guard<std::mutex> guard(lock);
+            if(chunks.empty()) {
+                return false;
+            }
+            chunk = chunks.back();
+            chunks.pop_back();
+            return true;
+        }
+    };
+
+    struct ThreadReport {
+        uint64_t ops = 0;
+        uint64_t chunksStolen = 0;
+        double finishTime = 0;
+
+        double opsPerSecond() const {
+            return finishTime > 0 ? ops / finishTime : 0;
+        }
+    };
+
+    struct RunReport {
+        double makespan = 0;
+        uint64_t totalOps = 0;
+        std::vector<ThreadReport> threads;
+
+        double aggregateOpsPerSecond() const {
+            return makespan > 0 ? totalOps / makespan : 0;
+        }
+
+        /**
+         * Finish time of the fastest thread, the gap to the makespan is the
+         * time lost to imbalance
+         */
+        double firstFinish() const {
+            double first = makespan;
+            for(const ThreadReport& t : threads) {
+                first = std::min(first, t.finishTime);
+            }
+            return first;
+        }
+
+        void print() const {
+            printf("Makespan: %.6fs, aggregate: %.0f ops/s, first thread done: %.6fs \n",
+                makespan, aggregateOpsPerSecond(), firstFinish());
+            for(size_t i = 0; i < threads.size(); i++) {
+                printf("  thread %zu: ops %lu, stolen chunks %lu, finish %.6fs, %.0f ops/s \n",
+                    i, threads[i].ops, threads[i].chunksStolen, threads[i].finishTime, threads[i].opsPerSecond());
+            }
+        }
+    };
+
+    /**
+     * Runs a set of operation partitions on numThreads threads. Partition i
+     * starts on thread i % numThreads, split into chunkSize sized chunks. With
+     * stealing enabled an idle thread takes chunks from the back of another
+     * thread's deque, otherwise the run is the usual static partitioning and
+     * the per-thread finish times show the imbalance.
+     *
+     * Chunks of a partition may run out of order once stolen, so a lookup
+     * can run before the insert of its key.
+     */
+    struct WorkStealingExecutor {
+        int numThreads;
+        size_t chunkSize;
+        bool stealing;
+
+        WorkStealingExecutor(int numThreads_, size_t chunkSize_ = 1024, bool stealing_ = true) :
+            numThreads(numThreads_), chunkSize(chunkSize_), stealing(stealing_) {}
+
+        /**
+         * @param partitionSizes number of operations in each partition
+         * @param fn called as fn(threadId, partition, begin, end) for each chunk
+         */
+        template<class Fn>
+        RunReport run(const std::vector<size_t>& partitionSizes, Fn&& fn) {
+            std::vector<WorkQueue> queues(numThreads);
+            for(size_t p = 0; p < partitionSizes.size(); p++) {
+                WorkQueue& queue = queues[p % numThreads];
+                for(size_t begin = 0; begin < partitionSizes[p]; begin += chunkSize) {
+                    size_t end = std::min(begin + chunkSize, partitionSizes[p]);
+                    queue.chunks.push_back(Chunk{(int)p, begin, end});
+                }
+            }
+
+            RunReport report;
+            report.threads.resize(numThreads);
+            std::atomic<bool> start{false};
+            std::vector<std::thread> threads;
+            Timer t;
+
+            auto worker = [&](int threadId) {
+                while(!start.load(std::memory_order_acquire)) {
+                    _mm_pause();
+                }
+                ThreadReport& mine = report.threads[threadId];
+                Chunk chunk;
+                while(true) {
+                    if(!queues[threadId].popFront(chunk)) {
+                        bool stole = false;
+                        for(int i = 1; stealing && i < numThreads && !stole; i++) {
+                            stole = queues[(threadId + i) % numThreads].stealBack(chunk);
+                        }
+                        if(!stole) {
+                            break;
+                        }
+                        mine.chunksStolen++;
+                    }
+                    fn(threadId, chunk.partition, chunk.begin, chunk.end);
+                    mine.ops += chunk.end - chunk.begin;
+                }
+                mine.finishTime = t.elapsed();
+            };
+
+            for(int i = 1; i < numThreads; i++) {
+                threads.push_back(std::thread(worker, i));
+            }
+            t.reset();
+            start.store(true, std::memory_order_release);
+            worker(0);
+            for(std::thread& thread : threads) {
+                thread.join();
+            }
+            report.makespan = t.elapsed();
+
+            for(const ThreadReport& thread : report.threads) {
+                report.totalOps += thread.ops;
+            }
+            return report;
+        }
+    };
+}
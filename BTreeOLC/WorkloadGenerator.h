@@ -1,3 +1,5 @@
+#pragma once
+
 #include <vector>
 #include <time.h>
 #include <iostream>
@@ -19,6 +21,110 @@ struct Operation {
         type(type_), key(key_), value(value_) {}
 };
 
+/**
+ * splitmix64 finalizer, used to derive per-thread seeds and values
+ */
+inline uint64_t mix64(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+/**
+ * Seeded bijection on [0, n). Mixes within the next power of two and cycle
+ * walks until the result lands in range, so the i-th inserted key can be
+ * computed on demand instead of shuffling a key vector up front.
+ */
+struct KeyPermutation {
+    uint64_t n;
+    uint64_t mask;
+    int shift;
+    uint64_t seed;
+
+    KeyPermutation(uint64_t n_, uint64_t seed_) : n(n_), seed(seed_) {
+        int bits = 1;
+        while(bits < 64 && (1ULL << bits) < n) {
+            bits++;
+        }
+        mask = (bits == 64) ? ~0ULL : (1ULL << bits) - 1;
+        shift = (bits + 1) / 2;
+    }
+
+    uint64_t step(uint64_t x) const {
+        for(int round = 0; round < 3; round++) {
+            x = (x * 0x9e3779b97f4a7c15ULL + (seed >> round)) & mask;
+            x ^= x >> shift;
+        }
+        return x;
+    }
+
+    uint64_t operator()(uint64_t i) const {
+        uint64_t x = step(i);
+        while(x >= n) {
+            x = step(x);
+        }
+        return x;
+    }
+};
+
+/**
+ * Produces one thread's workload a chunk at a time. Same distribution as
+ * WorkloadGenerator::generateWorkload: the first op is an insert, each op
+ * is an insert with probability percentInsert and lookups only pick keys
+ * this stream already inserted. Keys are a permutation of
+ * [keysStartValue, keysStartValue + numOperations) and values are derived
+ * from the key, so nothing proportional to numOperations is kept in memory
+ * and the same seed reproduces the same stream.
+ */
+struct WorkloadStream {
+    double percentInsert;
+    int64_t numOperations;
+    int64_t keysStartValue;
+    int64_t generated;
+    int64_t numInserted;
+    uint64_t seed;
+    KeyPermutation permutation;
+    std::mt19937_64 eng;
+
+    WorkloadStream(double percentInsert_, int64_t numOperations_, int64_t keysStartValue_, uint64_t seed_) :
+        percentInsert(percentInsert_), numOperations(numOperations_), keysStartValue(keysStartValue_),
+        generated(0), numInserted(0), seed(seed_), permutation(numOperations_, mix64(seed_)), eng(seed_) {}
+
+    int64_t keyAt(int64_t insertIndex) const {
+        return keysStartValue + permutation(insertIndex);
+    }
+
+    int64_t valueFor(int64_t key) const {
+        return keysStartValue + mix64(key ^ seed) % (numOperations * 100 + 1);
+    }
+
+    bool done() const {
+        return generated == numOperations;
+    }
+
+    /**
+     * Replaces the contents of chunk with the next chunkSize operations
+     * @return false once the stream is exhausted
+     */
+    bool nextChunk(std::vector<Operation>& chunk, size_t chunkSize) {
+        chunk.clear();
+        const uint64_t insertThreshold = percentInsert >= 1.0 ? ~0ULL : (uint64_t)(percentInsert * 18446744073709551616.0);
+        while(chunk.size() < chunkSize && generated < numOperations) {
+            if(numInserted == 0 || eng() < insertThreshold) {
+                int64_t key = keyAt(numInserted++);
+                chunk.emplace_back(OpType::Insert, key, valueFor(key));
+            } else {
+                int64_t lookUpIndex = (int64_t)(((unsigned __int128)eng() * numInserted) >> 64);
+                int64_t key = keyAt(lookUpIndex);
+                chunk.emplace_back(OpType::Lookup, key, valueFor(key));
+            }
+            generated++;
+        }
+        return !chunk.empty();
+    }
+};
+
 struct WorkloadGenerator {
     private:
         void generateRandomValues(
@@ -95,6 +201,28 @@ struct WorkloadGenerator {
             return workloads; 
         }
 
+        /**
+         * Streaming counterpart of generateParallelWorkload. Each returned
+         * stream covers the same key range its thread would get there and is
+         * meant to be drained by that thread, so generation runs in parallel
+         */
+        std::vector<WorkloadStream> generateParallelStreams(
+            double percentInsert,
+            int64_t numOperations,
+            int numThreads,
+            uint64_t seed = 418
+        ) {
+            int64_t operationsPerThread = numOperations / numThreads;
+            std::vector<WorkloadStream> streams;
+
+            for(int i = 0; i < numThreads; i++) {
+                int64_t count = (i == numThreads-1) ? numOperations - operationsPerThread * (numThreads-1) : operationsPerThread;
+                streams.emplace_back(percentInsert, count, operationsPerThread * i, mix64(seed + i));
+            }
+
+            return streams;
+        }
+
 };
 }
 
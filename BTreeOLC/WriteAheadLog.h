@@ -0,0 +1,409 @@
+#pragma once
+
+/*
+ * Optional redo log for btreeolc. Every successful insert, update and
+ * remove appends a record to a buffer owned by the writing thread, while
+ * the leaf is still write locked, so records of one key are numbered in the
+ * order they were applied. A flusher thread collects all buffers every
+ * commitInterval, writes them in one call and syncs the file every
+ * syncEvery intervals. Threads that need their writes on disk wait in
+ * commit().
+ *
+ * Each round writes exactly the records numbered up to where the last round
+ * stopped and the sequence number read at its start, in order; later ones
+ * wait for the next round. The file is therefore always numbered 1, 2, 3
+ * and so on, and recovery replays its longest prefix without a gap, torn
+ * or corrupt record, with runs of inserts and updates going through
+ * insertBatch.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "BTreeOLC.h"
+#include "Ingest.h"
+
+namespace wal {
+
+    enum class RecordType : uint32_t { Insert = 1, Update = 2, Remove = 3 };
+
+    template<class Key, class Value>
+    struct Record {
+        uint64_t lsn;
+        Key key;
+        Value value;
+        RecordType type;
+        uint32_t checksum;
+
+        uint32_t computeChecksum() const {
+            uint64_t h = 14695981039346656037ULL;
+            auto mix = [&h](const void* data, size_t size) {
+                const unsigned char* bytes = static_cast<const unsigned char*>(data);
+                for (size_t i = 0; i < size; i++) {
+                    h = (h ^ bytes[i]) * 1099511628211ULL;
+                }
+            };
+            mix(&lsn, sizeof(lsn));
+            mix(&key, sizeof(key));
+            mix(&value, sizeof(value));
+            mix(&type, sizeof(type));
+            return (uint32_t)(h ^ (h >> 32));
+        }
+    };
+
+    struct Options {
+        std::chrono::microseconds commitInterval{1000}; // how long the flusher gathers records
+        unsigned syncEvery = 1;                         // commit intervals per fdatasync, 0 never syncs
+    };
+
+    inline uint64_t nextLogId() {
+        static std::atomic<uint64_t> id{0};
+        return ++id;
+    }
+
+    template<class Key, class Value>
+    struct Log {
+        typedef Record<Key, Value> LogRecord;
+
+        struct alignas(64) ThreadLog {
+            std::mutex lock;
+            std::vector<LogRecord> records;
+            uint64_t lastLsn = 0; // only used by the owner
+        };
+
+        const uint64_t id = nextLogId();
+        int fd = -1;
+        Options options;
+        std::atomic<uint64_t> lastLsn{0};    // last sequence number handed out
+        std::atomic<uint64_t> durableLsn{0}; // everything up to here is on disk
+        std::atomic<bool> failed{false};
+
+        std::mutex threadsLock;
+        std::vector<std::unique_ptr<ThreadLog>> threads;
+
+        std::thread flusher;
+        std::mutex flusherLock;
+        std::condition_variable flusherWake;
+        std::condition_variable durableWake;
+        bool stopping = false;
+        unsigned roundsSinceSync = 0;
+        std::vector<LogRecord> carried; // taken numbered past the last barrier, flusher only
+
+        ~Log() {
+            close();
+        }
+
+        /**
+         * Opens path for appending and starts the flusher. Sequence
+         * numbers continue after startLsn
+         */
+        bool open(const char* path, Options options_ = Options(), uint64_t startLsn = 0) {
+            fd = ::open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+            if (fd < 0) {
+                return false;
+            }
+            options = options_;
+            lastLsn = durableLsn = startLsn;
+            stopping = false;
+            flusher = std::thread([this]() { run(); });
+            return true;
+        }
+
+        /**
+         * Writes and syncs what is left and stops the flusher
+         */
+        void close() {
+            if (!flusher.joinable()) {
+                return;
+            }
+            {
+                std::lock_guard<std::mutex> guard(flusherLock);
+                stopping = true;
+            }
+            flusherWake.notify_all();
+            flusher.join();
+            ::close(fd);
+            fd = -1;
+        }
+
+        /**
+         * Logs one change. Call while the changed leaf is still locked
+         */
+        void append(RecordType type, Key k, Value v) {
+            ThreadLog& local = localLog();
+            std::lock_guard<std::mutex> guard(local.lock);
+            LogRecord record;
+            memset(&record, 0, sizeof(record));
+            record.lsn = lastLsn.fetch_add(1) + 1;
+            record.key = k;
+            record.value = v;
+            record.type = type;
+            record.checksum = record.computeChecksum();
+            local.records.push_back(record);
+            local.lastLsn = record.lsn;
+        }
+
+        /**
+         * Waits until lsn is on disk
+         * @return false if the log could not be written
+         */
+        bool waitDurable(uint64_t lsn) {
+            std::unique_lock<std::mutex> guard(flusherLock);
+            durableWake.wait(guard, [&]() { return durableLsn.load() >= lsn || failed || stopping; });
+            return durableLsn.load() >= lsn;
+        }
+
+        /**
+         * Waits until everything this thread logged is on disk
+         */
+        bool commit() {
+            return waitDurable(localLog().lastLsn);
+        }
+
+    private:
+        ThreadLog& localLog() {
+            static thread_local std::unordered_map<uint64_t, ThreadLog*> logs;
+            ThreadLog*& local = logs[id];
+            if (!local) {
+                std::lock_guard<std::mutex> guard(threadsLock);
+                threads.emplace_back(new ThreadLog());
+                local = threads.back().get();
+            }
+            return *local;
+        }
+
+        void run() {
+            std::unique_lock<std::mutex> guard(flusherLock);
+            bool last = false;
+            while (!last) {
+                flusherWake.wait_for(guard, options.commitInterval, [this]() { return stopping; });
+                last = stopping;
+                guard.unlock();
+                flush(last);
+                guard.lock();
+                durableWake.notify_all();
+            }
+        }
+
+        /**
+         * Writes the records of all threads up to the sequence number read
+         * first, in order. All of them are in the buffers taken now or
+         * carried over, since numbers are handed out under the buffer's
+         * lock. Records past it are carried to the next round: a buffer
+         * taken early may still miss lower numbers. Stops for good after a
+         * failed write, so the file never has gaps
+         */
+        void flush(bool sync) {
+            if (failed) {
+                return;
+            }
+            uint64_t barrier = lastLsn.load();
+            std::vector<LogRecord> batch;
+            batch.swap(carried);
+            std::vector<LogRecord> taken;
+            std::vector<ThreadLog*> logs;
+            {
+                std::lock_guard<std::mutex> guard(threadsLock);
+                for (auto& local : threads) {
+                    logs.push_back(local.get());
+                }
+            }
+            for (ThreadLog* local : logs) {
+                {
+                    std::lock_guard<std::mutex> guard(local->lock);
+                    taken.swap(local->records);
+                }
+                batch.insert(batch.end(), taken.begin(), taken.end());
+                taken.clear();
+            }
+            std::sort(batch.begin(), batch.end(),
+                [](const LogRecord& a, const LogRecord& b) { return a.lsn < b.lsn; });
+            auto past = std::find_if(batch.begin(), batch.end(),
+                [barrier](const LogRecord& record) { return record.lsn > barrier; });
+            carried.assign(past, batch.end());
+            batch.erase(past, batch.end());
+
+            const char* data = reinterpret_cast<const char*>(batch.data());
+            size_t left = batch.size() * sizeof(LogRecord);
+            while (left > 0) {
+                ssize_t written = ::write(fd, data, left);
+                if (written < 0) {
+                    failed = true;
+                    return;
+                }
+                data += written;
+                left -= written;
+            }
+
+            if (options.syncEvery == 0) {
+                durableLsn = barrier;
+                return;
+            }
+            if (durableLsn < barrier && (++roundsSinceSync >= options.syncEvery || sync)) {
+                if (fdatasync(fd) != 0) {
+                    failed = true;
+                    return;
+                }
+                roundsSinceSync = 0;
+                durableLsn = barrier;
+            }
+        }
+    };
+
+    struct RecoveryResult {
+        uint64_t records = 0; // records replayed
+        uint64_t lastLsn = 0;
+        size_t validBytes = 0; // length of the valid prefix of the file
+    };
+
+    /**
+     * Replays the log at path into tree. A torn or corrupt record or a gap
+     * in the sequence numbers ends the log, later records depend on the
+     * missing one. Runs of inserts and updates go through insertBatch in batches of
+     * batchSize, removes in between are applied one at a time
+     * @return false if path exists but cannot be read
+     */
+    template<class Tree>
+    bool recover(const char* path, Tree& tree, RecoveryResult& result, size_t batchSize = 4096) {
+        typedef typename Tree::KeyType Key;
+        typedef typename Tree::ValueType Value;
+        typedef Record<Key, Value> LogRecord;
+
+        result = RecoveryResult();
+        if (access(path, F_OK) != 0) {
+            return true;
+        }
+        ingest::MappedFile file;
+        if (!file.open(path)) {
+            return false;
+        }
+        const LogRecord* mapped = static_cast<const LogRecord*>(file.data);
+        size_t n = file.size / sizeof(LogRecord);
+        std::vector<LogRecord> records;
+        records.reserve(n);
+        for (size_t i = 0; i < n && mapped[i].lsn == i + 1 && mapped[i].checksum == mapped[i].computeChecksum(); i++) {
+            records.push_back(mapped[i]);
+        }
+        result.validBytes = records.size() * sizeof(LogRecord);
+
+        std::vector<Key> keys;
+        std::vector<Value> values;
+        auto applyBatch = [&]() {
+            tree.insertBatch(keys.data(), values.data(), keys.size());
+            keys.clear();
+            values.clear();
+        };
+        for (const LogRecord& record : records) {
+            if (record.type == RecordType::Remove) {
+                applyBatch();
+                tree.remove(record.key);
+            } else {
+                keys.push_back(record.key);
+                values.push_back(record.value);
+                if (keys.size() == batchSize) {
+                    applyBatch();
+                }
+            }
+        }
+        applyBatch();
+        result.records = records.size();
+        result.lastLsn = records.empty() ? 0 : records.back().lsn;
+        return true;
+    }
+
+    /**
+     * btreeolc::BTree whose changes go to a redo log. Changes go through
+     * writeLeaf so they are logged under the leaf lock, appends to the
+     * right-most leaf and combining are not used
+     */
+    template<class Key, class Value>
+    struct LoggedBTree {
+        typedef Key KeyType;
+        typedef Value ValueType;
+
+        btreeolc::BTree<Key, Value> tree;
+        Log<Key, Value> log;
+
+        /**
+         * Recovers the tree from the log at path, cuts off everything after
+         * the valid prefix and goes on logging to it
+         */
+        bool open(const char* path, Options options = Options(), RecoveryResult* recovered = nullptr) {
+            RecoveryResult result;
+            if (!recover(path, tree, result)) {
+                return false;
+            }
+            if (access(path, F_OK) == 0 && truncate(path, result.validBytes) != 0) {
+                return false;
+            }
+            if (recovered) {
+                *recovered = result;
+            }
+            return log.open(path, options, result.lastLsn);
+        }
+
+        void insert(Key k, Value v) {
+            tree.writeLeaf(k, true, nullptr, [&](btreeolc::BTreeLeaf<Key, Value>* leaf) {
+                leaf->insert(k, v);
+                log.append(RecordType::Insert, k, v);
+                return true;
+            });
+        }
+
+        bool update(Key k, Value v) {
+            return tree.writeLeaf(k, false, nullptr, [&](btreeolc::BTreeLeaf<Key, Value>* leaf) {
+                Value* current = leaf->payloadFor(k);
+                if (!current) {
+                    return false;
+                }
+                *current = v;
+                log.append(RecordType::Update, k, v);
+                return true;
+            });
+        }
+
+        bool remove(Key k) {
+            return tree.writeLeaf(k, false, nullptr, [&](btreeolc::BTreeLeaf<Key, Value>* leaf) {
+                if (!leaf->remove(k)) {
+                    return false;
+                }
+                log.append(RecordType::Remove, k, Value());
+                return true;
+            });
+        }
+
+        bool lookup(Key k, Value& result) {
+            return tree.lookup(k, result);
+        }
+
+        uint64_t scanEntries(Key k, int range, Key* keysOut, Value* valuesOut) {
+            return tree.scanEntries(k, range, keysOut, valuesOut);
+        }
+
+        /**
+         * Waits until this thread's changes are on disk
+         */
+        bool commit() {
+            return log.commit();
+        }
+
+        treeverify::VerifyResult verify(int numThreads = parallel::defaultThreads()) {
+            return tree.verify(numThreads);
+        }
+
+        treestats::TreeStats stats(int numThreads = parallel::defaultThreads()) {
+            return tree.stats(numThreads);
+        }
+    };
+}